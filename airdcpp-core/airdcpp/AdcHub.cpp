@@ -779,12 +779,14 @@ void AdcHub::handle(AdcCommand::GET, AdcCommand& c) noexcept {
 		if (m > 0) {
 			dcdebug("Creating bloom filter, k=" SIZET_FMT ", m=" SIZET_FMT ", h=" SIZET_FMT "\n", k, m, h);
 
-			HashBloom bloom;
-			bloom.reset(k, m, h);
-			ShareManager::getInstance()->getBloom(bloom);
-			if (SETTING(USE_PARTIAL_SHARING))
+			ShareManager::getInstance()->getBloom(v, k, m, h);
+			if (SETTING(USE_PARTIAL_SHARING)) {
+				// The queued files are merged with the bits that are set already
+				HashBloom bloom;
+				bloom.reset(k, m, h);
 				QueueManager::getInstance()->getBloom(bloom);
-			bloom.copy_to(v);
+				bloom.copy_to(v);
+			}
 		}
 		AdcCommand cmd(AdcCommand::CMD_SND, AdcCommand::TYPE_HUB);
 		cmd.addParam(c.getParam(0));
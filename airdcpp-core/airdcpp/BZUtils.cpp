@@ -21,6 +21,7 @@
 
 #include "Exception.h"
 #include "ResourceManager.h"
+#include "ScopedFunctor.h"
 
 namespace dcpp {
 	
@@ -65,6 +66,190 @@ bool BZFilter::operator()(const void* in, size_t& insize, void* out, size_t& out
 	}
 }
 
+// Input size of a single block
+// Needs to be small enough to fit in one bzip2 block even after the initial run-length encoding (which may expand the data by 25%)
+#define PARALLEL_BZ_BLOCK_SIZE 700000
+
+// Magic numbers of the bzip2 format (48 bits)
+#define BZ_EOS_MAGIC 0x177245385090ULL
+
+ParallelBZFilter::ParallelBZFilter(size_t aThreads) : maxBlocks(aThreads > 0 ? aThreads : max(std::thread::hardware_concurrency(), 1U)) {
+	input.reserve(PARALLEL_BZ_BLOCK_SIZE);
+
+	// Stream header (block size 900k)
+	putBits('B', 8);
+	putBits('Z', 8);
+	putBits('h', 8);
+	putBits('9', 8);
+}
+
+ParallelBZFilter::~ParallelBZFilter() {
+	// Wait for the running tasks
+	for (auto& b : blocks) {
+		try {
+			b.task->wait();
+		} catch (...) {
+		}
+	}
+}
+
+ParallelBZFilter::Block ParallelBZFilter::compressBlock(const string& aData) {
+	bz_stream zs;
+	memzero(&zs, sizeof(zs));
+
+	if (BZ2_bzCompressInit(&zs, 9, 0, 30) != BZ_OK) {
+		throw Exception(STRING(COMPRESSION_ERROR));
+	}
+
+	// Maximum size of the compressed data
+	Block ret;
+	ret.data.resize(aData.size() + aData.size() / 100 + 600);
+
+	zs.next_in = (char*)aData.data();
+	zs.avail_in = aData.size();
+	zs.next_out = &ret.data[0];
+	zs.avail_out = ret.data.size();
+
+	int err = ::BZ2_bzCompress(&zs, BZ_FINISH);
+	ret.data.resize(ret.data.size() - zs.avail_out);
+	BZ2_bzCompressEnd(&zs);
+
+	if (err != BZ_STREAM_END) {
+		throw Exception(STRING(COMPRESSION_ERROR));
+	}
+
+	// Locate the end-of-stream marker (followed by the combined CRC and 0-7 bits of padding)
+	auto readBits = [&ret](size_t aPos, int aBits) {
+		uint64_t value = 0;
+		for (int i = 0; i < aBits; ++i, ++aPos) {
+			value = (value << 1) | ((static_cast<uint8_t>(ret.data[aPos / 8]) >> (7 - aPos % 8)) & 1);
+		}
+		return value;
+	};
+
+	auto totalBits = ret.data.size() * 8;
+	for (size_t padding = 0; padding < 8; ++padding) {
+		if (totalBits < 32 + 80 + padding) {
+			break;
+		}
+
+		auto pos = totalBits - padding - 80;
+		if (readBits(pos, 48) == BZ_EOS_MAGIC) {
+			ret.endBit = pos;
+
+			// This is the CRC of our only block
+			ret.crc = static_cast<uint32_t>(readBits(pos + 48, 32));
+			return ret;
+		}
+	}
+
+	throw Exception(STRING(COMPRESSION_ERROR));
+}
+
+void ParallelBZFilter::startBlock() {
+	auto result = make_shared<PendingBlock::Result>();
+	result->input.swap(input);
+	input.reserve(PARALLEL_BZ_BLOCK_SIZE);
+
+	PendingBlock block;
+	block.result = result;
+	block.task.reset(new task_group());
+
+	block.task->run([result] {
+		ScopedFunctor([&result] { result->finished = true; });
+		result->block = compressBlock(result->input);
+		string().swap(result->input);
+	});
+
+	blocks.push_back(move(block));
+}
+
+void ParallelBZFilter::appendBlock(PendingBlock& aBlock) {
+	// Throws if the compression failed
+	aBlock.task->wait();
+	const auto& block = aBlock.result->block;
+
+	// Skip the stream header
+	auto data = reinterpret_cast<const uint8_t*>(block.data.data()) + 4;
+	auto bits = block.endBit - 32;
+
+	for (size_t i = 0; i < bits / 8; ++i) {
+		putBits(data[i], 8);
+	}
+
+	auto rest = static_cast<int>(bits % 8);
+	if (rest > 0) {
+		putBits(data[bits / 8] >> (8 - rest), rest);
+	}
+
+	combinedCrc = ((combinedCrc << 1) | (combinedCrc >> 31)) ^ block.crc;
+}
+
+void ParallelBZFilter::putBits(uint32_t aValue, int aBits) noexcept {
+	bitBuffer = (bitBuffer << aBits) | (aValue & ((1ULL << aBits) - 1));
+	bitCount += aBits;
+
+	while (bitCount >= 8) {
+		bitCount -= 8;
+		output += static_cast<char>((bitBuffer >> bitCount) & 0xFF);
+	}
+}
+
+void ParallelBZFilter::putTrailer() noexcept {
+	putBits(static_cast<uint32_t>(BZ_EOS_MAGIC >> 24), 24);
+	putBits(static_cast<uint32_t>(BZ_EOS_MAGIC & 0xFFFFFF), 24);
+	putBits(combinedCrc, 32);
+
+	// Pad to full bytes
+	if (bitCount > 0) {
+		putBits(0, 8 - bitCount);
+	}
+}
+
+bool ParallelBZFilter::operator()(const void* in, size_t& insize, void* out, size_t& outsize) {
+	if(outsize == 0)
+		return 0;
+
+	if (insize > 0) {
+		insize = min(insize, PARALLEL_BZ_BLOCK_SIZE - input.size());
+		input.append(static_cast<const char*>(in), insize);
+		if (input.size() == PARALLEL_BZ_BLOCK_SIZE) {
+			startBlock();
+		}
+	} else if (!finishing) {
+		if (!input.empty()) {
+			startBlock();
+		}
+
+		finishing = true;
+	}
+
+	// Add the compressed blocks in order (wait if there are too many of them or if there's no more input)
+	while (!blocks.empty() && (finishing || blocks.size() > maxBlocks || blocks.front().result->finished)) {
+		auto block = move(blocks.front());
+		blocks.pop_front();
+		appendBlock(block);
+	}
+
+	if (finishing && !finished && blocks.empty()) {
+		putTrailer();
+		finished = true;
+	}
+
+	// Return what we have
+	outsize = min(outsize, output.size() - outputPos);
+	memcpy(out, output.data() + outputPos, outsize);
+	outputPos += outsize;
+
+	if (outputPos == output.size()) {
+		output.clear();
+		outputPos = 0;
+		return !finished;
+	}
+
+	return true;
+}
+
 UnBZFilter::UnBZFilter() {
 	memzero(&zs, sizeof(zs));
 
@@ -21,6 +21,9 @@
 
 #include <bzlib.h>
 
+#include "typedefs.h"
+#include "concurrency.h"
+
 namespace dcpp {
 
 class BZFilter {
@@ -40,6 +43,64 @@ private:
 	bz_stream zs;
 };
 
+/* Compresses the data in independent blocks with the shared task threads. The blocks are combined
+   into a single bzip2 stream, so the result can be decompressed with UnBZFilter as usual. */
+class ParallelBZFilter {
+public:
+	// Maximum number of blocks in progress, uses the number of available cores by default
+	ParallelBZFilter(size_t aThreads = 0);
+	~ParallelBZFilter();
+	/**
+	* Compress data.
+	* @param in Input data
+	* @param insize Input size (Set to 0 to indicate that no more data will follow)
+	* @param out Output buffer
+	* @param outsize Output size, set to compressed size on return.
+	* @return True if there's more processing to be done.
+	*/
+	bool operator()(const void* in, size_t& insize, void* out, size_t& outsize);
+private:
+	struct Block {
+		string data; // Compressed bzip2 stream containing a single block
+		size_t endBit; // Start position of the end-of-stream marker
+		uint32_t crc;
+	};
+
+	struct PendingBlock {
+		struct Result {
+			string input;
+			Block block;
+			atomic<bool> finished { false };
+		};
+
+		shared_ptr<Result> result;
+
+		// Each block has its own group so that the blocks can be waited for in order
+		unique_ptr<task_group> task;
+	};
+
+	static Block compressBlock(const string& aData);
+	void startBlock();
+	void appendBlock(PendingBlock& aBlock);
+
+	void putBits(uint32_t aValue, int aBits) noexcept;
+	void putTrailer() noexcept;
+
+	string input;
+	deque<PendingBlock> blocks;
+	const size_t maxBlocks;
+
+	string output;
+	size_t outputPos = 0;
+
+	uint64_t bitBuffer = 0;
+	int bitCount = 0;
+	uint32_t combinedCrc = 0;
+
+	bool finishing = false;
+	bool finished = false;
+};
+
 class UnBZFilter {
 public:
 	UnBZFilter();
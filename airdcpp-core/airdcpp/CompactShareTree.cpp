@@ -0,0 +1,793 @@
+/*
+ * Copyright (C) 2011-2016 AirDC++ Project
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+#include "stdinc.h"
+#include "CompactShareTree.h"
+
+#include "AirUtil.h"
+#include "ClientManager.h"
+#include "LogManager.h"
+#include "ResourceManager.h"
+#include "SearchQuery.h"
+#include "SearchResult.h"
+#include "SettingsManager.h"
+#include "SimpleXML.h"
+#include "Streams.h"
+#include "Text.h"
+#include "UserConnection.h"
+#include "Util.h"
+
+#include "version.h"
+
+namespace dcpp {
+
+const uint32_t CompactShareTree::INVALID_INDEX;
+
+CompactShareTree::Builder::Builder() noexcept : tree(new CompactShareTree()) {
+	tree->nameOffsets.push_back(0);
+}
+
+uint32_t CompactShareTree::Builder::addName(const string& aName, const string& aNameLower) noexcept {
+	auto i = nameIds.find(aName);
+	if (i != nameIds.end()) {
+		return i->second;
+	}
+
+	auto id = static_cast<uint32_t>(tree->nameLowerLengths.size());
+	tree->nameArena += aNameLower;
+	if (aName != aNameLower) {
+		tree->nameArena += aName;
+	}
+
+	dcassert(tree->nameArena.size() < INVALID_INDEX);
+	tree->nameLowerLengths.push_back(static_cast<uint32_t>(aNameLower.size()));
+	tree->nameOffsets.push_back(static_cast<uint32_t>(tree->nameArena.size()));
+
+	nameIds.emplace(aName, id);
+	return id;
+}
+
+uint32_t CompactShareTree::Builder::addRoot(const string& aVirtualName, const string& aRealPath, uint64_t aLastWrite, const ProfileTokenSet& aProfiles) noexcept {
+	dcassert(nextDirectory == 0);
+
+	auto id = static_cast<uint32_t>(tree->dirName.size());
+	tree->dirName.push_back(addName(aVirtualName, Text::toLower(aVirtualName)));
+	tree->dirParent.push_back(INVALID_INDEX);
+	tree->dirLastWrite.push_back(aLastWrite);
+
+	tree->roots.push_back({ aRealPath, Text::toLower(Util::getLastDir(aRealPath)), aProfiles });
+	return id;
+}
+
+void CompactShareTree::Builder::openDirectory(uint32_t aDirectory) noexcept {
+	dcassert(aDirectory >= nextDirectory && aDirectory < tree->dirName.size());
+
+	// Directories that were skipped have no content
+	while (nextDirectory <= aDirectory) {
+		tree->dirFirstChild.push_back(static_cast<uint32_t>(tree->dirName.size()));
+		tree->dirFirstFile.push_back(static_cast<uint32_t>(tree->fileName.size()));
+		nextDirectory++;
+	}
+}
+
+uint32_t CompactShareTree::Builder::addDirectory(const string& aName, const string& aNameLower, uint64_t aLastWrite) noexcept {
+	dcassert(nextDirectory > 0);
+
+	auto id = static_cast<uint32_t>(tree->dirName.size());
+	tree->dirName.push_back(addName(aName, aNameLower));
+	tree->dirParent.push_back(nextDirectory - 1);
+	tree->dirLastWrite.push_back(aLastWrite);
+	return id;
+}
+
+void CompactShareTree::Builder::addFile(const string& aName, const string& aNameLower, int64_t aSize, uint64_t aLastWrite, const TTHValue& aTTH) noexcept {
+	dcassert(nextDirectory > 0);
+
+	tree->fileName.push_back(addName(aName, aNameLower));
+	tree->fileParent.push_back(nextDirectory - 1);
+	tree->fileSize.push_back(aSize);
+	tree->fileLastWrite.push_back(aLastWrite);
+	tree->fileTTH.push_back(aTTH);
+}
+
+unique_ptr<CompactShareTree> CompactShareTree::Builder::build() noexcept {
+	if (!tree->dirName.empty()) {
+		openDirectory(static_cast<uint32_t>(tree->dirName.size() - 1));
+	}
+
+	// End of the ranges of the last directory
+	tree->dirFirstChild.push_back(static_cast<uint32_t>(tree->dirName.size()));
+	tree->dirFirstFile.push_back(static_cast<uint32_t>(tree->fileName.size()));
+
+	auto& files = tree->fileTTH;
+	tree->tthIndex.resize(files.size());
+	iota(tree->tthIndex.begin(), tree->tthIndex.end(), 0);
+	sort(tree->tthIndex.begin(), tree->tthIndex.end(), [&files](uint32_t a, uint32_t b) { return files[a] < files[b]; });
+
+	tree->nameArena.shrink_to_fit();
+	tree->nameOffsets.shrink_to_fit();
+	tree->nameLowerLengths.shrink_to_fit();
+	tree->dirName.shrink_to_fit();
+	tree->dirParent.shrink_to_fit();
+	tree->dirFirstChild.shrink_to_fit();
+	tree->dirFirstFile.shrink_to_fit();
+	tree->dirLastWrite.shrink_to_fit();
+	tree->fileName.shrink_to_fit();
+	tree->fileParent.shrink_to_fit();
+	tree->fileSize.shrink_to_fit();
+	tree->fileLastWrite.shrink_to_fit();
+	tree->fileTTH.shrink_to_fit();
+
+	nameIds.clear();
+	return move(tree);
+}
+
+const char* CompactShareTree::getNameLower(uint32_t aName, size_t& length_) const noexcept {
+	length_ = nameLowerLengths[aName];
+	return nameArena.data() + nameOffsets[aName];
+}
+
+void CompactShareTree::getNameLower(uint32_t aName, string& name_) const noexcept {
+	size_t length = 0;
+	auto name = getNameLower(aName, length);
+	name_.assign(name, length);
+}
+
+string CompactShareTree::getName(uint32_t aName) const noexcept {
+	auto start = nameOffsets[aName];
+	auto end = nameOffsets[aName + 1];
+	if (end - start > nameLowerLengths[aName]) {
+		// Normal name is stored separately
+		start += nameLowerLengths[aName];
+	}
+
+	return string(nameArena.data() + start, end - start);
+}
+
+int CompactShareTree::compareNameLower(uint32_t aName, const string& aNameLower) const noexcept {
+	// Same as string::compare
+	size_t length = 0;
+	auto name = getNameLower(aName, length);
+	auto res = char_traits<char>::compare(name, aNameLower.data(), min(length, aNameLower.size()));
+	if (res != 0) {
+		return res;
+	}
+
+	return length < aNameLower.size() ? -1 : length > aNameLower.size() ? 1 : 0;
+}
+
+string CompactShareTree::getADCPath(uint32_t aDirectory) const noexcept {
+	string ret = "/";
+	for (auto d = aDirectory; d != INVALID_INDEX; d = dirParent[d]) {
+		ret.insert(1, getName(dirName[d]) + '/');
+	}
+
+	return ret;
+}
+
+string CompactShareTree::getFullName(uint32_t aDirectory) const noexcept {
+	string ret;
+	for (auto d = aDirectory; d != INVALID_INDEX; d = dirParent[d]) {
+		ret.insert(0, getName(dirName[d]) + '\\');
+	}
+
+	return ret;
+}
+
+string CompactShareTree::getRealPath(uint32_t aDirectory) const noexcept {
+	string ret;
+	auto d = aDirectory;
+	for (; dirParent[d] != INVALID_INDEX; d = dirParent[d]) {
+		ret.insert(0, getName(dirName[d]) + PATH_SEPARATOR);
+	}
+
+	return roots[d].realPath + ret;
+}
+
+size_t CompactShareTree::getRoot(uint32_t aDirectory) const noexcept {
+	auto d = aDirectory;
+	while (dirParent[d] != INVALID_INDEX) {
+		d = dirParent[d];
+	}
+
+	return d;
+}
+
+bool CompactShareTree::hasProfile(size_t aRoot, const OptionalProfileToken& aProfile) const noexcept {
+	return !aProfile || roots[aRoot].profiles.find(*aProfile) != roots[aRoot].profiles.end();
+}
+
+void CompactShareTree::getRoots(const OptionalProfileToken& aProfile, vector<uint32_t>& dirs_) const noexcept {
+	for (size_t i = 0; i < roots.size(); ++i) {
+		if (hasProfile(i, aProfile)) {
+			dirs_.push_back(static_cast<uint32_t>(i));
+		}
+	}
+}
+
+void CompactShareTree::getRootsByVirtual(const string& aVirtualName, const OptionalProfileToken& aProfile, vector<uint32_t>& dirs_) const noexcept {
+	for (size_t i = 0; i < roots.size(); ++i) {
+		if (hasProfile(i, aProfile) && Util::stricmp(getName(dirName[i]), aVirtualName) == 0) {
+			dirs_.push_back(static_cast<uint32_t>(i));
+		}
+	}
+}
+
+uint32_t CompactShareTree::findChild(uint32_t aDirectory, const string& aNameLower) const noexcept {
+	auto begin = dirFirstChild[aDirectory], end = dirFirstChild[aDirectory + 1];
+	while (begin < end) {
+		auto mid = begin + (end - begin) / 2;
+		auto res = compareNameLower(dirName[mid], aNameLower);
+		if (res == 0) {
+			return mid;
+		}
+
+		if (res < 0) {
+			begin = mid + 1;
+		} else {
+			end = mid;
+		}
+	}
+
+	return INVALID_INDEX;
+}
+
+bool CompactShareTree::hasFile(uint32_t aDirectory, const string& aNameLower) const noexcept {
+	auto begin = dirFirstFile[aDirectory], end = dirFirstFile[aDirectory + 1];
+	while (begin < end) {
+		auto mid = begin + (end - begin) / 2;
+		auto res = compareNameLower(fileName[mid], aNameLower);
+		if (res == 0) {
+			return true;
+		}
+
+		if (res < 0) {
+			begin = mid + 1;
+		} else {
+			end = mid;
+		}
+	}
+
+	return false;
+}
+
+void CompactShareTree::findVirtuals(const string& aVirtualPath, const OptionalProfileToken& aProfile, vector<uint32_t>& dirs_) const throw(ShareException) {
+	if (aVirtualPath.empty() || aVirtualPath[0] != '/') {
+		throw ShareException(UserConnection::FILE_NOT_AVAILABLE);
+	}
+
+	auto start = aVirtualPath.find('/', 1);
+	if (start == string::npos || start == 1) {
+		throw ShareException(UserConnection::FILE_NOT_AVAILABLE);
+	}
+
+	// Several roots may have the same virtual name
+	vector<uint32_t> virtuals;
+	getRootsByVirtual(aVirtualPath.substr(1, start - 1), aProfile, virtuals);
+	if (virtuals.empty()) {
+		throw ShareException(UserConnection::FILE_NOT_AVAILABLE);
+	}
+
+	for (auto d : virtuals) {
+		auto i = start;
+		auto j = i + 1;
+		while ((i = aVirtualPath.find('/', j)) != string::npos) {
+			d = findChild(d, Text::toLower(aVirtualPath.substr(j, i - j)));
+			j = i + 1;
+			if (d == INVALID_INDEX) {
+				break;
+			}
+		}
+
+		if (d != INVALID_INDEX) {
+			dirs_.push_back(d);
+		}
+	}
+
+	if (dirs_.empty()) {
+		throw ShareException(UserConnection::FILE_NOT_AVAILABLE);
+	}
+}
+
+int64_t CompactShareTree::getSize(uint32_t aDirectory) const noexcept {
+	int64_t ret = 0;
+	for (auto f = dirFirstFile[aDirectory]; f < dirFirstFile[aDirectory + 1]; ++f) {
+		ret += fileSize[f];
+	}
+
+	for (auto d = dirFirstChild[aDirectory]; d < dirFirstChild[aDirectory + 1]; ++d) {
+		ret += getSize(d);
+	}
+
+	return ret;
+}
+
+void CompactShareTree::getContentInfo(uint32_t aDirectory, int64_t& size_, size_t& files_, size_t& folders_) const noexcept {
+	for (auto d = dirFirstChild[aDirectory]; d < dirFirstChild[aDirectory + 1]; ++d) {
+		getContentInfo(d, size_, files_, folders_);
+	}
+
+	for (auto f = dirFirstFile[aDirectory]; f < dirFirstFile[aDirectory + 1]; ++f) {
+		size_ += fileSize[f];
+	}
+
+	folders_ += dirFirstChild[aDirectory + 1] - dirFirstChild[aDirectory];
+	files_ += dirFirstFile[aDirectory + 1] - dirFirstFile[aDirectory];
+}
+
+size_t CompactShareTree::getMemoryUsage() const noexcept {
+	size_t ret = sizeof(CompactShareTree) + nameArena.capacity();
+	ret += (nameOffsets.capacity() + nameLowerLengths.capacity()) * sizeof(uint32_t);
+	ret += (dirName.capacity() + dirParent.capacity() + dirFirstChild.capacity() + dirFirstFile.capacity()) * sizeof(uint32_t);
+	ret += dirLastWrite.capacity() * sizeof(uint64_t);
+	ret += (fileName.capacity() + fileParent.capacity() + tthIndex.capacity()) * sizeof(uint32_t);
+	ret += fileSize.capacity() * sizeof(int64_t) + fileLastWrite.capacity() * sizeof(uint64_t) + fileTTH.capacity() * sizeof(TTHValue);
+
+	ret += roots.capacity() * sizeof(Root);
+	for (const auto& r : roots) {
+		ret += r.realPath.capacity() + r.realNameLower.capacity() + r.profiles.size() * sizeof(ProfileToken);
+	}
+
+	return ret;
+}
+
+
+// Keeps the best results up to the maximum result count (same ranking as with the normal share tree)
+class CompactShareTree::ResultSet {
+public:
+	struct Result {
+		Result(uint32_t aIndex, bool aDirectory, double aScores) : index(aIndex), directory(aDirectory), scores(aScores) { }
+
+		uint32_t index;
+		bool directory;
+		double scores;
+		size_t order = 0;
+	};
+
+	ResultSet(const CompactShareTree& aTree, const SearchQuery& aSearch) noexcept : tree(aTree), maxResults(aSearch.maxResults), addParents(aSearch.addParents) { }
+
+	bool accepts(double aScores) const noexcept { return heap.size() < maxResults || (maxResults > 0 && aScores > heap.front().scores); }
+
+	void insert(Result&& aResult) noexcept {
+		dcassert(accepts(aResult.scores));
+
+		auto dupe = findDuplicate(aResult);
+		if (dupe != heap.end()) {
+			// Keep the one with the best scores
+			if (aResult.scores > dupe->scores) {
+				aResult.order = inserted++;
+				*dupe = move(aResult);
+				make_heap(heap.begin(), heap.end(), Sort());
+			}
+
+			return;
+		}
+
+		aResult.order = inserted++;
+		if (heap.size() == maxResults) {
+			// Drop the lowest ranked item
+			pop_heap(heap.begin(), heap.end(), Sort());
+			heap.back() = move(aResult);
+		} else {
+			heap.push_back(move(aResult));
+		}
+
+		push_heap(heap.begin(), heap.end(), Sort());
+	}
+
+	// Results in descending order of scores
+	vector<Result> takeSorted() noexcept {
+		sort_heap(heap.begin(), heap.end(), Sort());
+
+		vector<Result> ret;
+		ret.swap(heap);
+		return ret;
+	}
+private:
+	struct Sort {
+		bool operator()(const Result& left, const Result& right) const {
+			return left.scores > right.scores || (left.scores == right.scores && left.order < right.order);
+		}
+	};
+
+	// Directories with the same virtual path are combined into a single result
+	vector<Result>::iterator findDuplicate(const Result& aResult) noexcept {
+		if (!aResult.directory) {
+			return heap.end();
+		}
+
+		auto getResultPath = [this](uint32_t aDirectory) {
+			return addParents ? Util::getNmdcParentDir(tree.getFullName(aDirectory)) : tree.getFullName(aDirectory);
+		};
+
+		string nameLower;
+		tree.getNameLower(tree.dirName[aResult.index], nameLower);
+
+		optional<string> path;
+		for (auto i = heap.begin(); i != heap.end(); ++i) {
+			if (!i->directory || (!addParents && tree.compareNameLower(tree.dirName[i->index], nameLower) != 0)) {
+				continue;
+			}
+
+			if (!path) {
+				path = getResultPath(aResult.index);
+			}
+
+			if (getResultPath(i->index) == *path) {
+				return i;
+			}
+		}
+
+		return heap.end();
+	}
+
+	const CompactShareTree& tree;
+	vector<Result> heap;
+	size_t inserted = 0;
+
+	const size_t maxResults;
+	const bool addParents;
+};
+
+// Names are copied in reused strings because the matching functions take strings
+struct CompactShareTree::SearchBuffers {
+	// Directory names of each level (the parent names must stay valid while the children are searched)
+	deque<string> directoryNames;
+	string fileName;
+};
+
+void CompactShareTree::search(SearchResultList& results_, SearchQuery& aSearch, const OptionalProfileToken& aProfile, const string& aDir) const throw(ShareException) {
+	if (aSearch.root) {
+		struct TTHCompare {
+			bool operator()(uint32_t a, const TTHValue& b) const { return files[a] < b; }
+			bool operator()(const TTHValue& a, uint32_t b) const { return a < files[b]; }
+			const vector<TTHValue>& files;
+		};
+
+		auto i = equal_range(tthIndex.begin(), tthIndex.end(), *aSearch.root, TTHCompare({ fileTTH }));
+
+		for (auto f = i.first; f != i.second; ++f) {
+			auto parent = fileParent[*f];
+			if (hasProfile(getRoot(parent), aProfile) && AirUtil::isParentOrExactAdc(aDir, getADCPath(parent) + getName(fileName[*f]))) {
+				addFileResult(*f, results_, aSearch.addParents);
+				return;
+			}
+		}
+
+		return;
+	}
+
+	vector<uint32_t> dirs;
+	if (aDir == "/" || aDir.empty()) {
+		getRoots(aProfile, dirs);
+	} else {
+		findVirtuals(aDir, aProfile, dirs);
+	}
+
+	ResultSet resultSet(*this, aSearch);
+	SearchBuffers buffers;
+	for (auto d : dirs) {
+		searchDirectory(resultSet, aSearch, d, 0, buffers);
+	}
+
+	for (const auto& r : resultSet.takeSorted()) {
+		if (r.directory) {
+			addDirectoryResult(r.index, results_, aProfile, aSearch);
+		} else {
+			addFileResult(r.index, results_, aSearch.addParents);
+		}
+	}
+}
+
+void CompactShareTree::searchDirectory(ResultSet& results_, SearchQuery& aSearch, uint32_t aDirectory, int aLevel, SearchBuffers& buffers_) const noexcept {
+	if (buffers_.directoryNames.size() <= static_cast<size_t>(aLevel)) {
+		buffers_.directoryNames.resize(aLevel + 1);
+	}
+
+	auto& nameLower = buffers_.directoryNames[aLevel];
+	getNameLower(dirName[aDirectory], nameLower);
+	if (aSearch.isExcludedLower(nameLower)) {
+		return;
+	}
+
+	auto old = aSearch.recursion;
+
+	unique_ptr<SearchQuery::Recursion> rec = nullptr;
+
+	// Find any matches in the directory name
+	if (aSearch.matchesAnyDirectoryLower(nameLower)) {
+		bool positionsComplete = aSearch.positionsComplete();
+		if (aSearch.itemType != SearchQuery::TYPE_FILE && positionsComplete && aSearch.gt == 0 && aSearch.matchesDate(dirLastWrite[aDirectory])) {
+			// Full match (roots are ranked by their real names)
+			auto scores = SearchQuery::getRelevanceScore(aSearch, aLevel, true, dirParent[aDirectory] == INVALID_INDEX ? roots[aDirectory].realNameLower : nameLower);
+			if (results_.accepts(scores)) {
+				results_.insert(ResultSet::Result(aDirectory, true, scores));
+			}
+		}
+
+		if (aSearch.matchType == Search::MATCH_PATH_PARTIAL && aSearch.isValidRecursion(positionsComplete)) {
+			rec.reset(new SearchQuery::Recursion(aSearch, nameLower));
+			aSearch.recursion = rec.get();
+		}
+	}
+
+	// Moving up
+	if (aSearch.recursion) {
+		aSearch.recursion->increase(nameLower.length());
+	}
+
+	// Match files
+	if (aSearch.itemType != SearchQuery::TYPE_DIRECTORY) {
+		auto& fileNameLower = buffers_.fileName;
+		for (auto f = dirFirstFile[aDirectory]; f < dirFirstFile[aDirectory + 1]; ++f) {
+			getNameLower(fileName[f], fileNameLower);
+			if (!aSearch.matchesFileLower(fileNameLower, fileSize[f], fileLastWrite[f])) {
+				continue;
+			}
+
+			auto scores = SearchQuery::getRelevanceScore(aSearch, aLevel + 1, false, fileNameLower);
+			if (results_.accepts(scores)) {
+				results_.insert(ResultSet::Result(f, false, scores));
+			}
+
+			if (aSearch.addParents)
+				break;
+		}
+	}
+
+	// Match directories
+	for (auto d = dirFirstChild[aDirectory]; d < dirFirstChild[aDirectory + 1]; ++d) {
+		searchDirectory(results_, aSearch, d, aLevel + 1, buffers_);
+	}
+
+	// Moving to a lower level
+	if (aSearch.recursion) {
+		aSearch.recursion->decrease(nameLower.length());
+	}
+
+	aSearch.recursion = old;
+}
+
+void CompactShareTree::addDirectoryResult(uint32_t aDirectory, SearchResultList& results_, const OptionalProfileToken& aProfile, SearchQuery& aSearch) const noexcept {
+	const string path = aSearch.addParents ? Util::getNmdcParentDir(getFullName(aDirectory)) : getFullName(aDirectory);
+
+	// Have we added it already?
+	auto p = find_if(results_.begin(), results_.end(), [&path](const SearchResultPtr& sr) { return sr->getPath() == path; });
+	if (p != results_.end())
+		return;
+
+	// Get all directories with this path
+	vector<uint32_t> dirs;
+
+	try {
+		findVirtuals(Util::toAdcFile(path), aProfile, dirs);
+	} catch (...) {
+		dcassert(path.empty());
+	}
+
+	// Count date and content information
+	uint64_t date = 0;
+	int64_t size = 0;
+	size_t files = 0, folders = 0;
+	for (auto d : dirs) {
+		getContentInfo(d, size, files, folders);
+		date = max(date, dirLastWrite[d]);
+	}
+
+	if (aSearch.matchesDate(date)) {
+		SearchResultPtr sr(new SearchResult(SearchResult::TYPE_DIRECTORY, size, path, TTHValue(), date, files, folders));
+		results_.push_back(sr);
+	}
+}
+
+void CompactShareTree::addFileResult(uint32_t aFile, SearchResultList& results_, bool aAddParent) const noexcept {
+	auto parent = fileParent[aFile];
+	if (aAddParent) {
+		SearchResultPtr sr(new SearchResult(getFullName(parent)));
+		results_.push_back(sr);
+	} else {
+		SearchResultPtr sr(new SearchResult(SearchResult::TYPE_FILE,
+			fileSize[aFile], getFullName(parent) + getName(fileName[aFile]), fileTTH[aFile], fileLastWrite[aFile], 1));
+		results_.push_back(sr);
+	}
+}
+
+
+// Directories of the file list (share directories with the same virtual path are merged)
+struct CompactShareTree::ListDirectory {
+	typedef unordered_map<string*, ListDirectory*, noCaseStringHash, noCaseStringEq> ListDirectoryMap;
+
+	ListDirectory(const string& aName, int64_t aSize, uint64_t aDate) : name(aName), size(aSize), date(aDate) { }
+	~ListDirectory() {
+		for_each(listDirs | map_values, DeleteFunction());
+	}
+
+	vector<uint32_t> shareDirs;
+
+	string name;
+	int64_t size;
+	uint64_t date;
+	ListDirectoryMap listDirs;
+};
+
+void CompactShareTree::toFileList(OutputStream& os_, const string& aVirtualPath, const OptionalProfileToken& aProfile, bool aRecursive) const {
+	ListDirectory listRoot(Util::emptyString, 0, 0);
+	vector<uint32_t> childDirectories;
+
+	// Get the directories
+	if (aVirtualPath == "/") {
+		getRoots(aProfile, childDirectories);
+	} else {
+		try {
+			// We need to save the root directories as well for listing the files directly inside them
+			findVirtuals(aVirtualPath, aProfile, listRoot.shareDirs);
+		} catch (...) {
+			return;
+		}
+
+		for (auto d : listRoot.shareDirs) {
+			for (auto c = dirFirstChild[d]; c < dirFirstChild[d + 1]; ++c) {
+				childDirectories.push_back(c);
+			}
+
+			listRoot.date = max(listRoot.date, dirLastWrite[d]);
+		}
+	}
+
+	// Prepare the data
+	for (auto d : childDirectories) {
+		toListDirectory(d, listRoot, aRecursive);
+		listRoot.date = max(listRoot.date, dirLastWrite[d]); // In case the date is not set yet
+	}
+
+	// Write the XML
+	string tmp, indent = "\t";
+
+	os_.write(SimpleXML::utf8Header);
+	os_.write("<FileListing Version=\"1\" CID=\"" + ClientManager::getInstance()->getMe()->getCID().toBase32() +
+		"\" Base=\"" + SimpleXML::escape(aVirtualPath, tmp, false) +
+		"\" BaseDate=\"" + Util::toString(listRoot.date) +
+		"\" Generator=\"" + shortVersionString + "\">\r\n");
+
+	for (const auto ld : listRoot.listDirs | map_values) {
+		listToXml(*ld, os_, indent, tmp, aRecursive);
+	}
+	filesToXml(listRoot, os_, indent, tmp, !aRecursive);
+
+	os_.write("</FileListing>");
+}
+
+void CompactShareTree::toListDirectory(uint32_t aDirectory, ListDirectory& aParent, bool aRecursive) const noexcept {
+	string nameLower;
+	getNameLower(dirName[aDirectory], nameLower);
+
+	ListDirectory* listDir = nullptr;
+	auto pos = aParent.listDirs.find(&nameLower);
+	if (pos != aParent.listDirs.end()) {
+		listDir = pos->second;
+		if (!aRecursive) {
+			listDir->size += getSize(aDirectory);
+		}
+
+		listDir->date = max(listDir->date, dirLastWrite[aDirectory]);
+	} else {
+		listDir = new ListDirectory(getName(dirName[aDirectory]), aRecursive ? 0 : getSize(aDirectory), dirLastWrite[aDirectory]);
+		aParent.listDirs.emplace(&listDir->name, listDir);
+	}
+
+	listDir->shareDirs.push_back(aDirectory);
+
+	if (aRecursive) {
+		for (auto d = dirFirstChild[aDirectory]; d < dirFirstChild[aDirectory + 1]; ++d) {
+			toListDirectory(d, *listDir, aRecursive);
+		}
+	}
+}
+
+#define LITERAL(n) n, sizeof(n)-1
+void CompactShareTree::listToXml(const ListDirectory& aDirectory, OutputStream& xmlFile, string& indent, string& tmp2, bool aRecursive) const {
+	xmlFile.write(indent);
+	xmlFile.write(LITERAL("<Directory Name=\""));
+	xmlFile.write(SimpleXML::escape(aDirectory.name, tmp2, true));
+	if (!aRecursive) {
+		xmlFile.write(LITERAL("\" Size=\""));
+		xmlFile.write(Util::toString(aDirectory.size));
+	}
+	xmlFile.write(LITERAL("\" Date=\""));
+	xmlFile.write(Util::toString(aDirectory.date));
+
+	if (aRecursive) {
+		xmlFile.write(LITERAL("\">\r\n"));
+
+		indent += '\t';
+		for (const auto& d : aDirectory.listDirs | map_values) {
+			listToXml(*d, xmlFile, indent, tmp2, aRecursive);
+		}
+
+		filesToXml(aDirectory, xmlFile, indent, tmp2, !aRecursive);
+
+		indent.erase(indent.length() - 1);
+		xmlFile.write(indent);
+		xmlFile.write(LITERAL("</Directory>\r\n"));
+	} else {
+		const auto& shareDirs = aDirectory.shareDirs;
+		bool hasDirs = any_of(shareDirs.begin(), shareDirs.end(), [this](uint32_t d) { return dirFirstChild[d] != dirFirstChild[d + 1]; });
+		if (!hasDirs && all_of(shareDirs.begin(), shareDirs.end(), [this](uint32_t d) { return dirFirstFile[d] == dirFirstFile[d + 1]; })) {
+			xmlFile.write(LITERAL("\" />\r\n"));
+		} else {
+			xmlFile.write(LITERAL("\" Incomplete=\"1\""));
+			if (hasDirs) {
+				xmlFile.write(LITERAL(" Children=\"1\""));
+			}
+			xmlFile.write(LITERAL("/>\r\n"));
+		}
+	}
+}
+
+void CompactShareTree::filesToXml(const ListDirectory& aDirectory, OutputStream& xmlFile, string& indent, string& tmp2, bool addDate) const {
+	const auto& shareDirs = aDirectory.shareDirs;
+
+	bool filesAdded = false;
+	int dupeFiles = 0;
+	string nameLower;
+	for (auto di = shareDirs.begin(); di != shareDirs.end(); ++di) {
+		auto first = dirFirstFile[*di], last = dirFirstFile[*di + 1];
+		if (filesAdded) {
+			for (auto f = first; f < last; ++f) {
+				//go through the dirs that we have added already
+				getNameLower(fileName[f], nameLower);
+				if (none_of(shareDirs.begin(), di, [&](uint32_t d) { return hasFile(d, nameLower); })) {
+					fileToXml(f, xmlFile, indent, tmp2, addDate);
+				} else {
+					dupeFiles++;
+				}
+			}
+		} else if (first != last) {
+			filesAdded = true;
+			for (auto f = first; f < last; ++f)
+				fileToXml(f, xmlFile, indent, tmp2, addDate);
+		}
+	}
+
+	if (dupeFiles > 0 && SETTING(FL_REPORT_FILE_DUPES) && shareDirs.size() > 1) {
+		StringList paths;
+		for (auto d : shareDirs)
+			paths.push_back(getRealPath(d));
+
+		LogManager::getInstance()->message(STRING_F(DUPLICATE_FILES_DETECTED, dupeFiles % Util::toString(", ", paths)), LogMessage::SEV_WARNING);
+	}
+}
+
+void CompactShareTree::fileToXml(uint32_t aFile, OutputStream& xmlFile, string& indent, string& tmp2, bool addDate) const {
+	xmlFile.write(indent);
+	xmlFile.write(LITERAL("<File Name=\""));
+	xmlFile.write(SimpleXML::escape(getName(fileName[aFile]), tmp2, true));
+	xmlFile.write(LITERAL("\" Size=\""));
+	xmlFile.write(Util::toString(fileSize[aFile]));
+	xmlFile.write(LITERAL("\" TTH=\""));
+	tmp2.clear();
+	xmlFile.write(fileTTH[aFile].toBase32(tmp2));
+
+	if (addDate) {
+		xmlFile.write(LITERAL("\" Date=\""));
+		xmlFile.write(Util::toString(fileLastWrite[aFile]));
+	}
+	xmlFile.write(LITERAL("\"/>\r\n"));
+}
+
+} // namespace dcpp
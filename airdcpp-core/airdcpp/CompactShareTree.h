@@ -0,0 +1,160 @@
+/*
+ * Copyright (C) 2011-2016 AirDC++ Project
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+#ifndef DCPLUSPLUS_DCPP_COMPACT_SHARE_TREE_H
+#define DCPLUSPLUS_DCPP_COMPACT_SHARE_TREE_H
+
+#include "typedefs.h"
+
+#include "Exception.h"
+#include "MerkleTree.h"
+
+namespace dcpp {
+
+class OutputStream;
+class SearchQuery;
+
+/* Immutable share tree stored as contiguous arrays (struct of arrays) instead of individually allocated nodes.
+   Directories and files are referenced by their indexes. The children of a directory are stored next to each other
+   (breadth-first order), so the subdirectories and files of a directory are index ranges sorted by the lowercase name.
+   Names are interned in a single arena; the normal name is stored only if it differs from the lowercase one.
+   The tree is built from the share with ShareManager::buildCompactTree and it isn't updated afterwards. */
+
+class CompactShareTree {
+public:
+	// Adds the content in breadth-first order
+	// The roots are added first, after which the content of each directory is added after calling openDirectory
+	// for it (the directories must be opened in the same order as they were added)
+	class Builder {
+	public:
+		Builder() noexcept;
+
+		uint32_t addRoot(const string& aVirtualName, const string& aRealPath, uint64_t aLastWrite, const ProfileTokenSet& aProfiles) noexcept;
+
+		// The following directories and files will be added in this directory
+		void openDirectory(uint32_t aDirectory) noexcept;
+
+		// Items must be added in the order of their lowercase names
+		uint32_t addDirectory(const string& aName, const string& aNameLower, uint64_t aLastWrite) noexcept;
+		void addFile(const string& aName, const string& aNameLower, int64_t aSize, uint64_t aLastWrite, const TTHValue& aTTH) noexcept;
+
+		// The builder can't be used after this
+		unique_ptr<CompactShareTree> build() noexcept;
+	private:
+		uint32_t addName(const string& aName, const string& aNameLower) noexcept;
+
+		unique_ptr<CompactShareTree> tree;
+		unordered_map<string, uint32_t> nameIds;
+		uint32_t nextDirectory = 0;
+	};
+
+	// Search the directories of the wanted profile under the virtual path ("/" searches all roots)
+	// The results are returned in the same format as by ShareManager::adcSearch (no temp shares)
+	void search(SearchResultList& results_, SearchQuery& aSearch, const OptionalProfileToken& aProfile, const string& aDir) const throw(ShareException);
+
+	// Write a full or partial file list of the virtual path
+	// The output is identical to the list generated by ShareManager::toFilelist
+	void toFileList(OutputStream& os_, const string& aVirtualPath, const OptionalProfileToken& aProfile, bool aRecursive) const;
+
+	// Get the directories matching the virtual path (root path is not accepted here)
+	// Throws if no directories were found
+	void findVirtuals(const string& aVirtualPath, const OptionalProfileToken& aProfile, vector<uint32_t>& dirs_) const throw(ShareException);
+
+	string getADCPath(uint32_t aDirectory) const noexcept;
+	string getFullName(uint32_t aDirectory) const noexcept;
+	string getRealPath(uint32_t aDirectory) const noexcept;
+
+	size_t getDirectoryCount() const noexcept { return dirName.size(); }
+	size_t getFileCount() const noexcept { return fileName.size(); }
+
+	// Memory allocated for the arrays (including the unused capacity)
+	size_t getMemoryUsage() const noexcept;
+
+	CompactShareTree(CompactShareTree&) = delete;
+	CompactShareTree& operator=(CompactShareTree&) = delete;
+private:
+	CompactShareTree() noexcept { }
+
+	// The index of a root entry is the same as the index of its directory
+	struct Root {
+		string realPath;
+		string realNameLower;
+		ProfileTokenSet profiles;
+	};
+
+	class ResultSet;
+	struct SearchBuffers;
+	struct ListDirectory;
+
+	// Parent of the roots (or a directory that wasn't found)
+	static const uint32_t INVALID_INDEX = static_cast<uint32_t>(-1);
+
+	// Name arena
+	string nameArena;
+	vector<uint32_t> nameOffsets; // Includes the end offset of the last name
+	vector<uint32_t> nameLowerLengths; // The normal name follows the lowercase one if they differ
+
+	// Directories (index ranges of the children end where the ranges of the next directory begin)
+	vector<uint32_t> dirName;
+	vector<uint32_t> dirParent;
+	vector<uint32_t> dirFirstChild; // Includes the directory count after the last directory
+	vector<uint32_t> dirFirstFile; // Includes the file count after the last directory
+	vector<uint64_t> dirLastWrite;
+
+	// Files
+	vector<uint32_t> fileName;
+	vector<uint32_t> fileParent;
+	vector<int64_t> fileSize;
+	vector<uint64_t> fileLastWrite;
+	vector<TTHValue> fileTTH;
+
+	// File indexes sorted by TTH
+	vector<uint32_t> tthIndex;
+
+	vector<Root> roots;
+
+	const char* getNameLower(uint32_t aName, size_t& length_) const noexcept;
+	string getName(uint32_t aName) const noexcept;
+	void getNameLower(uint32_t aName, string& name_) const noexcept;
+	int compareNameLower(uint32_t aName, const string& aNameLower) const noexcept;
+
+	// Index of the root entry
+	size_t getRoot(uint32_t aDirectory) const noexcept;
+	bool hasProfile(size_t aRoot, const OptionalProfileToken& aProfile) const noexcept;
+
+	void getRoots(const OptionalProfileToken& aProfile, vector<uint32_t>& dirs_) const noexcept;
+	void getRootsByVirtual(const string& aVirtualName, const OptionalProfileToken& aProfile, vector<uint32_t>& dirs_) const noexcept;
+	uint32_t findChild(uint32_t aDirectory, const string& aNameLower) const noexcept;
+	bool hasFile(uint32_t aDirectory, const string& aNameLower) const noexcept;
+
+	int64_t getSize(uint32_t aDirectory) const noexcept;
+	void getContentInfo(uint32_t aDirectory, int64_t& size_, size_t& files_, size_t& folders_) const noexcept;
+
+	void searchDirectory(ResultSet& results_, SearchQuery& aSearch, uint32_t aDirectory, int aLevel, SearchBuffers& buffers_) const noexcept;
+	void addDirectoryResult(uint32_t aDirectory, SearchResultList& results_, const OptionalProfileToken& aProfile, SearchQuery& aSearch) const noexcept;
+	void addFileResult(uint32_t aFile, SearchResultList& results_, bool aAddParent) const noexcept;
+
+	void toListDirectory(uint32_t aDirectory, ListDirectory& aParent, bool aRecursive) const noexcept;
+	void listToXml(const ListDirectory& aDirectory, OutputStream& xmlFile, string& indent, string& tmp2, bool aRecursive) const;
+	void filesToXml(const ListDirectory& aDirectory, OutputStream& xmlFile, string& indent, string& tmp2, bool addDate) const;
+	void fileToXml(uint32_t aFile, OutputStream& xmlFile, string& indent, string& tmp2, bool addDate) const;
+};
+
+} // namespace dcpp
+
+#endif // !defined(DCPLUSPLUS_DCPP_COMPACT_SHARE_TREE_H)
@@ -181,6 +181,7 @@ void shutdown(function<void (const string&)> stepF, function<void (float)> progr
 	ConnectivityManager::getInstance()->close();
 	GeoManager::getInstance()->close();
 	BufferedSocket::waitShutdown();
+	SearchManager::getInstance()->shutdown();
 	
 	announce(STRING(SAVING_SETTINGS));
 	AutoSearchManager::getInstance()->AutoSearchSave();
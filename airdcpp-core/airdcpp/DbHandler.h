@@ -35,6 +35,18 @@ class DbSnapshot {
 
 };
 
+// Set of writes that are applied atomically
+class DbBatch {
+public:
+	virtual void put(void* aKey, size_t keyLen, void* aValue, size_t valueLen) noexcept = 0;
+	virtual void remove(void* aKey, size_t keyLen) noexcept = 0;
+	virtual size_t size() const noexcept = 0;
+
+	virtual ~DbBatch() { }
+};
+
+typedef pair<void*, size_t> DbKey;
+
 class DbHandler : boost::noncopyable {
 public:
 	virtual DbSnapshot* getSnapshot() { return nullptr; }
@@ -48,6 +60,21 @@ public:
 
 	virtual bool hasKey(void* key, size_t keyLen, DbSnapshot* aSnapshot = nullptr) throw(DbException) = 0;
 
+	virtual DbBatch* createBatch() noexcept = 0;
+	virtual void write(DbBatch* aBatch) throw(DbException) = 0;
+
+	// Fetch the values of multiple (unique) keys. loadF is called with the index of each key that was found.
+	virtual void getMultiple(const vector<DbKey>& aKeys, std::function<bool(size_t aIndex, void* aValue, size_t aValueLen)> loadF, DbSnapshot* aSnapshot = nullptr) throw(DbException) {
+		for (size_t i = 0; i < aKeys.size(); ++i) {
+			get(aKeys[i].first, aKeys[i].second, 0, [&](void* aValue, size_t aValueLen) { return loadF(i, aValue, aValueLen); }, aSnapshot);
+		}
+	}
+
+	// Disable syncing of individual writes, the caller is responsible for calling flush() periodically
+	// Unsynced writes are readable right away but they may be lost if the system crashes before flush() is called
+	virtual void setSyncWrites(bool /*aSync*/) noexcept { }
+	virtual void flush() throw(DbException) { }
+
 	virtual size_t size(bool thorough, DbSnapshot* aSnapshot = nullptr) throw(DbException) = 0;
 	virtual int64_t getSizeOnDisk() throw(DbException) = 0;
 
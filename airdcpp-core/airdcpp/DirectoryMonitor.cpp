@@ -21,13 +21,18 @@
 
 #include "AirUtil.h"
 #include "DirectoryMonitor.h"
+#include "File.h"
 #include "ResourceManager.h"
 #include "Text.h"
 
-/*#ifndef _WIN32
+#ifndef _WIN32
+#include <poll.h>
+#include <sys/eventfd.h>
 #include <sys/inotify.h>
-#include <sys/epoll.h>
-#endif*/
+#include <unistd.h>
+
+#define WATCH_MASK (IN_CREATE | IN_DELETE | IN_CLOSE_WRITE | IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR)
+#endif
 
 namespace dcpp {
 
@@ -67,19 +72,21 @@ void DirectoryMonitor::Server::init() throw(MonitorException) {
 		throw MonitorException(Util::translateError(::GetLastError()));
 	}
 #else
-	/*fd = inotify_init();
-	if (fd < 0)
-		throw MonitorException(Util::translateError(::GetLastError()));
-
-	efd = epoll_create(sizeof(int));
-	if (efd < 0)
-		throw MonitorException(Util::translateError(::GetLastError()));
+	fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (fd < 0) {
+		threadRunning.clear();
+		throw MonitorException(getErrorStr(errno));
+	}
 
-	ev.events = EPOLLIN | EPOLLOUT | EPOLLET;
-	cfg = epoll_ctl(efd, EPOLL_CTL_ADD, fd, &ev);
-	if (cfg < 0)
-		throw MonitorException(Util::translateError(::GetLastError()));*/
+	efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (efd < 0) {
+		auto error = errno;
+		::close(fd);
+		fd = -1;
 
+		threadRunning.clear();
+		throw MonitorException(getErrorStr(error));
+	}
 #endif
 
 	start();
@@ -204,17 +211,25 @@ void Monitor::openDirectory(HANDLE iocp) {
 
 #else
 
-Monitor::Monitor(const string& aPath, DirectoryMonitor::Server* aServer, int monitorFlags, size_t bufferSize) {
+Monitor::Monitor(const string& aPath, DirectoryMonitor::Server* aServer) : server(aServer), changes(0), path(aPath) {
 }
 
 Monitor::~Monitor() { }
 
 void Monitor::stopMonitoring() {
+	if (stopped)
+		return;
+
+	server->removeWatches(this);
+	stopped = true;
 
+	// The thread will delete us
+	server->wakeUp();
 }
 
 DirectoryMonitor::Server::Server(DirectoryMonitor* aBase, int numThreads) : base(aBase), m_bTerminate(false), m_nThreads(numThreads) {
 	threadRunning.clear();
+	buffer.resize(64 * 1024);
 }
 
 DirectoryMonitor::Server::~Server() {
@@ -367,44 +382,384 @@ bool DirectoryMonitor::Server::addDirectory(const string& aPath) throw(MonitorEx
 #else
 
 bool DirectoryMonitor::Server::addDirectory(const string& aPath) throw(MonitorException) {
-	//int fd = inotify_init();
-	//if (fd < 0)
-	//	throw MonitorException(Util::translateError(::GetLastError()));
+	{
+		RLock l(cs);
+		if (monitors.find(aPath) != monitors.end())
+			return false;
+	}
 
-	/*int wd = inotify_add_watch(fd, Text::fromUtf8(aPath), IN_MODIFY);
-	if (wd < 0)
-		throw MonitorException(Util::translateError(::GetLastError()));
+	init();
 
+	// Listing the directory tree may take a long time, don't block the event processing meanwhile
+	Monitor* mon = new Monitor(aPath, this);
+	WatchList created;
+	try {
+		createWatches(mon, aPath, -1, aPath, created);
+	} catch (MonitorException& e) {
+		for (const auto& w : created) {
+			inotify_rm_watch(fd, w.first);
+		}
 
-	int cfg = epoll_ctl(efd, EPOLL_CTL_ADD, fd, &ev);
-	if (cfg < 0)
-		throw MonitorException(Util::translateError(::GetLastError()));*/
+		{
+			WLock l(cs);
+			failedDirectories.insert(aPath);
+		}
+
+		delete mon;
+		throw e;
+	}
+
+	{
+		WLock l(cs);
+		for (const auto& w : created) {
+			insertWatch(w.first, mon, w.second.parent, w.second.name);
+		}
+
+		monitors.emplace(aPath, mon);
+		failedDirectories.erase(aPath);
+	}
 
 	return true;
 }
 
-void DirectoryMonitor::Server::deleteDirectory(DirectoryMonitor::Server::MonitorMap::iterator mon) {
+void DirectoryMonitor::Server::createWatches(Monitor* aMonitor, const string& aPath, int aParent, const string& aName, WatchList& watches_) throw(MonitorException) {
+	auto wd = inotify_add_watch(fd, Text::fromUtf8(aPath).c_str(), WATCH_MASK);
+	if (wd < 0) {
+		auto error = errno;
+		if (error == ENOSPC) {
+			throw MonitorException("The maximum number of watched directories has been reached (increase the value of fs.inotify.max_user_watches)");
+		}
+
+		if (aParent == -1) {
+			throw MonitorException(getErrorStr(error));
+		}
+
+		// Skip inaccessible subdirectories
+		return;
+	}
+
+	watches_.emplace_back(wd, Watch({ aMonitor, aParent, aName, set<int>() }));
+
+	FileFindIter end;
+	for (FileFindIter i(aPath, "*"); i != end; ++i) {
+		if (!i->isDirectory() || i->isLink())
+			continue;
+
+		auto name = i->getFileName();
+		if (name == "." || name == "..")
+			continue;
+
+		createWatches(aMonitor, aPath + name + PATH_SEPARATOR, wd, name, watches_);
+	}
+}
+
+void DirectoryMonitor::Server::addWatches(Monitor* aMonitor, const string& aPath, int aParent, const string& aName) throw(MonitorException) {
+	WatchList created;
+	try {
+		createWatches(aMonitor, aPath, aParent, aName, created);
+	} catch (const MonitorException&) {
+		for (const auto& w : created) {
+			inotify_rm_watch(fd, w.first);
+		}
+
+		throw;
+	}
+
+	// Parents are listed before their children
+	for (const auto& w : created) {
+		insertWatch(w.first, aMonitor, w.second.parent, w.second.name);
+	}
+}
+
+void DirectoryMonitor::Server::insertWatch(int aWatch, Monitor* aMonitor, int aParent, const string& aName) noexcept {
+	auto& w = watches[aWatch];
+	if (w.monitor) {
+		// The directory has been moved (or an existing watch of the same directory is replaced)
+		auto n = watchNames.find(make_pair(w.parent, w.name));
+		if (n != watchNames.end() && n->second == aWatch) {
+			watchNames.erase(n);
+		}
+
+		auto p = watches.find(w.parent);
+		if (p != watches.end()) {
+			p->second.children.erase(aWatch);
+		}
+	}
+
+	w.monitor = aMonitor;
+	w.parent = aParent;
+	w.name = aName;
+
+	watchNames[make_pair(aParent, aName)] = aWatch;
+	if (aParent != -1) {
+		auto p = watches.find(aParent);
+		if (p != watches.end()) {
+			p->second.children.insert(aWatch);
+		}
+	}
+}
+
+void DirectoryMonitor::Server::removeWatches(const Monitor* aMonitor) noexcept {
+	auto wd = findWatch(-1, aMonitor->path);
+	if (wd != -1 && watches[wd].monitor == aMonitor) {
+		removeWatchTree(wd);
+	}
+}
+
+void DirectoryMonitor::Server::removeWatchTree(int aWatch) noexcept {
+	auto w = watches.find(aWatch);
+	if (w == watches.end())
+		return;
+
+	auto children = move(w->second.children);
+	for (auto c : children) {
+		removeWatchTree(c);
+	}
+
+	// The watch may have been removed by the kernel already
+	inotify_rm_watch(fd, aWatch);
+
+	w = watches.find(aWatch);
+	auto n = watchNames.find(make_pair(w->second.parent, w->second.name));
+	if (n != watchNames.end() && n->second == aWatch) {
+		watchNames.erase(n);
+	}
+
+	auto p = watches.find(w->second.parent);
+	if (p != watches.end()) {
+		p->second.children.erase(aWatch);
+	}
+
+	watches.erase(w);
+}
+
+int DirectoryMonitor::Server::findWatch(int aParent, const string& aName) const noexcept {
+	auto w = watchNames.find(make_pair(aParent, aName));
+	return w != watchNames.end() ? w->second : -1;
+}
+
+bool DirectoryMonitor::Server::getWatchPath(int aWatch, string& path_) const noexcept {
+	auto w = watches.find(aWatch);
+	if (w == watches.end())
+		return false;
+
+	if (w->second.parent == -1) {
+		path_ = w->second.name;
+		return true;
+	}
+
+	if (!getWatchPath(w->second.parent, path_))
+		return false;
+
+	path_ += w->second.name + PATH_SEPARATOR;
+	return true;
+}
+
+void DirectoryMonitor::Server::wakeUp() noexcept {
+	if (efd < 0)
+		return;
+
+	uint64_t value = 1;
+	auto ret = ::write(efd, &value, sizeof(value));
+	(void)ret;
+}
 
+void DirectoryMonitor::Server::deleteDirectory(DirectoryMonitor::Server::MonitorMap::iterator mon) {
+	delete mon->second;
+	monitors.erase(mon);
 }
 
 int DirectoryMonitor::Server::read() {
-	/*struct epoll_event ev;
-	ev.events = EPOLLIN|EPOLLOUT|EPOLLET;
-	int ret = epoll_wait(efd, &ev, 100, 86400000);
-	if (ret > 0) {
-		
-	} else if (ret < 0) {
-		perror("Error in the polling");
-		break;
-	} else {
-		perror("Timed Out");
-		break;
-	}*/
-	return 0;
+	pollfd fds[2];
+	fds[0].fd = fd;
+	fds[0].events = POLLIN;
+	fds[0].revents = 0;
+	fds[1].fd = efd;
+	fds[1].events = POLLIN;
+	fds[1].revents = 0;
+
+	if (poll(fds, 2, -1) < 0 && errno != EINTR) {
+		dcdebug("DirectoryMonitor: poll failed (%s)\n", getErrorStr(errno).c_str());
+		Thread::sleep(1000);
+	}
+
+	if (fds[1].revents & POLLIN) {
+		uint64_t value;
+		auto ret = ::read(efd, &value, sizeof(value));
+		(void)ret;
+	}
+
+	WLock l(cs);
+	if (fds[0].revents & POLLIN) {
+		for (;;) {
+			auto len = ::read(fd, &buffer[0], buffer.size());
+			if (len <= 0)
+				break;
+
+			processEvents(static_cast<size_t>(len));
+		}
+	}
+
+	// Delete the monitors that have been stopped
+	for (auto i = monitors.begin(); i != monitors.end();) {
+		if (i->second->stopped) {
+			deleteDirectory(i++);
+		} else {
+			++i;
+		}
+	}
+
+	if (m_bTerminate && monitors.empty()) {
+		::close(fd);
+		::close(efd);
+		fd = efd = -1;
+		return 0;
+	}
+
+	return 1;
 }
 
-void DirectoryMonitor::processNotification(const string& aPath, const ByteVector& aBuf) {
+void DirectoryMonitor::Server::processEvents(size_t aLength) noexcept {
+	auto monBase = base;
+
+	// IN_MOVED_FROM events are kept until we know whether there's a matching IN_MOVED_TO event
+	Monitor* movedMonitor = nullptr;
+	uint32_t movedCookie = 0;
+	string movedPath;
+	int movedParent = -1;
+	string movedName;
+	bool movedDir = false;
+
+	// The item was moved outside the monitored directories
+	auto flushMoved = [&] {
+		if (!movedMonitor)
+			return;
 
+		if (movedDir) {
+			auto wd = findWatch(movedParent, movedName);
+			if (wd != -1)
+				removeWatchTree(wd);
+		}
+
+		auto path = movedPath;
+		monBase->callAsync([=] { monBase->fire(DirectoryMonitorListener::FileDeleted(), path); });
+		movedMonitor = nullptr;
+	};
+
+	for (size_t pos = 0; pos + sizeof(inotify_event) <= aLength;) {
+		auto e = reinterpret_cast<const inotify_event*>(&buffer[pos]);
+		pos += sizeof(inotify_event) + e->len;
+
+		if (e->mask & IN_Q_OVERFLOW) {
+			// We don't know where the changes were lost
+			flushMoved();
+			for (const auto& m : monitors) {
+				auto path = m.first;
+				monBase->callAsync([=] { monBase->fire(DirectoryMonitorListener::Overflow(), path); });
+			}
+			continue;
+		}
+
+		auto w = watches.find(e->wd);
+		if (w == watches.end())
+			continue;
+
+		auto mon = w->second.monitor;
+		if (e->mask & IN_IGNORED) {
+			removeWatchTree(e->wd);
+			continue;
+		}
+
+		if (e->mask & (IN_DELETE_SELF | IN_MOVE_SELF | IN_UNMOUNT)) {
+			// Subdirectories are handled via the events of their parent
+			if (w->second.parent == -1 && !mon->stopped) {
+				flushMoved();
+				failDirectory(mon->path, e->mask & IN_UNMOUNT ? STRING(DEVICE_REMOVED) : STRING(FILE_NOT_FOUND));
+			}
+			continue;
+		}
+
+		string path;
+		if (!getWatchPath(e->wd, path)) {
+			// The parent has been removed
+			removeWatchTree(e->wd);
+			continue;
+		}
+
+		if (e->len == 0)
+			continue;
+
+		string name(e->name);
+		path += name;
+
+		auto isDir = (e->mask & IN_ISDIR) > 0;
+		mon->changes++;
+
+		auto created = (e->mask & IN_CREATE) > 0;
+		if (e->mask & IN_MOVED_TO) {
+			if (movedMonitor && movedCookie == e->cookie) {
+				auto sameMonitor = movedMonitor == mon;
+				auto oldPath = movedPath;
+				movedMonitor = nullptr;
+
+				if (sameMonitor) {
+					if (isDir) {
+						// The existing watch follows the directory, just update the location
+						auto wd = inotify_add_watch(fd, Text::fromUtf8(path + PATH_SEPARATOR).c_str(), WATCH_MASK);
+						if (wd >= 0)
+							insertWatch(wd, mon, e->wd, name);
+					}
+
+					monBase->callAsync([=] { monBase->fire(DirectoryMonitorListener::FileRenamed(), oldPath, path); });
+					continue;
+				}
+
+				// Moved between different monitored directories
+				if (isDir) {
+					auto wd = findWatch(movedParent, movedName);
+					if (wd != -1)
+						removeWatchTree(wd);
+				}
+
+				monBase->callAsync([=] { monBase->fire(DirectoryMonitorListener::FileDeleted(), oldPath); });
+			} else {
+				flushMoved();
+			}
+
+			created = true;
+		} else {
+			flushMoved();
+
+			if (e->mask & IN_MOVED_FROM) {
+				movedMonitor = mon;
+				movedCookie = e->cookie;
+				movedPath = path;
+				movedParent = e->wd;
+				movedName = name;
+				movedDir = isDir;
+				continue;
+			}
+		}
+
+		if (created) {
+			if (isDir) {
+				try {
+					addWatches(mon, path + PATH_SEPARATOR, e->wd, name);
+				} catch (const MonitorException& ex) {
+					failDirectory(mon->path, ex.getError());
+					continue;
+				}
+			}
+
+			monBase->callAsync([=] { monBase->fire(DirectoryMonitorListener::FileCreated(), path); });
+		} else if (e->mask & IN_CLOSE_WRITE) {
+			monBase->callAsync([=] { monBase->fire(DirectoryMonitorListener::FileModified(), path); });
+		} else if (e->mask & IN_DELETE) {
+			monBase->callAsync([=] { monBase->fire(DirectoryMonitorListener::FileDeleted(), path); });
+		}
+	}
+
+	flushMoved();
 }
 
 #endif
@@ -604,8 +959,6 @@ void DirectoryMonitor::processNotification(const string& aPath, const ByteVector
 	};
 }
 
-#else
-
 #endif
 
 } //dcpp
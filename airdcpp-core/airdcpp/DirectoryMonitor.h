@@ -65,6 +65,8 @@ private:
 	friend class Monitor;
 	class Server : public Thread {
 	public:
+		friend class Monitor;
+
 		Server(DirectoryMonitor* aBase, int numThreads);
 		~Server();
 		bool addDirectory(const string& aPath) throw(MonitorException);
@@ -107,8 +109,46 @@ private:
 #ifdef WIN32
 		HANDLE m_hIOCP;
 #else
-		int efd = -1;
-		int fd = -1;
+		struct Watch {
+			Monitor* monitor;
+			int parent; // -1 for the monitored root
+			string name; // full path for the monitored root
+			set<int> children;
+		};
+
+		typedef unordered_map<int, Watch> WatchMap;
+		typedef map<pair<int, string>, int> WatchNameMap;
+		typedef vector<pair<int, Watch>> WatchList;
+
+		WatchMap watches;
+		WatchNameMap watchNames; // (parent, name) -> watch
+		ByteVector buffer;
+
+		// Add inotify watches for the directory and its subdirectories recursively without modifying the watch map (doesn't require locking)
+		// The created watches are left in the list in case of errors
+		void createWatches(Monitor* aMonitor, const string& aPath, int aParent, const string& aName, WatchList& watches_) throw(MonitorException);
+
+		// Add watches for the directory and its subdirectories recursively
+		// must be called from inside WLock
+		void addWatches(Monitor* aMonitor, const string& aPath, int aParent, const string& aName) throw(MonitorException);
+
+		// must be called from inside WLock
+		void insertWatch(int aWatch, Monitor* aMonitor, int aParent, const string& aName) noexcept;
+		void removeWatches(const Monitor* aMonitor) noexcept;
+		void removeWatchTree(int aWatch) noexcept;
+		int findWatch(int aParent, const string& aName) const noexcept;
+
+		// Returns false if the watch or any of its parents has been removed
+		bool getWatchPath(int aWatch, string& path_) const noexcept;
+
+		// Converts the inotify events to listener events, must be called from inside WLock
+		void processEvents(size_t aLength) noexcept;
+
+		// Wake up the thread from poll
+		void wakeUp() noexcept;
+
+		int efd = -1; // eventfd for waking up the thread
+		int fd = -1; // inotify
 #endif
 		int	m_nThreads;
 		set<string> failedDirectories;
@@ -116,7 +156,9 @@ private:
 
 	Server* server;
 
+#ifdef WIN32
 	void processNotification(const string& aPath, const ByteVector& aBuf);
+#endif
 	DispatcherQueue dispatcher;
 };
 
@@ -132,9 +174,7 @@ public:
 	void openDirectory(HANDLE iocp);
 	void beginRead();
 #else
-	//int addWatch(const string& aPath);
-
-	Monitor(const string& aPath, DirectoryMonitor::Server* aParent, int monitorFlags, size_t bufferSize);
+	Monitor(const string& aPath, DirectoryMonitor::Server* aParent);
 	~Monitor();
 #endif
 
@@ -144,13 +184,13 @@ public:
 	DirectoryMonitor::Server* server;
 private:
 	uint64_t changes;
+	const string	path;
 #ifdef WIN32
 	void processNotification();
 
 	// Parameters from the caller for ReadDirectoryChangesW().
 	int				m_dwFlags;
 	int				m_bChildren;
-	const string	path;
 
 	// Result of calling CreateFile().
 	HANDLE		m_hDirectory;
@@ -165,7 +205,8 @@ private:
 	int errorCount;
 	int key;
 #else
-
+	// The watches have been removed and the monitor will be deleted by the server thread
+	bool stopped = false;
 #endif
 };
 
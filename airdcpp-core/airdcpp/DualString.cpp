@@ -41,9 +41,18 @@ wchar_t toUpper(wchar_t c) noexcept {
 
 #define ARRAY_BITS (sizeof(MaskType)*8)
 
+// Strings up to this length are converted without allocating a temporary array
+#define LOCAL_ARRAY_SIZE 8
+
 DualString::DualString(const string& aStr) {
 	reserve(aStr.size());
 
+	// The final array can't be created before the length of the lowercase string is known
+	MaskType localSizes[LOCAL_ARRAY_SIZE];
+	std::unique_ptr<MaskType[]> allocatedSizes;
+	MaskType* sizes = nullptr;
+	auto arraySize = getArraySize(aStr.size());
+
 	//auto tmp = dcpp::Text::toLower(aStr);
 	int arrayPos = 0, bitPos = 0;
 	const char* end = &aStr[0] + aStr.size();
@@ -55,10 +64,17 @@ DualString::DualString(const string& aStr) {
 		} else {
 			auto lc = toLower(c);
 			if (lc != c) {
-				if (!charSizes) {
-					initSizeArray(aStr.size());
+				if (!sizes) {
+					if (arraySize <= LOCAL_ARRAY_SIZE) {
+						sizes = localSizes;
+					} else {
+						allocatedSizes.reset(new MaskType[arraySize]);
+						sizes = allocatedSizes.get();
+					}
+
+					std::fill(sizes, sizes + arraySize, 0);
 				}
-				charSizes[arrayPos] |= (1 << bitPos);
+				sizes[arrayPos] |= (1 << bitPos);
 			}
 
 			dcpp::Text::wcToUtf8(lc, *this);
@@ -73,20 +89,43 @@ DualString::DualString(const string& aStr) {
 			arrayPos++;
 		}
 	}
+
+	if (sizes) {
+		setSizeArray(sizes, arraySize);
+	}
 }
 
-// Create an array with minumum possible length that will store the character sizes (unset=lowercase, set=uppercase)
-size_t DualString::initSizeArray(size_t strLen) {
-	size_t arrSize = strLen % ARRAY_BITS == 0 ? strLen / ARRAY_BITS : (strLen / ARRAY_BITS) + 1;
-	charSizes = new MaskType[arrSize];
-	for (size_t s = 0; s < arrSize; ++s) {
-		charSizes[s] = 0;
+// Minimum possible length of an array that will store the character sizes (unset=lowercase, set=uppercase)
+size_t DualString::getArraySize(size_t aStrLen) noexcept {
+	return aStrLen % ARRAY_BITS == 0 ? aStrLen / ARRAY_BITS : (aStrLen / ARRAY_BITS) + 1;
+}
+
+void DualString::setSizeArray(const MaskType* aSizes, size_t aArraySize) noexcept {
+	// The lowercase string may have a different byte length than the original one
+	auto arraySize = getArraySize(size());
+
+	MaskType* target = inlineSizes;
+	if (!hasInlineSizes()) {
+		charSizes = new MaskType[arraySize];
+		target = charSizes;
 	}
 
-	return arrSize;
+	for (size_t s = 0; s < arraySize; ++s) {
+		target[s] = s < aArraySize ? aSizes[s] : 0;
+	}
+}
+
+void DualString::freeSizeArray() noexcept {
+	if (!hasInlineSizes() && charSizes) {
+		delete[] charSizes;
+	}
+
+	charSizes = nullptr;
 }
 
 DualString& DualString::operator=(DualString&& rhs) {
+	freeSizeArray();
+
 	assign(rhs.begin(), rhs.end());
 	charSizes = rhs.charSizes;
 	rhs.charSizes = nullptr;
@@ -100,47 +139,43 @@ DualString::DualString(DualString&& rhs) : charSizes(rhs.charSizes) {
 
 DualString::DualString(const DualString& rhs) {
 	assign(rhs.begin(), rhs.end());
-	if (rhs.charSizes) {
-		auto size = initSizeArray(rhs.size());
-		for (size_t s = 0; s < size; ++s) {
-			charSizes[s] = rhs.charSizes[s];
-		}
+	if (!rhs.lowerCaseOnly()) {
+		setSizeArray(rhs.getSizeArray(), getArraySize(rhs.size()));
 	}
 	//dcassert(0);
 }
 
 DualString& DualString::operator= (const DualString& rhs) {
-	if (charSizes) {
-		delete[] charSizes;
-		charSizes = nullptr;
+	if (this == &rhs) {
+		return *this;
 	}
 
+	freeSizeArray();
+
 	assign(rhs.begin(), rhs.end());
-	if (rhs.charSizes) {
-		auto size = initSizeArray(rhs.size());
-		for (size_t s = 0; s < size; ++s) {
-			charSizes[s] = rhs.charSizes[s];
-		}
+	if (!rhs.lowerCaseOnly()) {
+		setSizeArray(rhs.getSizeArray(), getArraySize(rhs.size()));
 	}
 	return *this;
 }
 
 DualString::~DualString() { 
-	if (charSizes)
-		delete[] charSizes; 
+	freeSizeArray();
 }
 
 string DualString::getNormal() const {
-	if (!charSizes)
+	if (lowerCaseOnly())
 		return *this;
 
+	const auto sizes = getSizeArray();
+
 	string ret;
 	ret.reserve(size());
 
 	int bitPos = 0, arrayPos = 0;
 	const char* end = &c_str()[0] + string::size();
 	for (const char* p = &c_str()[0]; p < end;) {
-		if (charSizes[arrayPos] & (1 << bitPos)) {
+		if (sizes[arrayPos] & (1 << bitPos)) {
 			wchar_t c = 0;
 			int n = dcpp::Text::utf8ToWc(p, c);
 
@@ -164,5 +199,32 @@ string DualString::getNormal() const {
 }
 
 bool DualString::lowerCaseOnly() const noexcept {
-	return !charSizes; 
-}
\ No newline at end of file
+	if (!hasInlineSizes()) {
+		return !charSizes;
+	}
+
+	for (size_t s = 0; s < INLINE_ARRAY_SIZE; ++s) {
+		if (inlineSizes[s] != 0) {
+			return false;
+		}
+	}
+
+	return true;
+}
+
+size_t DualString::getAllocatedSize() const noexcept {
+	size_t ret = 0;
+
+	// Short strings are stored inside the string object
+	auto d = data();
+	auto obj = reinterpret_cast<const char*>(static_cast<const string*>(this));
+	if (d < obj || d >= obj + sizeof(string)) {
+		ret += capacity() + 1;
+	}
+
+	if (!hasInlineSizes() && charSizes) {
+		ret += getArraySize(size()) * sizeof(MaskType);
+	}
+
+	return ret;
+}
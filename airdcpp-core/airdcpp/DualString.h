@@ -45,9 +45,26 @@ public:
 	DualString& operator=(DualString&&);
 	DualString(const DualString&);
 	DualString& operator= (const DualString& other);
+
+	// Approximate amount of memory allocated for storing the string (excluding the object itself)
+	size_t getAllocatedSize() const noexcept;
 private:
-	size_t initSizeArray(size_t strLen);
-	MaskType* charSizes = nullptr;
+	// Case bits for short strings are stored in place of the array pointer
+	enum { INLINE_ARRAY_SIZE = sizeof(uintptr_t) / sizeof(MaskType) };
+
+	static size_t getArraySize(size_t aStrLen) noexcept;
+	bool hasInlineSizes() const noexcept { return getArraySize(size()) <= INLINE_ARRAY_SIZE; }
+	const MaskType* getSizeArray() const noexcept { return hasInlineSizes() ? inlineSizes : charSizes; }
+
+	// Must be called after the string has been set
+	void setSizeArray(const MaskType* aSizes, size_t aArraySize) noexcept;
+	// Must be called before the string is changed
+	void freeSizeArray() noexcept;
+
+	union {
+		MaskType* charSizes = nullptr;
+		MaskType inlineSizes[INLINE_ARRAY_SIZE];
+	};
 };
 
 #endif
\ No newline at end of file
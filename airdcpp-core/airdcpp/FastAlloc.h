@@ -148,8 +148,113 @@ class FastAlloc : public FastAllocBase  {
 	
 	template <class T> boost::pool< > FastAlloc<T> ::pool( sizeof(T) );
 
+// Pool allocator for types that are allocated by multiple threads at the same time
+// Each thread keeps a cache of free chunks so that the pool (which has its own lock) is only locked when a batch of chunks is moved
+template <class T>
+class CachedFastAlloc {
+public:
+	static void* operator new(size_t s) {
+		if (s != sizeof(T)) {
+			return ::operator new(s);
+		}
+
+		auto& cache = getCache();
+		if (cache.chunks.empty()) {
+			cache.refill();
+		}
+
+		auto ret = cache.chunks.back();
+		cache.chunks.pop_back();
+		return ret;
+	}
+
+	static void operator delete(void* m, size_t s) {
+		if (s != sizeof(T)) {
+			::operator delete(m);
+		} else if (m) {
+			auto& cache = getCache();
+			cache.chunks.push_back(m);
+			if (cache.chunks.size() == MAX_CACHED) {
+				cache.release(BATCH_SIZE);
+			}
+		}
+	}
+
+	static void* operator new(size_t, void* m) {
+		return m;
+	}
+
+	static void operator delete(void*, void*) {
+	}
+
+protected:
+	~CachedFastAlloc() { }
+
+private:
+	enum {
+		BATCH_SIZE = 64,
+		MAX_CACHED = BATCH_SIZE * 2
+	};
+
+	struct SharedPool {
+		SharedPool() : pool(sizeof(T)) { }
+
+		FastCriticalSection cs;
+		boost::pool< > pool;
+	};
+
+	static SharedPool& getPool() {
+		static SharedPool pool;
+		return pool;
+	}
+
+	struct Cache {
+		Cache() {
+			chunks.reserve(MAX_CACHED);
+		}
+
+		~Cache() {
+			release(chunks.size());
+		}
+
+		void refill() {
+			auto& p = getPool();
+			FastLock l(p.cs);
+			for (int i = 0; i < BATCH_SIZE; ++i) {
+				auto m = p.pool.malloc();
+				if (!m) {
+					break;
+				}
+
+				chunks.push_back(m);
+			}
+
+			if (chunks.empty()) {
+				throw std::bad_alloc();
+			}
+		}
+
+		void release(size_t aCount) {
+			auto& p = getPool();
+			FastLock l(p.cs);
+			for (size_t i = 0; i < aCount; ++i) {
+				p.pool.free(chunks.back());
+				chunks.pop_back();
+			}
+		}
+
+		vector<void*> chunks;
+	};
+
+	static Cache& getCache() {
+		static thread_local Cache cache;
+		return cache;
+	}
+};
+
 #else
 template<class T> struct FastAlloc { };
+template<class T> struct CachedFastAlloc { };
 class FastAllocator {};
 #endif
 } // namespace dcpp
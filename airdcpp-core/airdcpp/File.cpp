@@ -23,12 +23,18 @@
 #ifdef _WIN32
 #include "w.h"
 #else
+#include <sys/ioctl.h>
 #include <sys/stat.h>
 #include <sys/statvfs.h>
 #include <errno.h>
 #include <dirent.h>
 #include <fnmatch.h>
 #include <utime.h>
+
+#ifdef __linux__
+#include <linux/fiemap.h>
+#include <linux/fs.h>
+#endif
 #endif
 
 namespace dcpp {
@@ -280,6 +286,34 @@ int64_t File::getBlockSize(const string& aFileName) noexcept {
 	return ret > 0 ? static_cast<int64_t>(sectorBytes)*static_cast<int64_t>(clusterSectors) : 4096;
 }
 
+bool File::getPhysicalPosition(const string& aFileName, uint64_t& position_) noexcept {
+	position_ = 0;
+
+	HANDLE h = ::CreateFile(Text::toT(Util::formatPath(aFileName)).c_str(), FILE_READ_ATTRIBUTES, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL, OPEN_EXISTING, 0, NULL);
+	if (h == INVALID_HANDLE_VALUE) {
+		return false;
+	}
+
+	bool ret = false;
+
+	// Logical cluster of the first extent
+	STARTING_VCN_INPUT_BUFFER input = { 0 };
+	RETRIEVAL_POINTERS_BUFFER output;
+	DWORD bytes = 0;
+	if ((::DeviceIoControl(h, FSCTL_GET_RETRIEVAL_POINTERS, &input, sizeof(input), &output, sizeof(output), &bytes, NULL) || ::GetLastError() == ERROR_MORE_DATA) && output.ExtentCount > 0) {
+		position_ = output.Extents[0].Lcn.QuadPart;
+		ret = true;
+	} else {
+		BY_HANDLE_FILE_INFORMATION info;
+		if (::GetFileInformationByHandle(h, &info)) {
+			position_ = (static_cast<uint64_t>(info.nFileIndexHigh) << 32) | info.nFileIndexLow;
+		}
+	}
+
+	::CloseHandle(h);
+	return ret;
+}
+
 #else // !_WIN32
 
 File::File(const string& aFileName, int access, int mode, BufferMode aBufferMode, bool /*isAbsolute*/, bool /*isDirectory*/) {
@@ -551,6 +585,42 @@ uint64_t File::getLastModified(const string& aPath) noexcept {
 	return statbuf.st_mtime;
 }
 
+bool File::getPhysicalPosition(const string& aFileName, uint64_t& position_) noexcept {
+	position_ = 0;
+
+	int fd = open(Text::fromUtf8(aFileName).c_str(), O_RDONLY);
+	if (fd == -1) {
+		return false;
+	}
+
+	bool ret = false;
+	struct stat statbuf;
+	if (fstat(fd, &statbuf) == 0) {
+		position_ = statbuf.st_ino;
+	}
+
+#ifdef FS_IOC_FIEMAP
+	// Physical offset of the first extent (files without extents, such as empty or inlined ones, keep the inode number)
+	uint64_t buf[(sizeof(struct fiemap) + sizeof(struct fiemap_extent)) / sizeof(uint64_t)];
+	memzero(buf, sizeof(buf));
+
+	auto fm = reinterpret_cast<struct fiemap*>(buf);
+	fm->fm_length = FIEMAP_MAX_OFFSET;
+	fm->fm_extent_count = 1;
+
+	if (ioctl(fd, FS_IOC_FIEMAP, fm) == 0) {
+		const auto& extent = fm->fm_extents[0];
+		if (fm->fm_mapped_extents > 0 && !(extent.fe_flags & FIEMAP_EXTENT_UNKNOWN) && extent.fe_physical > 0) {
+			position_ = extent.fe_physical;
+			ret = true;
+		}
+	}
+#endif
+
+	::close(fd);
+	return ret;
+}
+
 void File::removeDirectory(const string& aPath) noexcept {
 	rmdir(Text::fromUtf8(aPath).c_str());
 }
@@ -115,6 +115,11 @@ public:
 	static uint64_t getLastModified(const string& path) noexcept;
 	static int64_t getSize(const string& aFileName) noexcept;
 	static int64_t getBlockSize(const string& aFileName) noexcept;
+
+	// Location of the beginning of the file on disk
+	// Returns false if the location isn't available, position_ is set to the file index/inode number (or 0) in that case
+	// The positions are only comparable between files on the same volume and with the same return value
+	static bool getPhysicalPosition(const string& aFileName, uint64_t& position_) noexcept;
 	static int64_t getDirSize(const string& aPath, bool recursive, const string& pattern = "*") noexcept;
 	static int64_t getFreeSpace(const string& aPath) noexcept;
 
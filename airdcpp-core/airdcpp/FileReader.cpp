@@ -28,6 +28,13 @@
 #ifndef _WIN32
 #include "TimerManager.h"
 #include <fcntl.h>
+
+#ifdef HAVE_LINUX_IO_URING_H
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#endif
 #endif
 
 namespace dcpp {
@@ -273,10 +280,325 @@ size_t FileReader::readMapped(const string& /*file*/, const DataCallback& /*call
 #include <unistd.h>
 
 
+#if defined(HAVE_LINUX_IO_URING_H) && defined(__NR_io_uring_setup) && defined(__NR_io_uring_enter)
+
+/** Minimal io_uring submission/completion queue pair (without liburing) */
+class FileReader::IoUring : boost::noncopyable {
+public:
+	~IoUring() {
+		if (sqes != MAP_FAILED)
+			munmap(sqes, sqesSize);
+		if (cqPtr != MAP_FAILED)
+			munmap(cqPtr, cqSize);
+		if (sqPtr != MAP_FAILED)
+			munmap(sqPtr, sqSize);
+		if (fd != -1)
+			::close(fd);
+	}
+
+	bool init(unsigned aEntries) {
+		io_uring_params p;
+		memzero(&p, sizeof(p));
+
+		fd = static_cast<int>(syscall(__NR_io_uring_setup, aEntries, &p));
+		if (fd == -1) {
+			return false;
+		}
+
+		sqSize = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+		cqSize = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+		sqesSize = p.sq_entries * sizeof(io_uring_sqe);
+
+		sqPtr = mmap(0, sqSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+		cqPtr = mmap(0, cqSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+		sqes = mmap(0, sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+		if (sqPtr == MAP_FAILED || cqPtr == MAP_FAILED || sqes == MAP_FAILED) {
+			return false;
+		}
+
+		auto sq = static_cast<uint8_t*>(sqPtr);
+		sqTail = reinterpret_cast<unsigned*>(sq + p.sq_off.tail);
+		sqMask = *reinterpret_cast<unsigned*>(sq + p.sq_off.ring_mask);
+		sqArray = reinterpret_cast<unsigned*>(sq + p.sq_off.array);
+
+		auto cq = static_cast<uint8_t*>(cqPtr);
+		cqHead = reinterpret_cast<unsigned*>(cq + p.cq_off.head);
+		cqTail = reinterpret_cast<unsigned*>(cq + p.cq_off.tail);
+		cqMask = *reinterpret_cast<unsigned*>(cq + p.cq_off.ring_mask);
+		cqes = reinterpret_cast<io_uring_cqe*>(cq + p.cq_off.cqes);
+		return true;
+	}
+
+	bool submitRead(int aFile, iovec* aVec, int64_t aOffset, uint64_t aUserData) {
+		auto tail = *sqTail;
+		auto index = tail & sqMask;
+
+		auto& sqe = static_cast<io_uring_sqe*>(sqes)[index];
+		memzero(&sqe, sizeof(sqe));
+		sqe.opcode = IORING_OP_READV;
+		sqe.fd = aFile;
+		sqe.off = aOffset;
+		sqe.addr = reinterpret_cast<uint64_t>(aVec);
+		sqe.len = 1;
+		sqe.user_data = aUserData;
+
+		sqArray[index] = index;
+		__atomic_store_n(sqTail, tail + 1, __ATOMIC_RELEASE);
+
+		return syscall(__NR_io_uring_enter, fd, 1, 0, 0, NULL, 0) == 1;
+	}
+
+	bool waitCompletion() {
+		for (;;) {
+			if (syscall(__NR_io_uring_enter, fd, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0) != -1) {
+				return true;
+			}
+
+			if (errno != EINTR) {
+				return false;
+			}
+		}
+	}
+
+	// Returns false if there are no completed reads
+	bool getCompletion(uint64_t& userData_, int& result_) {
+		auto head = *cqHead;
+		if (head == __atomic_load_n(cqTail, __ATOMIC_ACQUIRE)) {
+			return false;
+		}
+
+		const auto& cqe = cqes[head & cqMask];
+		userData_ = cqe.user_data;
+		result_ = cqe.res;
+
+		__atomic_store_n(cqHead, head + 1, __ATOMIC_RELEASE);
+		return true;
+	}
+private:
+	int fd = -1;
+
+	void* sqPtr = MAP_FAILED;
+	void* cqPtr = MAP_FAILED;
+	void* sqes = MAP_FAILED;
+	size_t sqSize = 0, cqSize = 0, sqesSize = 0;
+
+	unsigned* sqTail = nullptr;
+	unsigned* sqArray = nullptr;
+	unsigned sqMask = 0;
+
+	unsigned* cqHead = nullptr;
+	unsigned* cqTail = nullptr;
+	unsigned cqMask = 0;
+	io_uring_cqe* cqes = nullptr;
+};
+
+/** Keep multiple unbuffered reads in progress with io_uring while the callback processes the completed blocks in order */
+size_t FileReader::readDirect(const string& aPath, const DataCallback& callback) {
+	static const size_t ALIGNMENT = 4096;
+
+	if (!ring) {
+		if (ringFailed) {
+			return READ_FAILED;
+		}
+
+		ring = std::make_shared<IoUring>();
+		if (!ring->init(DIRECT_QUEUE_DEPTH)) {
+			dcdebug("Failed to initialize io_uring: %s\n", Util::translateError(errno).c_str());
+			ring = nullptr;
+			ringFailed = true;
+			return READ_FAILED;
+		}
+	}
+
+	int fd = open(Text::fromUtf8(aPath).c_str(), O_RDONLY | O_DIRECT);
+	if (fd == -1) {
+		// EINVAL: the file system doesn't support O_DIRECT, the caller will use buffered reads instead
+		dcdebug("Failed to open unbuffered file %s: %s\n", aPath.c_str(), Util::translateError(errno).c_str());
+		return READ_FAILED;
+	}
+
+	struct stat statbuf;
+	if (fstat(fd, &statbuf) == -1) {
+		::close(fd);
+		return READ_FAILED;
+	}
+
+	auto bufSize = getBlockSize(ALIGNMENT);
+	buffer.resize(bufSize * DIRECT_QUEUE_DEPTH + ALIGNMENT);
+	auto buf = static_cast<uint8_t*>(align(&buffer[0], ALIGNMENT));
+
+	struct Slot {
+		iovec vec;
+		int64_t offset; // File position of the block
+		size_t filled; // Bytes of the block that have been read
+		int result;
+		bool pending;
+	};
+
+	Slot slots[DIRECT_QUEUE_DEPTH];
+
+	const int64_t size = statbuf.st_size;
+	int64_t nextOffset = 0;
+
+	// Reads that haven't been completed by the kernel
+	size_t inFlight = 0;
+
+	// Blocks that haven't been processed by the callback
+	size_t queued = 0;
+
+	// Read the rest of the block
+	auto submit = [&](size_t aSlot) {
+		auto& slot = slots[aSlot];
+		slot.vec.iov_base = buf + aSlot * bufSize + slot.filled;
+		slot.vec.iov_len = bufSize - slot.filled;
+		slot.result = 0;
+		slot.pending = true;
+
+		if (!ring->submitRead(fd, &slot.vec, slot.offset + slot.filled, aSlot)) {
+			slot.pending = false;
+			return false;
+		}
+
+		inFlight++;
+		bytesInFlight += slot.vec.iov_len;
+		return true;
+	};
+
+	auto submitNext = [&](size_t aSlot) {
+		auto& slot = slots[aSlot];
+		slot.offset = nextOffset;
+		slot.filled = 0;
+
+		if (!submit(aSlot)) {
+			return false;
+		}
+
+		nextOffset += bufSize;
+		queued++;
+		return true;
+	};
+
+	auto complete = [&] {
+		uint64_t slot;
+		int result;
+		while (ring->getCompletion(slot, result)) {
+			slots[slot].result = result;
+			slots[slot].pending = false;
+			inFlight--;
+			bytesInFlight -= slots[slot].vec.iov_len;
+		}
+	};
+
+	// The kernel must not write in the buffers after we have returned
+	auto finish = [&] {
+		while (inFlight > 0 && ring->waitCompletion()) {
+			complete();
+		}
+
+		if (inFlight > 0) {
+			// Can't be reused
+			ring = nullptr;
+		}
+
+		bytesInFlight = 0;
+		::close(fd);
+	};
+
+	// Start reading
+	for (size_t i = 0; i < DIRECT_QUEUE_DEPTH && nextOffset < size; ++i) {
+		if (!submitNext(i)) {
+			finish();
+			return READ_FAILED;
+		}
+	}
+
+	size_t total = 0;
+	bool aborted = false;
+	try {
+		size_t i = 0;
+		while (queued > 0) {
+			auto& slot = slots[i];
+
+			// Wait for the next block in order
+			if (slot.pending) {
+				auto start = std::chrono::steady_clock::now();
+				while (slot.pending) {
+					if (!ring->waitCompletion()) {
+						throw FileException(Util::translateError(errno));
+					}
+
+					complete();
+				}
+
+				readWaitTime += std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+			}
+
+			if (slot.result < 0) {
+				if (total == 0 && slot.filled == 0) {
+					// Unbuffered reads aren't supported by all file systems, try something else
+					dcdebug("Unbuffered read failed for file %s: %s\n", aPath.c_str(), Util::translateError(-slot.result).c_str());
+					finish();
+					return READ_FAILED;
+				}
+
+				throw FileException(Util::translateError(-slot.result));
+			}
+
+			auto n = static_cast<size_t>(slot.result);
+			slot.filled += n;
+
+			// Short read before the end of file, read the rest of the block first
+			// (the callback gets full blocks except at the end of the file, tiger trees can't handle partial leaves in the middle)
+			if (n > 0 && slot.filled < bufSize && slot.offset + static_cast<int64_t>(slot.filled) < size) {
+				if (!submit(i)) {
+					throw FileException(Util::translateError(errno));
+				}
+
+				continue;
+			}
+
+			if (slot.filled > 0 && !callback(buf + i * bufSize, slot.filled)) {
+				total += slot.filled;
+				aborted = true;
+				break;
+			}
+
+			total += slot.filled;
+			queued--;
+
+			// End of file (or the file was truncated)?
+			if (slot.filled < bufSize) {
+				break;
+			}
+
+			if (nextOffset < size && !submitNext(i)) {
+				throw FileException(Util::translateError(errno));
+			}
+
+			i = (i + 1) % DIRECT_QUEUE_DEPTH;
+		}
+	} catch (...) {
+		finish();
+		throw;
+	}
+
+	finish();
+
+	if (!aborted && static_cast<int64_t>(total) != size) {
+		throw FileException("The file size changed while it was being read");
+	}
+
+	return total;
+}
+
+#else
+
 size_t FileReader::readDirect(const string& file, const DataCallback& callback) {
 	return READ_FAILED;
 }
 
+#endif
+
 static const int64_t BUF_SIZE = 0x1000000 - (0x1000000 % getpagesize());
 static sigjmp_buf sb_env;
 
@@ -19,7 +19,9 @@
 #ifndef DCPLUSPLUS_DCPP_FILE_READER_H
 #define DCPLUSPLUS_DCPP_FILE_READER_H
 
+#include <atomic>
 #include <functional>
+#include <memory>
 #include <string>
 #include <vector>
 
@@ -27,8 +29,10 @@
 
 namespace dcpp {
 
+using std::atomic;
 using std::function;
 using std::pair;
+using std::shared_ptr;
 using std::string;
 using std::vector;
 
@@ -52,6 +56,9 @@ public:
 	 */
 	FileReader(bool direct = false, size_t blockSize = 0) : direct(direct), blockSize(blockSize) { }
 
+	/** The reader (and its buffers) can be reused for reading multiple files */
+	void setDirect(bool aDirect) { direct = aDirect; }
+
 	/**
 	 * Read file - callback will be called for each read chunk which may or may not be a multiple of the requested block size.
 	 * @param file File name
@@ -61,16 +68,33 @@ public:
 	 */
 	size_t read(const string& file, const DataCallback& callback);
 
+	/** Amount of data that has been requested from the disk but not read yet (direct reads only, may be called from any thread) */
+	size_t getBytesInFlight() const { return bytesInFlight; }
+
+	/** Total time spent waiting for the data to be read in microseconds (direct reads only, may be called from any thread) */
+	uint64_t getReadWaitTime() const { return readWaitTime; }
+
 private:
 	static const size_t DEFAULT_BLOCK_SIZE = 256*1024;
 	static const size_t DEFAULT_MMAP_SIZE = 64*1024*1024;
 
+	/** Number of direct reads that are kept in progress at the same time */
+	static const size_t DIRECT_QUEUE_DEPTH = 16;
+
 	string file;
 	bool direct;
 	size_t blockSize;
 
 	vector<uint8_t> buffer;
 
+	atomic<size_t> bytesInFlight { 0 };
+	atomic<uint64_t> readWaitTime { 0 };
+
+	/** Kept for all files read with this reader (set up on the first direct read) */
+	class IoUring;
+	shared_ptr<IoUring> ring;
+	bool ringFailed = false;
+
 	/** Return an aligned buffer which is at least twice the size of ret.second */
 	size_t getBlockSize(size_t alignment);
 	void* align(void* buf, size_t alignment);
@@ -0,0 +1,239 @@
+/*
+ * Copyright (C) 2011-2016 AirDC++ Project
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+#ifndef DCPLUSPLUS_DCPP_FLAT_MULTIMAP_H
+#define DCPLUSPLUS_DCPP_FLAT_MULTIMAP_H
+
+#include "typedefs.h"
+
+namespace dcpp {
+
+/* Open-addressing (linear probing) multimap for pointer keys, such as the TTH indices.
+   All entries are stored in a single array so that there are no per-item allocations.
+   Items with an equal key are located in the same probe sequence, which ends in the first empty slot.
+   Erasing is done by shifting the following items backwards (no tombstones are needed).
+
+   Mostly compatible with the unordered_multimap interface; inserting or erasing invalidates all iterators. */
+
+template<class K, class V, class Hash = std::hash<K>, class Pred = std::equal_to<K>>
+class FlatMultiMap {
+public:
+	static_assert(std::is_pointer<K>::value, "Keys must be pointers (null is used for empty slots)");
+
+	typedef K key_type;
+	typedef V mapped_type;
+	typedef pair<K, V> value_type;
+	typedef size_t size_type;
+
+	template<bool IsConst>
+	class Iterator : public std::iterator<std::forward_iterator_tag, value_type, ptrdiff_t,
+		typename std::conditional<IsConst, const value_type*, value_type*>::type,
+		typename std::conditional<IsConst, const value_type&, value_type&>::type> {
+
+		typedef typename std::conditional<IsConst, const FlatMultiMap*, FlatMultiMap*>::type MapPtr;
+	public:
+		typedef typename std::conditional<IsConst, const value_type&, value_type&>::type reference;
+		typedef typename std::conditional<IsConst, const value_type*, value_type*>::type pointer;
+
+		Iterator() { }
+		Iterator(MapPtr aMap, size_t aPos, K aKey) : map(aMap), pos(aPos), key(aKey) { }
+
+		// Conversion from a non-const iterator
+		template<bool WasConst, class = typename std::enable_if<IsConst && !WasConst>::type>
+		Iterator(const Iterator<WasConst>& aIter) : map(aIter.map), pos(aIter.pos), key(aIter.key) { }
+
+		reference operator*() const { return map->slots[pos]; }
+		pointer operator->() const { return &map->slots[pos]; }
+
+		Iterator& operator++() {
+			if (key) {
+				pos = map->findNext(pos, key);
+			} else {
+				pos = map->nextUsed(pos + 1);
+			}
+			return *this;
+		}
+
+		Iterator operator++(int) { auto tmp = *this; ++(*this); return tmp; }
+
+		bool operator==(const Iterator& aOther) const { return pos == aOther.pos; }
+		bool operator!=(const Iterator& aOther) const { return pos != aOther.pos; }
+	private:
+		template<bool> friend class Iterator;
+		friend class FlatMultiMap;
+
+		MapPtr map = nullptr;
+		size_t pos = 0;
+
+		// Only the matching items are iterated if the key is set
+		K key = nullptr;
+	};
+
+	typedef Iterator<false> iterator;
+	typedef Iterator<true> const_iterator;
+
+	FlatMultiMap() { }
+
+	iterator begin() { return iterator(this, nextUsed(0), nullptr); }
+	iterator end() { return iterator(this, slots.size(), nullptr); }
+	const_iterator begin() const { return const_iterator(this, nextUsed(0), nullptr); }
+	const_iterator end() const { return const_iterator(this, slots.size(), nullptr); }
+
+	size_type size() const { return count; }
+	bool empty() const { return count == 0; }
+
+	void clear() {
+		vector<value_type>().swap(slots);
+		count = 0;
+	}
+
+	// Make room for at least the wanted number of items without rehashing
+	void reserve(size_type aItems) {
+		if (aItems <= maxItems(slots.size())) {
+			return;
+		}
+
+		size_t newSize = 16;
+		while (aItems > maxItems(newSize)) {
+			newSize *= 2;
+		}
+
+		vector<value_type> old(newSize);
+		old.swap(slots);
+		count = 0;
+
+		for (auto& v : old) {
+			if (v.first) {
+				insertUnique(std::move(v));
+			}
+		}
+	}
+
+	iterator emplace(K aKey, V aValue) {
+		reserve(count + 1);
+		return iterator(this, insertUnique(value_type(aKey, std::move(aValue))), aKey);
+	}
+
+	iterator insert(const value_type& aValue) {
+		return emplace(aValue.first, aValue.second);
+	}
+
+	template<class ForwardIt>
+	void insert(ForwardIt aFirst, ForwardIt aLast) {
+		reserve(count + std::distance(aFirst, aLast));
+		for (; aFirst != aLast; ++aFirst) {
+			insert(*aFirst);
+		}
+	}
+
+	iterator find(K aKey) {
+		auto pos = findFirst(aKey);
+		return iterator(this, pos, pos == slots.size() ? nullptr : slots[pos].first);
+	}
+
+	const_iterator find(K aKey) const {
+		auto pos = findFirst(aKey);
+		return const_iterator(this, pos, pos == slots.size() ? nullptr : slots[pos].first);
+	}
+
+	pair<iterator, iterator> equal_range(K aKey) {
+		return { find(aKey), end() };
+	}
+
+	pair<const_iterator, const_iterator> equal_range(K aKey) const {
+		return { find(aKey), end() };
+	}
+
+	void erase(const_iterator aIter) {
+		auto mask = slots.size() - 1;
+		auto hole = aIter.pos;
+
+		// Move the following items of the probe sequence to fill the hole
+		for (auto i = (hole + 1) & mask; slots[i].first; i = (i + 1) & mask) {
+			auto ideal = Hash()(slots[i].first) & mask;
+
+			// Items can't be moved before their ideal position
+			auto canMove = hole <= i ? (ideal <= hole || ideal > i) : (ideal <= hole && ideal > i);
+			if (canMove) {
+				slots[hole] = std::move(slots[i]);
+				hole = i;
+			}
+		}
+
+		slots[hole] = value_type();
+		count--;
+	}
+
+	// Bytes allocated for the slots
+	size_t getMemoryUsage() const { return slots.capacity() * sizeof(value_type); }
+private:
+	// Keep the load factor under 75%
+	static size_t maxItems(size_t aSlots) { return aSlots / 4 * 3; }
+
+	size_t insertUnique(value_type&& aValue) {
+		auto mask = slots.size() - 1;
+		auto pos = Hash()(aValue.first) & mask;
+		while (slots[pos].first) {
+			pos = (pos + 1) & mask;
+		}
+
+		slots[pos] = std::move(aValue);
+		count++;
+		return pos;
+	}
+
+	size_t findFirst(K aKey) const {
+		if (slots.empty()) {
+			return 0;
+		}
+
+		auto pos = Hash()(aKey) & (slots.size() - 1);
+		if (!slots[pos].first) {
+			return slots.size();
+		}
+
+		return Pred()(slots[pos].first, aKey) ? pos : findNext(pos, aKey);
+	}
+
+	// Returns the position of the next matching item in the probe sequence
+	size_t findNext(size_t aPos, K aKey) const {
+		auto mask = slots.size() - 1;
+		for (auto pos = (aPos + 1) & mask; slots[pos].first; pos = (pos + 1) & mask) {
+			if (Pred()(slots[pos].first, aKey)) {
+				return pos;
+			}
+		}
+
+		return slots.size();
+	}
+
+	size_t nextUsed(size_t aPos) const {
+		while (aPos < slots.size() && !slots[aPos].first) {
+			aPos++;
+		}
+
+		return aPos;
+	}
+
+	vector<value_type> slots;
+	size_t count = 0;
+};
+
+} // namespace dcpp
+
+#endif // !defined(DCPLUSPLUS_DCPP_FLAT_MULTIMAP_H)
@@ -70,6 +70,10 @@ void HashBloom::reset(size_t k_, size_t m, size_t h_) {
 }
 
 size_t HashBloom::pos(const TTHValue& tth, size_t n) const {
+	return pos(tth, n, h, bloom.size());
+}
+
+size_t HashBloom::pos(const TTHValue& tth, size_t n, size_t h, size_t m) {
 	if((n+1)*h > TTHValue::BITS) {
 		return 0;
 	}
@@ -86,7 +90,7 @@ size_t HashBloom::pos(const TTHValue& tth, size_t n) const {
 			x |= (1LL << i);
 		}
 	}
-	return x % bloom.size();
+	return x % m;
 }
 
 void HashBloom::copy_to(ByteVector& v) const {
@@ -96,4 +100,33 @@ void HashBloom::copy_to(ByteVector& v) const {
 	}
 }
 
+CountingHashBloom::CountingHashBloom(size_t k_, size_t m_, size_t h_) : counts(m_), bytes(m_ / 8), k(k_), m(m_), h(h_) {
+
+}
+
+void CountingHashBloom::add(const TTHValue& tth) {
+	for(size_t i = 0; i < k; ++i) {
+		auto p = HashBloom::pos(tth, i, h, m);
+		if(counts[p] < numeric_limits<uint8_t>::max()) {
+			counts[p]++;
+		}
+
+		bytes[p / 8] |= 1 << (p % 8);
+	}
+}
+
+void CountingHashBloom::remove(const TTHValue& tth) {
+	for(size_t i = 0; i < k; ++i) {
+		auto p = HashBloom::pos(tth, i, h, m);
+		if(counts[p] == 0 || counts[p] == numeric_limits<uint8_t>::max()) {
+			// Not added or saturated
+			continue;
+		}
+
+		if(--counts[p] == 0) {
+			bytes[p / 8] &= ~(1 << (p % 8));
+		}
+	}
+}
+
 }
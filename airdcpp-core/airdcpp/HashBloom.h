@@ -47,6 +47,9 @@ public:
 	void push_back(bool v);
 	
 	void copy_to(ByteVector& v) const;
+
+	/** Bit position for the hash n of tth */
+	static size_t pos(const TTHValue& tth, size_t n, size_t h, size_t m);
 private:	
 	
 	size_t pos(const TTHValue& tth, size_t n) const;
@@ -56,6 +59,30 @@ private:
 	size_t h;
 };
 
+/**
+ * Hash bloom that also allows removing items. A counter is kept for each bit
+ * (counters that reach the maximum value will stay set) and the serialized
+ * filter is updated as items are added or removed.
+ */
+class CountingHashBloom {
+public:
+	CountingHashBloom(size_t k, size_t m, size_t h);
+
+	void add(const TTHValue& tth);
+	void remove(const TTHValue& tth);
+
+	bool hasParams(size_t k_, size_t m_, size_t h_) const { return k == k_ && m == m_ && h == h_; }
+
+	/** The filter in the same format as with HashBloom::copy_to */
+	const ByteVector& getBytes() const { return bytes; }
+private:
+	std::vector<uint8_t> counts;
+	ByteVector bytes;
+	size_t k;
+	size_t m;
+	size_t h;
+};
+
 }
 
 #endif /*HASHBLOOM_H_*/
@@ -23,6 +23,7 @@
 #include "File.h"
 #include "FileReader.h"
 #include "LogManager.h"
+#include "ParallelTigerTree.h"
 #include "QueueManager.h"
 #include "ShareManager.h"
 #include "ResourceManager.h"
@@ -45,15 +46,32 @@ using boost::range::find_if;
 
 SharedMutex HashManager::Hasher::hcs;
 const int64_t HashManager::MIN_BLOCK_SIZE = 64 * 1024;
+const int64_t HashManager::PARALLEL_HASH_MIN_SIZE = 1024 * 1024 * 1024;
 
-HashManager::HashManager() {
+// Whether the files should be hashed without using the system caches
+static bool useDirectReads() noexcept {
+#ifdef _WIN32
+	return true;
+#else
+	// O_DIRECT isn't supported by all file systems and it may be slower with some of them
+	return SETTING(HASH_UNBUFFERED);
+#endif
+}
 
+HashManager::HashManager() {
+	TimerManager::getInstance()->addListener(this);
 }
 
 HashManager::~HashManager() {
+	TimerManager::getInstance()->removeListener(this);
 	optimizer.join();
 }
 
+void HashManager::on(TimerManagerListener::Second, uint64_t /*aTick*/) noexcept {
+	// Limit the amount of writes that can be lost on a crash (including those that aren't made by the hashers)
+	store.flush();
+}
+
 bool HashManager::checkTTH(const string& aFileLower, const string& aFileName, HashedFile& fi_) {
 	dcassert(Text::isLower(aFileLower));
 	if (!store.checkTTH(aFileLower, fi_)) {
@@ -63,6 +81,18 @@ bool HashManager::checkTTH(const string& aFileLower, const string& aFileName, Ha
 	return true;
 }
 
+vector<bool> HashManager::checkTTHs(const StringList& aFilesLower, const StringList& aFileNames, vector<HashedFile>& fileInfos_) {
+	dcassert(aFilesLower.size() == aFileNames.size() && aFilesLower.size() == fileInfos_.size());
+	auto ret = store.checkTTHs(aFilesLower, fileInfos_);
+	for (size_t i = 0; i < ret.size(); ++i) {
+		if (!ret[i]) {
+			hashFile(aFileNames[i], aFilesLower[i], fileInfos_[i].getSize());
+		}
+	}
+
+	return ret;
+}
+
 void HashManager::getFileInfo(const string& aFileLower, const string& aFileName, HashedFile& fi_) throw(HashException) {
 	dcassert(Text::isLower(aFileLower));
 	auto found = store.getFileInfo(aFileLower, fi_);
@@ -105,6 +135,11 @@ bool HashManager::hashFile(const string& filePath, const string& pathLower, int6
 
 	Hasher* h = nullptr;
 
+	// Check the location before locking, this requires disk access
+	auto diskOrder = SETTING(HASH_DISK_ORDER);
+	uint64_t physicalPos = 0;
+	auto physicalOffset = diskOrder && File::getPhysicalPosition(filePath, physicalPos);
+
 	WLock l(Hasher::hcs);
 
 	//get the volume name
@@ -176,7 +211,7 @@ bool HashManager::hashFile(const string& filePath, const string& pathLower, int6
 	}
 
 	//queue the file for hashing
-	return h->hashFile(filePath, pathLower, size, vol);
+	return h->hashFile(filePath, pathLower, size, vol, diskOrder, physicalPos, physicalOffset);
 }
 
 void HashManager::getFileTTH(const string& aFile, int64_t aSize, bool addStore, TTHValue& tth_, int64_t& sizeLeft_, const bool& aCancel, std::function<void(int64_t, const string&)> updateF/*nullptr*/) throw(HashException) {
@@ -192,7 +227,7 @@ void HashManager::getFileTTH(const string& aFile, int64_t aSize, bool addStore,
 		auto start = GET_TICK();
 		int64_t tickHashed = 0;
 
-		FileReader fr(true);
+		FileReader fr(useDirectReads());
 		fr.read(aFile, [&](const void* buf, size_t n) -> bool {
 			tt.update(buf, n);
 
@@ -279,6 +314,7 @@ void HashManager::HashStore::addFile(const string& aFileLower, const HashedFile&
 	saveFileInfo(buf, fi_);
 
 	try {
+		RLock l(commitCs);
 		fileDb->put((void*)aFileLower.c_str(), aFileLower.length(), (void*)buf, sz);
 	} catch(DbException& e) {
 		throw HashException(STRING_F(WRITE_FAILED_X, fileDb->getNameLower() % e.getError()));
@@ -294,12 +330,24 @@ void HashManager::renameFile(const string& aOldPath, const string& aNewPath, con
 void HashManager::HashStore::renameFile(const string& oldPath, const string& newPath, const HashedFile& fi) throw(HashException) {
 	auto oldNameLower = Text::toLower(oldPath);
 	auto newNameLower = Text::toLower(newPath);
-	//HashedFile fi;
-	//if (getFileInfo(oldNameLower, fi)) {
-		removeFile(oldNameLower);
-		addFile(newNameLower, fi);
-		//return true;
-	//}
+	auto sz = getFileInfoSize(fi);
+	void* buf = malloc(sz);
+	saveFileInfo(buf, fi);
+
+	// Apply both changes atomically
+	unique_ptr<DbBatch> batch(fileDb->createBatch());
+	batch->remove((void*)oldNameLower.c_str(), oldNameLower.length());
+	batch->put((void*)newNameLower.c_str(), newNameLower.length(), buf, sz);
+
+	try {
+		RLock l(commitCs);
+		fileDb->write(batch.get());
+	} catch (DbException& e) {
+		free(buf);
+		throw HashException(STRING_F(WRITE_FAILED_X, fileDb->getNameLower() % e.getError()));
+	}
+
+	free(buf);
 }
 
 void HashManager::HashStore::removeFile(const string& aFilePathLower) throw(HashException) {
@@ -515,6 +563,32 @@ bool HashManager::HashStore::checkTTH(const string& aFileLower, HashedFile& fi)
 	return false;
 }
 
+vector<bool> HashManager::HashStore::checkTTHs(const StringList& aFilesLower, vector<HashedFile>& fileInfos_) {
+	vector<bool> ret(aFilesLower.size(), false);
+
+	vector<DbKey> keys;
+	keys.reserve(aFilesLower.size());
+	for (const auto& path : aFilesLower) {
+		keys.emplace_back((void*)path.c_str(), path.length());
+	}
+
+	try {
+		fileDb->getMultiple(keys, [&](size_t aIndex, void* aValue, size_t valueLen) {
+			HashedFile fi;
+			if (loadFileInfo(aValue, valueLen, fi) && fi.getTimeStamp() == fileInfos_[aIndex].getTimeStamp() && fi.getSize() == fileInfos_[aIndex].getSize()) {
+				fileInfos_[aIndex] = fi;
+				ret[aIndex] = true;
+			}
+
+			return true;
+		});
+	} catch (DbException& e) {
+		LogManager::getInstance()->message(STRING_F(READ_FAILED_X, fileDb->getNameLower() % e.getError()), LogMessage::SEV_ERROR);
+	}
+
+	return ret;
+}
+
 bool HashManager::HashStore::getFileInfo(const string& aFileLower, HashedFile& fi_) {
 	try {
 		return fileDb->get((void*)aFileLower.c_str(), aFileLower.length(), sizeof(HashedFile), [&](void* aValue, size_t valueLen) {
@@ -732,6 +806,11 @@ void HashManager::HashStore::openDb(StepFunction stepF, MessageFunction messageF
 
 	hashDb->open(stepF, messageF);
 	fileDb->open(stepF, messageF);
+
+	// Syncing every write is slow when hashing lots of small files
+	// The writes of both databases are synced together by flush() (every second, when hashing finishes and when the databases are closed)
+	hashDb->setSyncWrites(false);
+	fileDb->setSyncWrites(false);
 }
 
 class HashLoader: public SimpleXMLReader::CallBack {
@@ -932,7 +1011,26 @@ void HashLoader::endTag(const string& name) {
 HashManager::HashStore::HashStore() {
 }
 
+void HashManager::HashStore::flush() noexcept {
+	// Trees first so that the file index won't refer to missing trees
+	// (the trees of all file entries in the log have been written before the flush started)
+	WLock l(commitCs);
+	for (auto db : { hashDb.get(), fileDb.get() }) {
+		if (!db) {
+			continue;
+		}
+
+		try {
+			db->flush();
+		} catch (DbException& e) {
+			LogManager::getInstance()->message(STRING_F(WRITE_FAILED_X, db->getNameLower() % e.getError()), LogMessage::SEV_ERROR);
+		}
+	}
+}
+
 void HashManager::HashStore::closeDb() {
+	flush();
+
 	hashDb.reset(nullptr);
 	fileDb.reset(nullptr);
 }
@@ -941,11 +1039,20 @@ HashManager::HashStore::~HashStore() {
 	closeDb();
 }
 
-bool HashManager::Hasher::hashFile(const string& fileName, const string& filePathLower, int64_t size, const string& devID) noexcept {
+bool HashManager::Hasher::hashFile(const string& fileName, const string& filePathLower, int64_t size, const string& devID, bool aDiskOrder, uint64_t aPhysicalPos, bool aPhysicalOffset) noexcept {
 	//always locked
-	auto ret = w.emplace_sorted(filePathLower, fileName, size, devID);
+	auto ret = w.emplace(filePathLower, WorkItem(fileName, size, devID, aDiskOrder, aPhysicalPos, aPhysicalOffset));
 	if (ret.second) {
-		devices[(*ret.first).devID]++; 
+		if (aDiskOrder) {
+			auto& queue = diskOrder[devID];
+			(aPhysicalOffset ? queue.offsets : queue.indexes).emplace(aPhysicalPos, filePathLower);
+
+			auto& dir = dirProgress[Util::getFilePath(filePathLower)];
+			dir.path = Util::getFilePath(fileName);
+			dir.filesLeft++;
+		}
+
+		devices[ret.first->second.devID]++; 
 		totalBytesLeft += size;
 		s.signal();
 		return true;
@@ -980,9 +1087,14 @@ void HashManager::Hasher::removeDevice(const string& aID) noexcept {
 
 void HashManager::Hasher::stopHashing(const string& baseDir) noexcept {
 	for (auto i = w.begin(); i != w.end();) {
-		if (Util::strnicmp(baseDir, i->filePath, baseDir.length()) == 0) {
-			totalBytesLeft -= i->fileSize;
-			removeDevice(i->devID);
+		if (Util::strnicmp(baseDir, i->second.filePath, baseDir.length()) == 0) {
+			totalBytesLeft -= i->second.fileSize;
+			removeDevice(i->second.devID);
+			if (i->second.diskOrder) {
+				removeDiskOrder(*i, false);
+				removeDirProgress(i->first);
+			}
+
 			i = w.erase(i);
 		} else {
 			++i;
@@ -1009,6 +1121,12 @@ void HashManager::getStats(string& curFile, int64_t& bytesLeft, size_t& filesLef
 		i->getStats(curFile, bytesLeft, filesLeft, speed);
 }
 
+void HashManager::getReadStats(int64_t& bytesInFlight_, uint64_t& readWaitTime_) const noexcept {
+	RLock l(Hasher::hcs);
+	for (auto i: hashers)
+		i->getReadStats(bytesInFlight_, readWaitTime_);
+}
+
 void HashManager::startMaintenance(bool verify){
 	optimizer.startMaintenance(verify); 
 }
@@ -1078,10 +1196,77 @@ void HashManager::shutdown(ProgressFunction progressF) noexcept {
 
 void HashManager::Hasher::clear() noexcept {
 	w.clear();
+	diskOrder.clear();
+	lastDevice.clear();
+	dirProgress.clear();
 	devices.clear();
 	totalBytesLeft = 0;
 }
 
+void HashManager::Hasher::removeDiskOrder(const WorkMap::value_type& aItem, bool aHashed) noexcept {
+	const auto& wi = aItem.second;
+	auto d = diskOrder.find(wi.devID);
+	if (d == diskOrder.end()) {
+		return;
+	}
+
+	auto& queue = d->second;
+	if (wi.physicalOffset) {
+		queue.offsets.erase({ wi.physicalPos, aItem.first });
+		if (aHashed) {
+			queue.lastOffset = wi.physicalPos;
+		}
+	} else {
+		queue.indexes.erase({ wi.physicalPos, aItem.first });
+		if (aHashed) {
+			queue.lastIndex = wi.physicalPos;
+		}
+	}
+
+	if (aHashed) {
+		lastDevice = wi.devID;
+	}
+
+	if (queue.offsets.empty() && queue.indexes.empty()) {
+		diskOrder.erase(d);
+	}
+}
+
+void HashManager::Hasher::removeDirProgress(const string& aFilePathLower) noexcept {
+	auto d = dirProgress.find(Util::getFilePath(aFilePathLower));
+	if (d != dirProgress.end() && --d->second.filesLeft == 0) {
+		dirProgress.erase(d);
+	}
+}
+
+HashManager::Hasher::WorkMap::iterator HashManager::Hasher::getNextFile() noexcept {
+	if (!diskOrder.empty()) {
+		// Stay on the same device while it has files left
+		auto d = diskOrder.find(lastDevice);
+		if (d == diskOrder.end()) {
+			d = diskOrder.begin();
+		}
+
+		// Continue forward from the previous location and wrap around when the end of the disk has been reached
+		// (files with an equal position are hashed in path order)
+		auto getNext = [](const DeviceQueue::PositionSet& aPositions, uint64_t aLastPos) {
+			auto p = aPositions.lower_bound({ aLastPos, Util::emptyString });
+			return p != aPositions.end() ? p : aPositions.begin();
+		};
+
+		const auto& queue = d->second;
+		auto p = !queue.offsets.empty() ? getNext(queue.offsets, queue.lastOffset) : getNext(queue.indexes, queue.lastIndex);
+
+		auto i = w.find(p->second);
+		dcassert(i != w.end());
+		if (i != w.end()) {
+			return i;
+		}
+	}
+
+	return w.begin();
+}
+
 void HashManager::Hasher::getStats(string& curFile, int64_t& bytesLeft, size_t& filesLeft, int64_t& speed) const noexcept {
 	curFile = currentFile;
 	filesLeft += w.size();
@@ -1091,6 +1276,27 @@ void HashManager::Hasher::getStats(string& curFile, int64_t& bytesLeft, size_t&
 	speed += lastSpeed;
 }
 
+void HashManager::Hasher::getReadStats(int64_t& bytesInFlight_, uint64_t& readWaitTime_) const noexcept {
+	bytesInFlight_ += reader.getBytesInFlight();
+	readWaitTime_ += reader.getReadWaitTime() / 1000;
+}
+
+void HashManager::Hasher::reportDirectory(const string& aPath, const string& aLastFile, int aFilesHashed, int64_t aSizeHashed, uint64_t aHashTime) noexcept {
+	getInstance()->fire(HashManagerListener::DirectoryHashed(), aPath, aFilesHashed, aSizeHashed, aHashTime, hasherID);
+	if (aFilesHashed == 1) {
+		getInstance()->log(STRING_F(HASHING_FINISHED_FILE, aLastFile % 
+			Util::formatBytes(aSizeHashed) % 
+			Util::formatTime(aHashTime / 1000, true) % 
+			(Util::formatBytes(aHashTime > 0 ? ((aSizeHashed * 1000) / aHashTime) : 0) + "/s" )), hasherID, false, false);
+	} else {
+		getInstance()->log(STRING_F(HASHING_FINISHED_DIR, Util::getFilePath(aPath) % 
+			aFilesHashed %
+			Util::formatBytes(aSizeHashed) % 
+			Util::formatTime(aHashTime / 1000, true) % 
+			(Util::formatBytes(aHashTime > 0 ? ((aSizeHashed * 1000) / aHashTime) : 0) + "/s" )), hasherID, false, false);
+	}
+}
+
 void HashManager::Hasher::instantPause() {
 	if(paused) {
 		t_suspend();
@@ -1122,18 +1328,26 @@ int HashManager::Hasher::run() {
 		int64_t originalSize = 0;
 		bool failed = true;
 		bool dirChanged = false;
+		bool diskOrdered = false;
 		string curDevID, pathLower;
 		{
 			WLock l(hcs);
 			if(!w.empty()) {
-				auto& wi = w.front();
-				dirChanged = initialDir.empty() || compare(Util::getFilePath(wi.filePath), Util::getFilePath(fname)) != 0;
+				auto i = getNextFile();
+				auto& wi = i->second;
+				diskOrdered = wi.diskOrder;
+				if (diskOrdered) {
+					removeDiskOrder(*i, true);
+				}
+
+				// Files of different directories may be hashed in turns in disk order
+				dirChanged = (!diskOrdered && initialDir.empty()) || compare(Util::getFilePath(wi.filePath), sfv.getPath()) != 0;
 				currentFile = fname = move(wi.filePath);
 				curDevID = move(wi.devID);
-				pathLower = move(wi.filePathLower);
+				pathLower = i->first;
 				originalSize = wi.fileSize;
 				dcassert(!curDevID.empty());
-				w.pop_front();
+				w.erase(i);
 			} else {
 				fname.clear();
 			}
@@ -1162,14 +1376,20 @@ int HashManager::Hasher::run() {
 				uint64_t timestamp = f.getLastModified();
 				TigerTree tt(bs);
 
+				// The tree of very large files is calculated with multiple threads (the file is still read sequentially)
+				unique_ptr<ParallelTigerTree> parallelTree;
+				if (size >= PARALLEL_HASH_MIN_SIZE && std::thread::hardware_concurrency() > 1) {
+					parallelTree.reset(new ParallelTigerTree(bs));
+				}
+
 				CRC32Filter crc32;
 
 				auto fileCRC = sfv.hasFile(Text::toLower(Util::getFileName(fname)));
 
 				uint64_t lastRead = GET_TICK();
  
-                FileReader fr(true);
-				fr.read(fname, [&](const void* buf, size_t n) -> bool {
+				reader.setDirect(useDirectReads());
+				reader.read(fname, [&](const void* buf, size_t n) -> bool {
 					if(SETTING(MAX_HASH_SPEED)> 0) {
 						uint64_t now = GET_TICK();
 						uint64_t minTime = n * 1000LL / Util::convertSize(SETTING(MAX_HASH_SPEED), Util::MB);
@@ -1181,7 +1401,11 @@ int HashManager::Hasher::run() {
 					} else {
 						lastRead = GET_TICK();
 					}
-					tt.update(buf, n);
+					if (parallelTree) {
+						parallelTree->update(buf, n);
+					} else {
+						tt.update(buf, n);
+					}
 				
 					if(fileCRC)
 						crc32(buf, n);
@@ -1198,7 +1422,12 @@ int HashManager::Hasher::run() {
 				});
 
 				f.close();
-				tt.finalize();
+
+				if (parallelTree) {
+					tt = parallelTree->finalize();
+				} else {
+					tt.finalize();
+				}
 
 				failed = fileCRC && crc32.getValue() != *fileCRC;
 
@@ -1236,20 +1465,13 @@ int HashManager::Hasher::run() {
 		}
 
 		auto onDirHashed = [&] () -> void {
+			if (initialDir.empty()) {
+				// Nothing hashed in path order (directories hashed in disk order are completed separately)
+				return;
+			}
+
 			if ((SETTING(HASHERS_PER_VOLUME) == 1 || w.empty()) && (dirFilesHashed > 1 || !failed)) {
-				getInstance()->fire(HashManagerListener::DirectoryHashed(), initialDir, dirFilesHashed, dirSizeHashed, dirHashTime, hasherID);
-				if (dirFilesHashed == 1) {
-					getInstance()->log(STRING_F(HASHING_FINISHED_FILE, currentFile % 
-						Util::formatBytes(dirSizeHashed) % 
-						Util::formatTime(dirHashTime / 1000, true) % 
-						(Util::formatBytes(dirHashTime > 0 ? ((dirSizeHashed * 1000) / dirHashTime) : 0) + "/s" )), hasherID, false, false);
-				} else {
-					getInstance()->log(STRING_F(HASHING_FINISHED_DIR, Util::getFilePath(initialDir) % 
-						dirFilesHashed %
-						Util::formatBytes(dirSizeHashed) % 
-						Util::formatTime(dirHashTime / 1000, true) % 
-						(Util::formatBytes(dirHashTime > 0 ? ((dirSizeHashed * 1000) / dirHashTime) : 0) + "/s" )), hasherID, false, false);
-				}
+				reportDirectory(initialDir, currentFile, dirFilesHashed, dirSizeHashed, dirHashTime);
 			}
 
 			totalDirsHashed++;
@@ -1260,12 +1482,39 @@ int HashManager::Hasher::run() {
 		};
 
 		bool deleteThis = false;
+		bool finished = false;
 		{
 			WLock l(hcs);
 			if (!fname.empty())
 				removeDevice(curDevID);
 
+			if (diskOrdered) {
+				auto d = dirProgress.find(Util::getFilePath(pathLower));
+				if (d != dirProgress.end()) {
+					auto& dir = d->second;
+					dir.filesHashed += dirFilesHashed;
+					dir.sizeHashed += dirSizeHashed;
+					dir.hashTime += dirHashTime;
+					dir.lastFile = fname;
+
+					if (--dir.filesLeft == 0) {
+						if ((SETTING(HASHERS_PER_VOLUME) == 1 || w.empty()) && dir.filesHashed > 0) {
+							reportDirectory(dir.path, dir.lastFile, dir.filesHashed, dir.sizeHashed, dir.hashTime);
+						}
+
+						totalDirsHashed++;
+						dirProgress.erase(d);
+					}
+				}
+
+				dirHashTime = 0;
+				dirSizeHashed = 0;
+				dirFilesHashed = 0;
+				initialDir.clear();
+			}
+
 			if (w.empty()) {
+				finished = true;
 				getInstance()->fire(HashManagerListener::HasherFinished(), totalDirsHashed, totalFilesHashed, totalSizeHashed, totalHashTime, hasherID);
 				if (totalSizeHashed > 0) {
 					if (totalDirsHashed == 0) {
@@ -1292,13 +1541,17 @@ int HashManager::Hasher::run() {
 				lastSpeed = 0;
 				deleteThis = hasherID != 0;
 				sfv.unload();
-			} else if (!AirUtil::isParentOrExactLocal(initialDir, w.front().filePath)) {
+			} else if (!AirUtil::isParentOrExactLocal(initialDir, getNextFile()->second.filePath)) {
 				onDirHashed();
 			}
 
 			currentFile.clear();
 		}
 
+		if (finished) {
+			getInstance()->store.flush();
+		}
+
 		if (!failed && !fname.empty())
 			getInstance()->fire(HashManagerListener::FileHashed(), fname, fi);
 
@@ -23,6 +23,7 @@
 #include "typedefs.h"
 
 #include "DbHandler.h"
+#include "FileReader.h"
 #include "HashedFile.h"
 #include "HashManagerListener.h"
 #include "MerkleTree.h"
@@ -32,6 +33,7 @@
 #include "SortedVector.h"
 #include "Speaker.h"
 #include "Thread.h"
+#include "TimerManager.h"
 
 namespace dcpp {
 
@@ -39,13 +41,16 @@ class File;
 class HashLoader;
 class FileException;
 
-class HashManager : public Singleton<HashManager>, public Speaker<HashManagerListener> {
+class HashManager : public Singleton<HashManager>, public Speaker<HashManagerListener>, private TimerManagerListener {
 
 public:
 
 	/** We don't keep leaves for blocks smaller than this... */
 	static const int64_t MIN_BLOCK_SIZE;
 
+	/** Files larger than this are hashed with multiple threads */
+	static const int64_t PARALLEL_HASH_MIN_SIZE;
+
 	HashManager();
 	~HashManager();
 
@@ -54,6 +59,13 @@ public:
 	 */
 	bool checkTTH(const string& fileLower, const string& aFileName, HashedFile& fi_);
 
+	/**
+	 * Same as checkTTH but all files are looked up with a single database pass (faster when checking many files from the same directory).
+	 * fileInfos_ must contain the current timestamps and sizes. Files that aren't current are queued for hashing.
+	 * @return whether each file was found
+	 */
+	vector<bool> checkTTHs(const StringList& aFilesLower, const StringList& aFileNames, vector<HashedFile>& fileInfos_);
+
 	void stopHashing(const string& baseDir) noexcept;
 	void setPriority(Thread::Priority p) noexcept;
 
@@ -70,6 +82,9 @@ public:
 
 	void getStats(string& curFile, int64_t& bytesLeft, size_t& filesLeft, int64_t& speed, int& hashers) const noexcept;
 
+	// Unbuffered reads of the running hashers: data requested from the disk but not read yet and the total time spent waiting for the reads (in milliseconds)
+	void getReadStats(int64_t& bytesInFlight_, uint64_t& readWaitTime_) const noexcept;
+
 	void getFileTTH(const string& aFile, int64_t aSize, bool addStore, TTHValue& tth_, int64_t& sizeLeft_, const bool& aCancel, std::function<void(int64_t /*timeLeft*/, const string& /*fileName*/)> updateF = nullptr)  throw(HashException);
 
 	/**
@@ -108,7 +123,8 @@ private:
 	public:
 		Hasher(bool isPaused, int aHasherID);
 
-		bool hashFile(const string& filePath, const string& filePathLower, int64_t size, const string& devID) noexcept;
+		// The disk location is used only if the file is queued in disk order
+		bool hashFile(const string& filePath, const string& filePathLower, int64_t size, const string& devID, bool aDiskOrder, uint64_t aPhysicalPos, bool aPhysicalOffset) noexcept;
 
 		/// @return whether hashing was already paused
 		bool pause() noexcept;
@@ -120,6 +136,7 @@ private:
 		void stopHashing(const string& baseDir) noexcept;
 		int run();
 		void getStats(string& curFile, int64_t& bytesLeft, size_t& filesLeft, int64_t& speed) const noexcept;
+		void getReadStats(int64_t& bytesInFlight_, uint64_t& readWaitTime_) const noexcept;
 		void shutdown();
 
 		bool hasFile(const string& aPath) const noexcept;
@@ -135,8 +152,8 @@ private:
 	private:
 		class WorkItem {
 		public:
-			WorkItem(const string& aFilePathLower, const string& aFilePath, int64_t aSize, const string& aDevID) noexcept 
-				: filePath(aFilePath), fileSize(aSize), devID(aDevID), filePathLower(aFilePathLower) { }
+			WorkItem(const string& aFilePath, int64_t aSize, const string& aDevID, bool aDiskOrder, uint64_t aPhysicalPos, bool aPhysicalOffset) noexcept 
+				: filePath(aFilePath), fileSize(aSize), devID(aDevID), diskOrder(aDiskOrder), physicalPos(aPhysicalPos), physicalOffset(aPhysicalOffset) { }
 			WorkItem(WorkItem&& rhs) = default;
 			WorkItem& operator=(WorkItem&&) = default;
 			WorkItem(const WorkItem&) = delete;
@@ -145,14 +162,58 @@ private:
 			string filePath;
 			int64_t fileSize;
 			string devID;
-			string filePathLower;
 
-			struct NameLower {
-				const string& operator()(const WorkItem& a) const { return a.filePathLower; }
-			};
+			// Queued while HASH_DISK_ORDER was enabled
+			bool diskOrder;
+
+			// Disk offset of the file, or the inode/file index number if the offset isn't available (see File::getPhysicalPosition)
+			uint64_t physicalPos;
+			bool physicalOffset;
+		};
+
+		// Files in path order, mapped by lowercase paths (files may be removed from any position in disk order mode)
+		typedef map<string, WorkItem, Util::PathSortOrderBool> WorkMap;
+		WorkMap w;
+
+		// Files queued in disk order on a single device, sorted by their location on disk (position, path lower)
+		// Disk offsets and inode/file index numbers can't be compared so they are kept separately, files with a known offset are hashed first
+		struct DeviceQueue {
+			typedef set<pair<uint64_t, string>> PositionSet;
+			PositionSet offsets;
+			PositionSet indexes;
+
+			// Position of the previous file, hashing continues forward from there
+			uint64_t lastOffset = 0;
+			uint64_t lastIndex = 0;
 		};
 
-		SortedVector<WorkItem, std::deque, string, Util::PathSortOrderInt, WorkItem::NameLower> w;
+		// Mapped by device IDs
+		map<string, DeviceQueue> diskOrder;
+		string lastDevice;
+
+		// Returns the file that should be hashed next (the queue must not be empty)
+		WorkMap::iterator getNextFile() noexcept;
+
+		// Pass aHashed = true if the file is going to be hashed next (the position of the device is updated)
+		void removeDiskOrder(const WorkMap::value_type& aItem, bool aHashed) noexcept;
+
+		// Files of a directory aren't hashed in a row in disk order so each directory is completed separately
+		struct DirectoryProgress {
+			string path;
+			string lastFile;
+			int filesLeft = 0;
+			int filesHashed = 0;
+			int64_t sizeHashed = 0;
+			uint64_t hashTime = 0;
+		};
+
+		// Directories with files queued in disk order, mapped by lowercase paths
+		unordered_map<string, DirectoryProgress> dirProgress;
+
+		void removeDirProgress(const string& aFilePathLower) noexcept;
+
+		// Fire the event and log the message for a finished directory
+		void reportDirectory(const string& aPath, const string& aLastFile, int aFilesHashed, int64_t aSizeHashed, uint64_t aHashTime) noexcept;
 
 		Semaphore s;
 		void removeDevice(const string& aID) noexcept;
@@ -179,6 +240,9 @@ private:
 
 		DirSFVReader sfv;
 
+		// Reused for all files (keeps the read buffers and the io_uring instance)
+		FileReader reader;
+
 		StringIntMap devices;
 	};
 
@@ -203,6 +267,7 @@ private:
 		void optimize(bool doVerify) noexcept;
 
 		bool checkTTH(const string& aFileNameLower, HashedFile& fi_);
+		vector<bool> checkTTHs(const StringList& aFilesLower, vector<HashedFile>& fileInfos_);
 
 		void addTree(const TigerTree& tt) throw(HashException);
 		bool getFileInfo(const string& aFileLower, HashedFile& aFile);
@@ -220,6 +285,9 @@ private:
 		void openDb(StepFunction stepF, MessageFunction messageF) throw(DbException);
 		void closeDb();
 
+		// Sync pending writes to disk (the trees are always synced before the file index)
+		void flush() noexcept;
+
 		void onScheduleRepair(bool schedule);
 		bool isRepairScheduled() const noexcept;
 
@@ -229,6 +297,8 @@ private:
 		std::unique_ptr<DbHandler> fileDb;
 		std::unique_ptr<DbHandler> hashDb;
 
+		// File index writes are blocked while flushing so that the synced entries can't refer to unsynced trees
+		SharedMutex commitCs;
 
 		friend class HashLoader;
 
@@ -273,6 +343,9 @@ private:
 	};
 
 	Optimizer optimizer;
+
+	// TimerManagerListener
+	void on(TimerManagerListener::Second, uint64_t aTick) noexcept;
 };
 
 } // namespace dcpp
@@ -0,0 +1,174 @@
+/*
+ * Copyright (C) 2011-2016 AirDC++ Project
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+#include "stdinc.h"
+#include "IncomingSearchQueue.h"
+
+#include "SettingsManager.h"
+
+namespace dcpp {
+
+IncomingSearchQueue::~IncomingSearchQueue() {
+	stop();
+}
+
+void IncomingSearchQueue::start(size_t aThreads) noexcept {
+	for (size_t i = 0; i < aThreads; ++i) {
+		workers.emplace_back(new Worker(*this));
+		workers.back()->start();
+	}
+}
+
+void IncomingSearchQueue::stop() noexcept {
+	{
+		FastLock l(cs);
+		if (stopping)
+			return;
+
+		stopping = true;
+	}
+
+	for (size_t i = 0; i < workers.size(); ++i) {
+		s.signal();
+	}
+
+	for (auto& w : workers) {
+		w->join();
+	}
+
+	workers.clear();
+
+	// Release the queued searches (and the users/hubs referenced by them)
+	FastLock l(cs);
+	for (auto& hubs : searches) {
+		hubs.clear();
+	}
+
+	queued = 0;
+}
+
+bool IncomingSearchQueue::add(const string& aHubUrl, Priority aPriority, Callback&& aCallback) noexcept {
+	{
+		FastLock l(cs);
+		if (stopping) {
+			return false;
+		}
+
+		auto maxQueued = static_cast<size_t>(max(SETTING(INCOMING_SEARCH_QUEUE_SIZE), 1));
+		if (queued >= maxQueued) {
+			dropped++;
+
+			// Priority searches may always replace normal ones
+			auto dropQueued = aPriority == PRIO_HIGH || SETTING(INCOMING_SEARCH_DROP_MODE) == SettingsManager::SEARCH_DROP_FLOODING;
+			if (!dropQueued || !dropFlooding()) {
+				return false;
+			}
+		}
+
+		searches[aPriority][aHubUrl].push_back(move(aCallback));
+		queued++;
+	}
+
+	s.signal();
+	return true;
+}
+
+bool IncomingSearchQueue::dropFlooding() noexcept {
+	auto& hubs = searches[PRIO_NORMAL];
+	auto longest = max_element(hubs.begin(), hubs.end(), [](const HubSearchMap::value_type& a, const HubSearchMap::value_type& b) {
+		return a.second.size() < b.second.size();
+	});
+
+	if (longest == hubs.end()) {
+		return false;
+	}
+
+	longest->second.pop_front();
+	if (longest->second.empty()) {
+		hubs.erase(longest);
+	}
+
+	queued--;
+	return true;
+}
+
+bool IncomingSearchQueue::pop(Callback& callback_) noexcept {
+	FastLock l(cs);
+	for (int prio = PRIO_HIGH; prio < PRIO_LAST; ++prio) {
+		auto& hubs = searches[prio];
+		if (hubs.empty()) {
+			continue;
+		}
+
+		// Continue from the next hub
+		auto hub = hubs.upper_bound(lastHub[prio]);
+		if (hub == hubs.end()) {
+			hub = hubs.begin();
+		}
+
+		callback_ = move(hub->second.front());
+		hub->second.pop_front();
+
+		lastHub[prio] = hub->first;
+		if (hub->second.empty()) {
+			hubs.erase(hub);
+		}
+
+		queued--;
+		return true;
+	}
+
+	return false;
+}
+
+IncomingSearchQueue::Stats IncomingSearchQueue::getStats() const noexcept {
+	Stats stats;
+
+	FastLock l(cs);
+	stats.queued = queued;
+	stats.processed = processed;
+	stats.dropped = dropped;
+	return stats;
+}
+
+int IncomingSearchQueue::Worker::run() {
+	for (;;) {
+		queue.s.wait();
+
+		{
+			FastLock l(queue.cs);
+			if (queue.stopping) {
+				break;
+			}
+		}
+
+		Callback callback;
+		if (!queue.pop(callback)) {
+			continue;
+		}
+
+		callback();
+
+		FastLock l(queue.cs);
+		queue.processed++;
+	}
+
+	return 0;
+}
+
+} // namespace dcpp
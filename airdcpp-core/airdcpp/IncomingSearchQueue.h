@@ -0,0 +1,95 @@
+/*
+ * Copyright (C) 2011-2016 AirDC++ Project
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+#ifndef DCPLUSPLUS_DCPP_INCOMING_SEARCH_QUEUE_H
+#define DCPLUSPLUS_DCPP_INCOMING_SEARCH_QUEUE_H
+
+#include "typedefs.h"
+
+#include "CriticalSection.h"
+#include "Semaphore.h"
+#include "Thread.h"
+
+namespace dcpp {
+
+// Bounded queue for answering incoming searches with worker threads so that the hub threads won't be blocked
+// Hubs are served in turns and priority searches (direct/TTH) are always handled first
+class IncomingSearchQueue : boost::noncopyable {
+public:
+	typedef std::function<void()> Callback;
+
+	enum Priority {
+		PRIO_HIGH,
+		PRIO_NORMAL,
+		PRIO_LAST
+	};
+
+	struct Stats {
+		size_t queued = 0;
+		uint64_t processed = 0;
+		uint64_t dropped = 0;
+	};
+
+	IncomingSearchQueue() { }
+	~IncomingSearchQueue();
+
+	// Returns false if the search was dropped
+	bool add(const string& aHubUrl, Priority aPriority, Callback&& aCallback) noexcept;
+
+	void start(size_t aThreads) noexcept;
+
+	// Waits for the running searches, queued searches are discarded
+	void stop() noexcept;
+
+	Stats getStats() const noexcept;
+private:
+	class Worker : public Thread {
+	public:
+		Worker(IncomingSearchQueue& aQueue) : queue(aQueue) { }
+	private:
+		int run();
+		IncomingSearchQueue& queue;
+	};
+
+	typedef deque<Callback> SearchList;
+	typedef map<string, SearchList> HubSearchMap;
+
+	bool pop(Callback& callback_) noexcept;
+
+	// Remove the oldest normal search from the hub with most searches in queue
+	bool dropFlooding() noexcept;
+
+	HubSearchMap searches[PRIO_LAST];
+
+	// Hub that was served last for each priority
+	string lastHub[PRIO_LAST];
+
+	vector<unique_ptr<Worker>> workers;
+	Semaphore s;
+
+	size_t queued = 0;
+	uint64_t processed = 0;
+	uint64_t dropped = 0;
+	bool stopping = false;
+
+	mutable FastCriticalSection cs;
+};
+
+} // namespace dcpp
+
+#endif // !defined(DCPLUSPLUS_DCPP_INCOMING_SEARCH_QUEUE_H)
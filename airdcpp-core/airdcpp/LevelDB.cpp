@@ -117,8 +117,14 @@ void LevelDB::repair(StepFunction stepF, MessageFunction messageF) throw(DbExcep
 }
 
 LevelDB::~LevelDB() {
-	if (db)
+	if (db) {
+		try {
+			flush();
+		} catch (const DbException&) {}
+
 		delete db;
+	}
+
 	delete defaultOptions.filter_policy;
 	delete defaultOptions.block_cache;
 }
@@ -132,6 +138,56 @@ void LevelDB::put(void* aKey, size_t keyLen, void* aValue, size_t valueLen, DbSn
 
 	// leveldb will replace existing values
 	DBACTION(db->Put(writeoptions, key, value));
+	onWriteCompleted();
+}
+
+void LevelDB::LevelBatch::put(void* aKey, size_t keyLen, void* aValue, size_t valueLen) noexcept {
+	wb.Put(leveldb::Slice((const char*)aKey, keyLen), leveldb::Slice((const char*)aValue, valueLen));
+	count++;
+}
+
+void LevelDB::LevelBatch::remove(void* aKey, size_t keyLen) noexcept {
+	wb.Delete(leveldb::Slice((const char*)aKey, keyLen));
+	count++;
+}
+
+DbBatch* LevelDB::createBatch() noexcept {
+	return new LevelBatch();
+}
+
+void LevelDB::write(DbBatch* aBatch) throw(DbException) {
+	auto batch = static_cast<LevelBatch*>(aBatch);
+	if (batch->count == 0)
+		return;
+
+	totalWrites += batch->count;
+	DBACTION(db->Write(writeoptions, &batch->wb));
+	onWriteCompleted();
+}
+
+void LevelDB::onWriteCompleted() noexcept {
+	if (writeoptions.sync)
+		return;
+
+	// set after the write so that a concurrent flush can't clear the flag before the data is in the log
+	FastLock l(cs);
+	unsyncedWrites = true;
+}
+
+void LevelDB::flush() throw(DbException) {
+	{
+		FastLock l(cs);
+		if (!unsyncedWrites)
+			return;
+
+		unsyncedWrites = false;
+	}
+
+	// an empty synced write will flush the log
+	leveldb::WriteBatch wb;
+	leveldb::WriteOptions options;
+	options.sync = true;
+	DBACTION(db->Write(options, &wb));
 }
 
 bool LevelDB::get(void* aKey, size_t keyLen, size_t /*initialValueLen*/, std::function<bool(void* aValue, size_t aValueLen)> loadF, DbSnapshot* /*aSnapshot*/ /*nullptr*/) throw(DbException) {
@@ -146,6 +202,43 @@ bool LevelDB::get(void* aKey, size_t keyLen, size_t /*initialValueLen*/, std::fu
 	return false;
 }
 
+void LevelDB::getMultiple(const vector<DbKey>& aKeys, std::function<bool(size_t aIndex, void* aValue, size_t aValueLen)> loadF, DbSnapshot* aSnapshot /*nullptr*/) throw(DbException) {
+	// go through the keys in sorted order so that the same iterator can be moved forward instead of doing a separate lookup for each key
+	vector<size_t> order(aKeys.size());
+	iota(order.begin(), order.end(), 0);
+	sort(order.begin(), order.end(), [&aKeys](size_t a, size_t b) {
+		return leveldb::Slice((const char*)aKeys[a].first, aKeys[a].second).compare(leveldb::Slice((const char*)aKeys[b].first, aKeys[b].second)) < 0;
+	});
+
+	leveldb::ReadOptions options = readoptions;
+	if (aSnapshot)
+		options.snapshot = static_cast<LevelSnapshot*>(aSnapshot)->snapshot;
+
+	auto it = unique_ptr<leveldb::Iterator>(db->NewIterator(options));
+	bool first = true;
+	for (auto i : order) {
+		leveldb::Slice key((const char*)aKeys[i].first, aKeys[i].second);
+
+		// the iterator points to the first entry after the previous key, nothing has to be done if we aren't past the wanted key
+		if (first || (it->Valid() && it->key().compare(key) < 0)) {
+			it->Seek(key);
+			first = false;
+		}
+
+		checkDbError(it->status());
+		if (!it->Valid()) {
+			// no more entries
+			break;
+		}
+
+		if (it->key().compare(key) == 0) {
+			totalReads++;
+			loadF(i, (void*)it->value().data(), it->value().size());
+			it->Next();
+		}
+	}
+}
+
 string LevelDB::getStats() throw(DbException) {
 	string ret;
 	string value = "leveldb.stats";
@@ -173,6 +266,7 @@ bool LevelDB::hasKey(void* aKey, size_t keyLen, DbSnapshot* /*aSnapshot*/ /*null
 void LevelDB::remove(void* aKey, size_t keyLen, DbSnapshot* /*aSnapshot*/ /*nullptr*/) throw(DbException) {
 	leveldb::Slice key((const char*)aKey, keyLen);
 	DBACTION(db->Delete(writeoptions, key));
+	onWriteCompleted();
 }
 
 int64_t LevelDB::getSizeOnDisk() throw(DbException) {
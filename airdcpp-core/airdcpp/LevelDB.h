@@ -20,12 +20,14 @@
 #ifndef DCPLUSPLUS_DCPP_LEVELDB_H_
 #define DCPLUSPLUS_DCPP_LEVELDB_H_
 
+#include "CriticalSection.h"
 #include "DbHandler.h"
 
 #include <leveldb/status.h>
 #include <leveldb/db.h>
 #include <leveldb/env.h>
 #include <leveldb/options.h>
+#include <leveldb/write_batch.h>
 
 namespace dcpp {
 
@@ -41,6 +43,13 @@ public:
 	void remove(void* aKey, size_t keyLen, DbSnapshot* aSnapshot /*nullptr*/) throw(DbException);
 	bool hasKey(void* aKey, size_t keyLen, DbSnapshot* aSnapshot /*nullptr*/) throw(DbException);
 
+	DbBatch* createBatch() noexcept;
+	void write(DbBatch* aBatch) throw(DbException);
+	void getMultiple(const vector<DbKey>& aKeys, std::function<bool(size_t aIndex, void* aValue, size_t aValueLen)> loadF, DbSnapshot* aSnapshot /*nullptr*/) throw(DbException);
+
+	void setSyncWrites(bool aSync) noexcept { writeoptions.sync = aSync; }
+	void flush() throw(DbException);
+
 	string getStats() throw(DbException);
 
 	size_t size(bool /*thorough*/, DbSnapshot* aSnapshot /*nullptr*/) throw(DbException);
@@ -65,6 +74,19 @@ private:
 		const leveldb::Snapshot* snapshot;
 	};
 
+	class LevelBatch : public DbBatch {
+	public:
+		void put(void* aKey, size_t keyLen, void* aValue, size_t valueLen) noexcept;
+		void remove(void* aKey, size_t keyLen) noexcept;
+		size_t size() const noexcept { return count; }
+
+		leveldb::WriteBatch wb;
+		size_t count = 0;
+	};
+
+	// Remember that the log has writes that haven't been synced yet (call after the write has completed)
+	void onWriteCompleted() noexcept;
+
 	string getRepairFlag() const;
 	leveldb::Status performDbOperation(function<leveldb::Status()> f) throw(DbException);
 	void checkDbError(leveldb::Status aStatus) throw(DbException);
@@ -83,6 +105,9 @@ private:
 	// options used when writing to the database
 	leveldb::WriteOptions writeoptions;
 
+	bool unsyncedWrites = false;
+	FastCriticalSection cs;
+
 	uint64_t totalReads;
 	uint64_t totalWrites;
 	uint64_t ioErrors;
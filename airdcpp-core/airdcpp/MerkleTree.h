@@ -106,21 +106,39 @@ public:
 			return;
 		
 		do {
+			// Hash the full blocks in batches so that the hasher can process them in parallel
+			size_t batch = min((len - i) / baseBlockSize, (size_t)LEAF_BATCH_SIZE);
+			if(batch > 1) {
+				uint8_t hashes[LEAF_BATCH_SIZE * BYTES];
+				Hasher::hashMultiple(zero, buf + i, baseBlockSize, batch, hashes);
+				for(size_t j = 0; j < batch; ++j) {
+					addBlock(MerkleValue(hashes + j * BYTES), baseBlockSize);
+				}
+
+				i += batch * baseBlockSize;
+				continue;
+			}
+
 			size_t n = min(baseBlockSize, len-i);
 			Hasher h;
 			h.update(&zero, 1);
 			h.update(buf + i, n);
-			if((int64_t)baseBlockSize < blockSize) {
-				blocks.emplace_back(MerkleValue(h.finalize()), baseBlockSize);
-				reduceBlocks();
-			} else {
-				leaves.emplace_back(h.finalize());
-			}
+			addBlock(MerkleValue(h.finalize()), baseBlockSize);
 			i += n;
 		} while(i < len);
 		fileSize += len;
 	}
 
+	/**
+	 * Add the root of a subtree that was calculated separately (for example in parallel).
+	 * @param aSize Size of the hashed data, must be a power of two multiple of baseBlockSize
+	 *              not larger than the block size, unless it's the last subtree.
+	 */
+	void addSubtree(const MerkleValue& aRoot, int64_t aSize) {
+		addBlock(aRoot, aSize);
+		fileSize += aSize;
+	}
+
 	uint8_t* finalize() {
 		// No updates yet, make sure we have at least one leaf for 0-length files...
 		if(leaves.empty() && blocks.empty()) {
@@ -170,6 +188,8 @@ public:
 
 
 private:	
+	enum { LEAF_BATCH_SIZE = 64 };
+
 	typedef pair<MerkleValue, int64_t> MerkleBlock;
 	typedef vector<MerkleBlock> MBList;
 
@@ -205,6 +225,15 @@ private:
 		return MerkleValue(h.finalize());
 	}
 
+	void addBlock(const MerkleValue& aHash, int64_t aSize) {
+		if(aSize < blockSize) {
+			blocks.emplace_back(aHash, aSize);
+			reduceBlocks();
+		} else {
+			leaves.push_back(aHash);
+		}
+	}
+
 	void reduceBlocks() {
 		while(blocks.size() > 1) {
 			MerkleBlock& a = blocks[blocks.size()-2];
@@ -0,0 +1,256 @@
+/*
+ * Copyright (C) 2011-2016 AirDC++ Project
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+#ifndef DCPLUSPLUS_DCPP_NGRAM_INDEX_H
+#define DCPLUSPLUS_DCPP_NGRAM_INDEX_H
+
+#include "typedefs.h"
+
+namespace dcpp {
+
+/* Inverted index that maps n-grams of (lowercase) names to the items containing them.
+   Each posting list is kept sorted so that lists can be intersected with a linear merge.
+   Changes are applied in batches to avoid moving the same list around for every item.
+   Small insertions (e.g. single hashed files) are collected in a sorted pending list that is merged
+   into the posting lists once it grows large enough. */
+
+template<class T, size_t N = 3>
+class NgramIndex {
+public:
+	static_assert(N > 0 && N <= 4, "N-grams must fit in 32 bits");
+
+	typedef vector<T> List;
+	typedef vector<pair<uint32_t, T>> ChangeList;
+
+	NgramIndex() { }
+	~NgramIndex() { }
+
+	// Append the n-grams of a string (unsorted, may contain duplicates)
+	static void getNgrams(const string& aStr, vector<uint32_t>& ngrams_) noexcept {
+		if (aStr.length() < N) {
+			return;
+		}
+
+		for (string::size_type i = 0; i <= aStr.length() - N; ++i) {
+			ngrams_.push_back(toNgram(aStr.data() + i));
+		}
+	}
+
+	// Queue the supplied n-grams for the item
+	static void addChanges(const vector<uint32_t>& aNgrams, T aItem, ChangeList& changes_) noexcept {
+		for (auto ngram : aNgrams) {
+			changes_.emplace_back(ngram, aItem);
+		}
+	}
+
+	// Sort and remove duplicates from the queued changes
+	// Can be used to prepare the changes before locking the index (otherwise it's done when the changes are applied)
+	static void sortChanges(ChangeList& changes_) noexcept {
+		if (!is_sorted(changes_.begin(), changes_.end())) {
+			sort(changes_.begin(), changes_.end());
+		}
+
+		changes_.erase(unique(changes_.begin(), changes_.end()), changes_.end());
+	}
+
+	// Apply new entries queued with addChanges
+	void insert(ChangeList& aChanges) noexcept {
+		sortChanges(aChanges);
+
+		if (pending.size() + aChanges.size() < MAX_PENDING) {
+			// Skip entries that exist in the lists already
+			aChanges.erase(remove_if(aChanges.begin(), aChanges.end(), [this](const typename ChangeList::value_type& aChange) {
+				auto i = lists.find(aChange.first);
+				return i != lists.end() && binary_search(i->second.begin(), i->second.end(), aChange.second);
+			}), aChanges.end());
+
+			auto oldSize = pending.size();
+
+			ChangeList merged;
+			merged.reserve(oldSize + aChanges.size());
+			set_union(pending.begin(), pending.end(), aChanges.begin(), aChanges.end(), back_inserter(merged));
+			pending.swap(merged);
+
+			entryCount += pending.size() - oldSize;
+			aChanges.clear();
+			return;
+		}
+
+		// Apply everything in a single pass
+		entryCount -= pending.size();
+		if (!pending.empty()) {
+			ChangeList merged;
+			merged.reserve(pending.size() + aChanges.size());
+			set_union(pending.begin(), pending.end(), aChanges.begin(), aChanges.end(), back_inserter(merged));
+			aChanges.swap(merged);
+			ChangeList().swap(pending);
+		}
+
+		forEachGroup(aChanges, [this](uint32_t aNgram, List& aItems) {
+			auto& list = lists[aNgram];
+			auto oldSize = list.size();
+
+			List merged;
+			merged.reserve(oldSize + aItems.size());
+			set_union(list.begin(), list.end(), aItems.begin(), aItems.end(), back_inserter(merged));
+			list.swap(merged);
+
+			entryCount += list.size() - oldSize;
+		});
+	}
+
+	// Remove entries queued with addChanges
+	void erase(ChangeList& aChanges) noexcept {
+		if (!pending.empty()) {
+			sortChanges(aChanges);
+
+			auto oldSize = pending.size();
+			pending.erase(set_difference(pending.begin(), pending.end(), aChanges.begin(), aChanges.end(), pending.begin()), pending.end());
+			entryCount -= oldSize - pending.size();
+		}
+
+		forEachGroup(aChanges, [this](uint32_t aNgram, List& aItems) {
+			auto i = lists.find(aNgram);
+			if (i == lists.end()) {
+				return;
+			}
+
+			auto& list = i->second;
+			auto oldSize = list.size();
+			list.erase(set_difference(list.begin(), list.end(), aItems.begin(), aItems.end(), list.begin()), list.end());
+			entryCount -= oldSize - list.size();
+
+			if (list.empty()) {
+				lists.erase(i);
+			} else if (list.capacity() > list.size() * 2) {
+				list.shrink_to_fit();
+			}
+		});
+	}
+
+	// Get the items containing every n-gram of the string (sorted)
+	// Returns false if the string is too short to be looked up from the index
+	bool find(const string& aStr, List& items_) const noexcept {
+		items_.clear();
+
+		vector<uint32_t> ngrams;
+		getNgrams(aStr, ngrams);
+		if (ngrams.empty()) {
+			return false;
+		}
+
+		sort(ngrams.begin(), ngrams.end());
+		ngrams.erase(unique(ngrams.begin(), ngrams.end()), ngrams.end());
+
+		// Lists combined with the pending entries
+		vector<List> combined;
+		combined.reserve(ngrams.size());
+
+		// Start from the shortest list
+		vector<const List*> found;
+		for (auto ngram : ngrams) {
+			auto i = lists.find(ngram);
+			auto p = equal_range(pending.begin(), pending.end(), make_pair(ngram, T()), [](const typename ChangeList::value_type& a, const typename ChangeList::value_type& b) {
+				return a.first < b.first;
+			});
+
+			if (p.first == p.second) {
+				if (i == lists.end()) {
+					return true;
+				}
+
+				found.push_back(&i->second);
+				continue;
+			}
+
+			combined.emplace_back();
+			auto& list = combined.back();
+			for (auto j = p.first; j != p.second; ++j) {
+				list.push_back(j->second);
+			}
+
+			if (i != lists.end()) {
+				List merged;
+				merged.reserve(list.size() + i->second.size());
+				set_union(i->second.begin(), i->second.end(), list.begin(), list.end(), back_inserter(merged));
+				list.swap(merged);
+			}
+
+			found.push_back(&list);
+		}
+
+		sort(found.begin(), found.end(), [](const List* a, const List* b) { return a->size() < b->size(); });
+
+		items_ = *found.front();
+		for (auto i = found.begin() + 1; i != found.end() && !items_.empty(); ++i) {
+			items_.erase(set_intersection(items_.begin(), items_.end(), (*i)->begin(), (*i)->end(), items_.begin()), items_.end());
+		}
+
+		return true;
+	}
+
+	size_t getNgramCount() const noexcept { return lists.size(); }
+	size_t getEntryCount() const noexcept { return entryCount; }
+	static size_t getNgramLength() noexcept { return N; }
+
+	void clear() noexcept {
+		lists.clear();
+		ChangeList().swap(pending);
+		entryCount = 0;
+	}
+private:
+	static const size_t MAX_PENDING = 4096;
+
+	static uint32_t toNgram(const char* aPos) noexcept {
+		uint32_t ret = 0;
+		for (size_t i = 0; i < N; ++i) {
+			ret = (ret << 8) | static_cast<uint8_t>(aPos[i]);
+		}
+		return ret;
+	}
+
+	// Call the handler with sorted and unique items for each n-gram
+	template<class HandlerT>
+	static void forEachGroup(ChangeList& aChanges, HandlerT aHandler) noexcept {
+		sortChanges(aChanges);
+
+		List items;
+		for (auto i = aChanges.begin(); i != aChanges.end();) {
+			auto ngram = i->first;
+
+			items.clear();
+			for (; i != aChanges.end() && i->first == ngram; ++i) {
+				items.push_back(i->second);
+			}
+
+			aHandler(ngram, items);
+		}
+
+		aChanges.clear();
+	}
+
+	unordered_map<uint32_t, List> lists;
+
+	// Sorted entries that haven't been merged into the lists yet (none of them exist in the lists)
+	ChangeList pending;
+	size_t entryCount = 0;
+};
+
+} // namespace dcpp
+
+#endif // !defined(DCPLUSPLUS_DCPP_NGRAM_INDEX_H)
@@ -0,0 +1,118 @@
+/* 
+ * Copyright (C) 2001-2016 Jacek Sieka, arnetheduck on gmail point com
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+#include "stdinc.h"
+#include "ParallelTigerTree.h"
+
+namespace dcpp {
+
+// Data size of a single chunk (a power of two multiple of TigerTree::BASE_BLOCK_SIZE)
+#define PARALLEL_TREE_CHUNK_SIZE (8 * 1024 * 1024)
+
+ParallelTigerTree::ParallelTigerTree(int64_t aBlockSize, size_t aThreads) : tree(aBlockSize), subtreeSize(min(aBlockSize, static_cast<int64_t>(PARALLEL_TREE_CHUNK_SIZE))),
+	maxChunks(aThreads > 0 ? aThreads : max(std::thread::hardware_concurrency(), 1U)) {
+
+	// Chunks must contain whole subtrees
+	dcassert(aBlockSize % TigerTree::BASE_BLOCK_SIZE == 0 && PARALLEL_TREE_CHUNK_SIZE % subtreeSize == 0);
+	input.reserve(PARALLEL_TREE_CHUNK_SIZE);
+}
+
+ParallelTigerTree::~ParallelTigerTree() {
+	// Wait for the running tasks
+	for (auto& c : chunks) {
+		try {
+			c.task->wait();
+		} catch (...) {
+		}
+	}
+}
+
+TigerTree::MerkleList ParallelTigerTree::hashChunk(const ByteVector& aData, int64_t aSubtreeSize) {
+	TigerTree tt(aSubtreeSize);
+	tt.update(aData.data(), aData.size());
+	tt.finalize();
+	return tt.getLeaves();
+}
+
+void ParallelTigerTree::startChunk() {
+	auto result = make_shared<Chunk::Result>();
+	result->data.swap(input);
+	input.reserve(PARALLEL_TREE_CHUNK_SIZE);
+
+	Chunk chunk;
+	chunk.size = result->data.size();
+	chunk.result = result;
+	chunk.task.reset(new task_group());
+
+	auto blockSize = subtreeSize;
+	chunk.task->run([result, blockSize] {
+		result->roots = hashChunk(result->data, blockSize);
+		ByteVector().swap(result->data);
+		result->finished = true;
+	});
+
+	chunks.push_back(move(chunk));
+}
+
+void ParallelTigerTree::addChunk(Chunk& aChunk) {
+	aChunk.task->wait();
+	const auto& roots = aChunk.result->roots;
+
+	// Only the last subtree of the data may be partial
+	auto size = aChunk.size;
+	for (const auto& root : roots) {
+		tree.addSubtree(root, min(size, subtreeSize));
+		size -= subtreeSize;
+	}
+}
+
+void ParallelTigerTree::update(const void* aData, size_t aLen) {
+	auto data = static_cast<const uint8_t*>(aData);
+	while (aLen > 0) {
+		auto n = min(aLen, PARALLEL_TREE_CHUNK_SIZE - input.size());
+		input.insert(input.end(), data, data + n);
+		data += n;
+		aLen -= n;
+
+		if (input.size() == PARALLEL_TREE_CHUNK_SIZE) {
+			startChunk();
+		}
+	}
+
+	// Add the hashed chunks in order (wait if there are too many of them)
+	while (!chunks.empty() && (chunks.size() > maxChunks || chunks.front().result->finished)) {
+		addChunk(chunks.front());
+		chunks.pop_front();
+	}
+}
+
+TigerTree& ParallelTigerTree::finalize() {
+	if (!input.empty()) {
+		startChunk();
+	}
+
+	while (!chunks.empty()) {
+		addChunk(chunks.front());
+		chunks.pop_front();
+	}
+
+	tree.finalize();
+	return tree;
+}
+
+} // namespace dcpp
@@ -0,0 +1,75 @@
+/*
+ * Copyright (C) 2001-2016 Jacek Sieka, arnetheduck on gmail point com
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+#ifndef DCPLUSPLUS_DCPP_PARALLEL_TIGER_TREE_H
+#define DCPLUSPLUS_DCPP_PARALLEL_TIGER_TREE_H
+
+#include "typedefs.h"
+#include "concurrency.h"
+#include "MerkleTree.h"
+
+namespace dcpp {
+
+/* Hashes the data in independent chunks with the shared task threads. The chunks are aligned with the leaves
+   (or with the subtrees of large leaves) and their roots are added to the tree the same way as MerkleTree
+   combines blocks, so the result is identical to hashing the data sequentially. */
+class ParallelTigerTree : boost::noncopyable {
+public:
+	// Maximum number of chunks in progress, uses the number of available cores by default
+	ParallelTigerTree(int64_t aBlockSize, size_t aThreads = 0);
+	~ParallelTigerTree();
+
+	// The data may be passed in parts of any size
+	void update(const void* aData, size_t aLen);
+
+	// Waits for the remaining chunks
+	TigerTree& finalize();
+
+	TigerTree& getTree() { return tree; }
+private:
+	struct Chunk {
+		struct Result {
+			ByteVector data;
+			TigerTree::MerkleList roots;
+			atomic<bool> finished { false };
+		};
+
+		int64_t size;
+		shared_ptr<Result> result;
+
+		// Each chunk has its own group so that the chunks can be waited for in order
+		unique_ptr<task_group> task;
+	};
+
+	static TigerTree::MerkleList hashChunk(const ByteVector& aData, int64_t aSubtreeSize);
+	void startChunk();
+	void addChunk(Chunk& aChunk);
+
+	TigerTree tree;
+
+	// Size of the subtrees calculated by the threads
+	const int64_t subtreeSize;
+
+	ByteVector input;
+	deque<Chunk> chunks;
+	const size_t maxChunks;
+};
+
+} // namespace dcpp
+
+#endif // !defined(DCPLUSPLUS_DCPP_PARALLEL_TIGER_TREE_H)
@@ -23,6 +23,7 @@
 
 #include "Bundle.h"
 #include "FastAlloc.h"
+#include "FlatMultiMap.h"
 #include "HintedUser.h"
 #include "MerkleTree.h"
 #include "Pointer.h"
@@ -34,7 +35,7 @@ class QueueItem : public QueueItemBase, public intrusive_ptr_base<QueueItem> {
 public:
 	typedef unordered_map<QueueToken, QueueItemPtr> TokenMap;
 	typedef unordered_map<string*, QueueItemPtr, noCaseStringHash, noCaseStringEq> StringMap;
-	typedef unordered_multimap<TTHValue*, QueueItemPtr> TTHMap;
+	typedef FlatMultiMap<TTHValue*, QueueItemPtr> TTHMap;
 	typedef vector<pair<QueueItemPtr, bool>> ItemBoolList;
 
 	struct Hash {
@@ -60,6 +60,7 @@ void DirSFVReader::loadPath(const string& aPath) {
 void DirSFVReader::unload() noexcept {
 	failedFiles.clear();
 	content.clear();
+	path.clear();
 	loaded = false;
 }
 
@@ -61,9 +61,13 @@ SearchManager::SearchManager() {
 	setSearchTypeDefaults();
 	TimerManager::getInstance()->addListener(this);
 	SettingsManager::getInstance()->addListener(this);
+
+	incomingSearches.start(max(std::thread::hardware_concurrency() / 2, 1U));
 }
 
 SearchManager::~SearchManager() {
+	incomingSearches.stop();
+
 	TimerManager::getInstance()->removeListener(this);
 	SettingsManager::getInstance()->removeListener(this);
 
@@ -472,7 +476,24 @@ void SearchManager::onPSR(const AdcCommand& aCmd, UserPtr from, const string& re
 
 }
 
+void SearchManager::shutdown() noexcept {
+	incomingSearches.stop();
+}
+
 void SearchManager::respond(const AdcCommand& adc, OnlineUser& aUser, bool isUdpActive, const string& hubIpPort, ProfileToken aProfile) {
+	// Direct and TTH searches are cheap to answer and usually more useful
+	string tth;
+	auto priority = adc.getType() == 'D' || adc.getParam("TR", 0, tth) ? IncomingSearchQueue::PRIO_HIGH : IncomingSearchQueue::PRIO_NORMAL;
+
+	OnlineUserPtr user(&aUser);
+	auto queueTime = std::chrono::steady_clock::now();
+	incomingSearches.add(aUser.getHubUrl(), priority, [=] {
+		handleSearch(adc, user, isUdpActive, hubIpPort, aProfile, queueTime);
+	});
+}
+
+void SearchManager::handleSearch(const AdcCommand& adc, const OnlineUserPtr& aUser, bool isUdpActive, const string& hubIpPort, ProfileToken aProfile, const std::chrono::steady_clock::time_point& aQueueTime) noexcept {
+	auto start = std::chrono::steady_clock::now();
 	auto isDirect = adc.getType() == 'D';
 	string path = "/", key;
 	int maxResults = isUdpActive ? 10 : 5;
@@ -493,16 +514,25 @@ void SearchManager::respond(const AdcCommand& adc, OnlineUser& aUser, bool isUdp
 	string token;
 	adc.getParam("TO", 0, token);
 
+	auto isAutoSearch = token.find("/as") != string::npos;
+	auto addStats = [&] {
+		auto queueMicros = std::chrono::duration_cast<std::chrono::microseconds>(start - aQueueTime).count();
+		auto micros = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+		searchStatistics.addSearch(aUser->getHubUrl(), SearchStatistics::getQueryType(srch, isAutoSearch), static_cast<uint64_t>(queueMicros), static_cast<uint64_t>(micros), results.size());
+	};
+
 	try {
-		ShareManager::getInstance()->adcSearch(results, srch, aProfile, aUser.getUser()->getCID(), path, token.find("/as") != string::npos);
+		ShareManager::getInstance()->adcSearch(results, srch, aProfile, aUser->getUser()->getCID(), path, isAutoSearch);
+		addStats();
 	} catch(const ShareException& e) {
+		addStats();
 		if (replyDirect) {
 			//path not found (direct search)
 			AdcCommand c(AdcCommand::SEV_FATAL, AdcCommand::ERROR_FILE_NOT_AVAILABLE, e.getError(), AdcCommand::TYPE_DIRECT);
-			c.setTo(aUser.getIdentity().getSID());
+			c.setTo(aUser->getIdentity().getSID());
 			c.addParam("TO", token);
 
-			aUser.getClient()->send(c);
+			aUser->getClient()->send(c);
 		}
 		return;
 	}
@@ -516,18 +546,18 @@ void SearchManager::respond(const AdcCommand& adc, OnlineUser& aUser, bool isUdp
 		PartsInfo partialInfo;
 		string bundle;
 		bool reply = false, add = false;
-		QueueManager::getInstance()->handlePartialSearch(aUser.getUser(), TTHValue(tth), partialInfo, bundle, reply, add);
+		QueueManager::getInstance()->handlePartialSearch(aUser->getUser(), TTHValue(tth), partialInfo, bundle, reply, add);
 
 		if (!partialInfo.empty()) {
 			//LogManager::getInstance()->message("SEARCH RESPOND: PARTIALINFO NOT EMPTY");
 			AdcCommand cmd = toPSR(isUdpActive, Util::emptyString, hubIpPort, tth, partialInfo);
-			ClientManager::getInstance()->sendUDP(cmd, aUser.getUser()->getCID(), false, true, Util::emptyString, aUser.getHubUrl());
+			ClientManager::getInstance()->sendUDP(cmd, aUser->getUser()->getCID(), false, true, Util::emptyString, aUser->getHubUrl());
 		}
 		
 		if (!bundle.empty()) {
 			//LogManager::getInstance()->message("SEARCH RESPOND: BUNDLE NOT EMPTY");
 			AdcCommand cmd = toPBD(hubIpPort, bundle, tth, reply, add);
-			ClientManager::getInstance()->sendUDP(cmd, aUser.getUser()->getCID(), false, true, Util::emptyString, aUser.getHubUrl());
+			ClientManager::getInstance()->sendUDP(cmd, aUser->getUser()->getCID(), false, true, Util::emptyString, aUser->getHubUrl());
 		}
 
 		goto end;
@@ -539,18 +569,18 @@ void SearchManager::respond(const AdcCommand& adc, OnlineUser& aUser, bool isUdp
 		AdcCommand cmd = sr->toRES(AdcCommand::TYPE_UDP);
 		if(!token.empty())
 			cmd.addParam("TO", token);
-		ClientManager::getInstance()->sendUDP(cmd, aUser.getUser()->getCID(), false, false, key, aUser.getHubUrl());
+		ClientManager::getInstance()->sendUDP(cmd, aUser->getUser()->getCID(), false, false, key, aUser->getHubUrl());
 	}
 
 end:
 	if (replyDirect) {
 		AdcCommand c(AdcCommand::SEV_SUCCESS, AdcCommand::SUCCESS, "Succeed", AdcCommand::TYPE_DIRECT);
-		c.setTo(aUser.getIdentity().getSID());
+		c.setTo(aUser->getIdentity().getSID());
 		c.addParam("FC", adc.getFourCC());
 		c.addParam("TO", token);
 		c.addParam("RC", Util::toString(results.size()));
 
-		aUser.getClient()->send(c);
+		aUser->getClient()->send(c);
 	}
 }
 
@@ -25,6 +25,8 @@
 
 #include "AdcCommand.h"
 #include "CriticalSection.h"
+#include "IncomingSearchQueue.h"
+#include "SearchStatistics.h"
 #include "Search.h"
 #include "Singleton.h"
 #include "Speaker.h"
@@ -61,7 +63,14 @@ public:
 	SearchQueueInfo search(const SearchPtr& aSearch) noexcept;
 	SearchQueueInfo search(StringList& who, const SearchPtr& aSearch, void* aOwner = nullptr) noexcept;
 	
+	// Queues the search to be answered asynchronously
 	void respond(const AdcCommand& cmd, OnlineUser& aUser, bool isUdpActive, const string& hubIpPort, ProfileToken aProfile);
+	IncomingSearchQueue::Stats getIncomingSearchStats() const noexcept { return incomingSearches.getStats(); }
+	SearchStatistics::Stats getSearchStatistics() const noexcept { return searchStatistics.getStats(); }
+	void clearSearchStatistics() noexcept { searchStatistics.clear(); }
+
+	// Stop answering incoming searches
+	void shutdown() noexcept;
 
 	const string& getPort() const;
 
@@ -109,6 +118,10 @@ private:
 	~SearchManager();
 
 	string getPartsString(const PartsInfo& partsInfo) const;
+
+	void handleSearch(const AdcCommand& cmd, const OnlineUserPtr& aUser, bool isUdpActive, const string& hubIpPort, ProfileToken aProfile, const std::chrono::steady_clock::time_point& aQueueTime) noexcept;
+	IncomingSearchQueue incomingSearches;
+	SearchStatistics searchStatistics;
 	
 	void on(TimerManagerListener::Minute, uint64_t aTick) noexcept;
 
@@ -483,4 +483,19 @@ bool SearchQuery::positionsComplete() const noexcept {
 	return recursion && recursion->completes(lastIncludePositions);
 }
 
+bool SearchQuery::isValidRecursion(bool aPositionsComplete) const noexcept {
+	if (aPositionsComplete) {
+		return true;
+	}
+
+	// Partial match; ignore if all matches are less than 3 chars in length
+	for (size_t j = 0; j < lastIncludePositions.size(); ++j) {
+		if (lastIncludePositions[j] != string::npos && include.getPatterns()[j].size() > 2) {
+			return true;
+		}
+	}
+
+	return false;
+}
+
 } //dcpp
\ No newline at end of file
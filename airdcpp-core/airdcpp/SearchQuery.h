@@ -79,6 +79,9 @@ namespace dcpp {
 		ResultPointsList getResultPositions(const string& aName) const noexcept;
 		bool positionsComplete() const noexcept;
 
+		// Should the partial directory name match be used for matching the subitems?
+		bool isValidRecursion(bool aPositionsComplete) const noexcept;
+
 
 		// We count the positions from the beginning of name of the first matching item
 		// This struct will keep the positions from the upper levels
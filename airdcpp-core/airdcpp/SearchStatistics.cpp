@@ -0,0 +1,141 @@
+/*
+ * Copyright (C) 2011-2016 AirDC++ Project
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+#include "stdinc.h"
+#include "SearchStatistics.h"
+
+#include "SearchQuery.h"
+#include "TimerManager.h"
+
+namespace dcpp {
+
+// Maximum number of hubs with separate statistics
+#define MAX_HUB_STATISTICS 100
+
+const vector<uint64_t> SearchStatistics::latencyBuckets = { 100, 250, 500, 1000, 2500, 5000, 10000, 25000, 50000, 100000, 250000, 1000000 };
+const vector<uint64_t> SearchStatistics::resultBuckets = { 0, 1, 2, 5, 10, 20 };
+
+SearchStatistics::Counters::Counters() : latencies(latencyBuckets.size() + 1), queueLatencies(latencyBuckets.size() + 1), results(resultBuckets.size() + 1) {
+
+}
+
+static size_t getBucket(const vector<uint64_t>& aBuckets, uint64_t aValue) noexcept {
+	return distance(aBuckets.begin(), lower_bound(aBuckets.begin(), aBuckets.end(), aValue));
+}
+
+void SearchStatistics::Counters::add(uint64_t aQueueMicroSeconds, uint64_t aMicroSeconds, size_t aResults) noexcept {
+	count++;
+	totalTime += aMicroSeconds;
+	maxTime = max(maxTime, aMicroSeconds);
+	totalQueueTime += aQueueMicroSeconds;
+	maxQueueTime = max(maxQueueTime, aQueueMicroSeconds);
+	totalResults += aResults;
+	lastSearch = GET_TICK();
+
+	latencies[getBucket(latencyBuckets, aMicroSeconds)]++;
+	queueLatencies[getBucket(latencyBuckets, aQueueMicroSeconds)]++;
+	results[getBucket(resultBuckets, aResults)]++;
+}
+
+uint64_t SearchStatistics::Counters::getLatencyPercentile(double aPercentile) const noexcept {
+	return getPercentile(latencies, maxTime, aPercentile);
+}
+
+uint64_t SearchStatistics::Counters::getQueueLatencyPercentile(double aPercentile) const noexcept {
+	return getPercentile(queueLatencies, maxQueueTime, aPercentile);
+}
+
+uint64_t SearchStatistics::Counters::getPercentile(const vector<uint64_t>& aBuckets, uint64_t aMax, double aPercentile) const noexcept {
+	if (count == 0) {
+		return 0;
+	}
+
+	auto wanted = static_cast<uint64_t>(ceil(static_cast<double>(count) * aPercentile / 100.0));
+
+	uint64_t passed = 0;
+	for (size_t i = 0; i < latencyBuckets.size(); ++i) {
+		passed += aBuckets[i];
+		if (passed >= wanted) {
+			return min(latencyBuckets[i], aMax);
+		}
+	}
+
+	return aMax;
+}
+
+SearchStatistics::QueryType SearchStatistics::getQueryType(const SearchQuery& aSearch, bool aIsAutoSearch) noexcept {
+	if (aSearch.root) {
+		return QUERY_TTH;
+	}
+
+	if (aIsAutoSearch) {
+		return QUERY_AUTO_SEARCH;
+	}
+
+	if (aSearch.itemType == SearchQuery::TYPE_DIRECTORY && aSearch.matchType == Search::MATCH_NAME_EXACT) {
+		return QUERY_EXACT_DIRECTORY;
+	}
+
+	return QUERY_RECURSIVE;
+}
+
+const char* SearchStatistics::getQueryTypeStr(QueryType aType) noexcept {
+	switch (aType) {
+		case QUERY_TTH: return "tth";
+		case QUERY_EXACT_DIRECTORY: return "exact_directory";
+		case QUERY_RECURSIVE: return "recursive";
+		case QUERY_AUTO_SEARCH: return "auto_search";
+		default: break;
+	}
+
+	dcassert(0);
+	return "";
+}
+
+void SearchStatistics::addSearch(const string& aHubUrl, QueryType aType, uint64_t aQueueMicroSeconds, uint64_t aMicroSeconds, size_t aResults) noexcept {
+	FastLock l(cs);
+	stats.types[aType].add(aQueueMicroSeconds, aMicroSeconds, aResults);
+
+	auto hub = stats.hubs.find(aHubUrl);
+	if (hub == stats.hubs.end()) {
+		if (stats.hubs.size() >= MAX_HUB_STATISTICS) {
+			// Most likely a hub that isn't connected anymore
+			auto oldest = min_element(stats.hubs.begin(), stats.hubs.end(), [](const HubCounterMap::value_type& a, const HubCounterMap::value_type& b) {
+				return a.second.lastSearch < b.second.lastSearch;
+			});
+
+			stats.hubs.erase(oldest);
+		}
+
+		hub = stats.hubs.emplace(aHubUrl, Counters()).first;
+	}
+
+	hub->second.add(aQueueMicroSeconds, aMicroSeconds, aResults);
+}
+
+SearchStatistics::Stats SearchStatistics::getStats() const noexcept {
+	FastLock l(cs);
+	return stats;
+}
+
+void SearchStatistics::clear() noexcept {
+	FastLock l(cs);
+	stats = Stats();
+}
+
+} // namespace dcpp
@@ -0,0 +1,92 @@
+/*
+ * Copyright (C) 2011-2016 AirDC++ Project
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+#ifndef DCPLUSPLUS_DCPP_SEARCH_STATISTICS_H
+#define DCPLUSPLUS_DCPP_SEARCH_STATISTICS_H
+
+#include "typedefs.h"
+
+#include "CriticalSection.h"
+
+namespace dcpp {
+
+class SearchQuery;
+
+// Fixed-bucket latency and result count distributions of the answered incoming searches
+// The time spent in the incoming search queue is tracked separately from the processing time
+class SearchStatistics : boost::noncopyable {
+public:
+	enum QueryType {
+		QUERY_TTH,
+		QUERY_EXACT_DIRECTORY,
+		QUERY_RECURSIVE,
+		QUERY_AUTO_SEARCH,
+		QUERY_LAST
+	};
+
+	// Upper bounds (inclusive) of the buckets, the last bucket has no upper limit
+	static const vector<uint64_t> latencyBuckets; // microseconds
+	static const vector<uint64_t> resultBuckets;
+
+	struct Counters {
+		Counters();
+
+		uint64_t count = 0;
+		uint64_t totalTime = 0;
+		uint64_t maxTime = 0;
+		uint64_t totalQueueTime = 0;
+		uint64_t maxQueueTime = 0;
+		uint64_t totalResults = 0;
+		uint64_t lastSearch = 0; // tick
+
+		vector<uint64_t> latencies;
+		vector<uint64_t> queueLatencies;
+		vector<uint64_t> results;
+
+		void add(uint64_t aQueueMicroSeconds, uint64_t aMicroSeconds, size_t aResults) noexcept;
+
+		// Upper bound of the bucket containing the wanted percentile (maximum time for the last bucket)
+		uint64_t getLatencyPercentile(double aPercentile) const noexcept;
+		uint64_t getQueueLatencyPercentile(double aPercentile) const noexcept;
+	private:
+		uint64_t getPercentile(const vector<uint64_t>& aBuckets, uint64_t aMax, double aPercentile) const noexcept;
+	};
+
+	typedef map<string, Counters> HubCounterMap;
+
+	struct Stats {
+		Counters types[QUERY_LAST];
+		HubCounterMap hubs;
+	};
+
+	static QueryType getQueryType(const SearchQuery& aSearch, bool aIsAutoSearch) noexcept;
+	static const char* getQueryTypeStr(QueryType aType) noexcept;
+
+	// Hubs with the oldest searches are removed when the maximum number of hubs is exceeded
+	void addSearch(const string& aHubUrl, QueryType aType, uint64_t aQueueMicroSeconds, uint64_t aMicroSeconds, size_t aResults) noexcept;
+
+	Stats getStats() const noexcept;
+	void clear() noexcept;
+private:
+	Stats stats;
+	mutable FastCriticalSection cs;
+};
+
+} // namespace dcpp
+
+#endif // !defined(DCPLUSPLUS_DCPP_SEARCH_STATISTICS_H)
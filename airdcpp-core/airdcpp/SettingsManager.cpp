@@ -229,7 +229,7 @@ const string SettingsManager::settingTags[] =
 "QueueSplitterPosition", "FullListDLLimit", "ASDelayHours", "LastListProfile", "MaxHashingThreads", "HashersPerVolume", "SubtractlistSkip", "BloomMode", "FavUsersSplitterPos", "AwayIdleTime",
 "SearchHistoryMax", "ExcludeHistoryMax", "DirectoryHistoryMax", "MinDupeCheckSize", "DbCacheSize", "DLAutoDisconnectMode", "RemovedTrees", "RemovedFiles", "MultithreadedRefresh", "MonitoringMode",
 "MonitoringDelay", "DelayCountMode", "MaxRunningBundles", "DefaultShareProfile", "UpdateChannel", "ColorStatusFinished", "ColorStatusShared", "ProgressLighten",
-"ConfigBuildNumber", "PmMessageCache", "HubMessageCache", "LogMessageCache",
+"ConfigBuildNumber", "PmMessageCache", "HubMessageCache", "LogMessageCache", "ListCacheSize", "IncomingSearchQueueSize", "IncomingSearchDropMode",
 "SENTRY",
 
 // Bools
@@ -278,7 +278,7 @@ const string SettingsManager::settingTags[] =
 	"RemoveExpiredAs", "AdcLogGroupCID", "ShareFollowSymlinks", "ScanMonitoredFolders", "FinishedNoHash", "ConfirmFileDeletions", "UseDefaultCertPaths", "StartupRefresh", "FLReportDupeFiles",
 	"FilterFLShared", "FilterFLQueued", "FilterFLInversed", "FilterFLTop", "FilterFLPartialDupes", "FilterFLResetChange", "FilterSearchShared", "FilterSearchQueued", "FilterSearchInversed", "FilterSearchTop", "FilterSearchPartialDupes", "FilterSearchResetChange",
 	"SearchAschOnlyMan", "UseUploadBundles", "CloseMinimize", "LogIgnored", "UsersFilterIgnore", "NfoExternal", "SingleClickTray", "QueueShowFinished", "RemoveFinishedBundles", "LogCRCOk",
-	"FilterQueueInverse", "FilterQueueTop", "FilterQueueReset", "AlwaysCCPM", "LogRemovedBundles",
+	"FilterQueueInverse", "FilterQueueTop", "FilterQueueReset", "AlwaysCCPM", "LogRemovedBundles", "SearchThreading", "FastScheduledRefresh", "HashDiskOrder", "HashUnbuffered",
 	"SENTRY",
 	// Int64
 	"TotalUpload", "TotalDownload",
@@ -845,11 +845,18 @@ SettingsManager::SettingsManager() : connectionRegex("(\\d+(\\.\\d+)?)")
 	setDefault(LAST_FL_FILETYPE, "0");
 
 	setDefault(DB_CACHE_SIZE, 8);
+	setDefault(LIST_CACHE_SIZE, 16);
+	setDefault(INCOMING_SEARCH_QUEUE_SIZE, 500);
+	setDefault(INCOMING_SEARCH_DROP_MODE, SEARCH_DROP_FLOODING);
 	setDefault(CUR_REMOVED_TREES, 0);
 	setDefault(CUR_REMOVED_FILES, 0);
 
 	setDefault(DL_AUTO_DISCONNECT_MODE, QUEUE_FILE);
 	setDefault(REFRESH_THREADING, MULTITHREAD_MANUAL);
+	setDefault(SEARCH_THREADING, true);
+	setDefault(FAST_SCHEDULED_REFRESH, false);
+	setDefault(HASH_DISK_ORDER, false);
+	setDefault(HASH_UNBUFFERED, false);
 
 	setDefault(REMOVE_EXPIRED_AS, false);
 
@@ -861,7 +868,6 @@ SettingsManager::SettingsManager() : connectionRegex("(\\d+(\\.\\d+)?)")
 #ifdef _WIN32
 	setDefault(MONITORING_MODE, MONITORING_ALL);
 #else
-	// TODO: implement monitoring
 	setDefault(MONITORING_MODE, MONITORING_DISABLED);
 #endif
 
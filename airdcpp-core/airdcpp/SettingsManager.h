@@ -119,7 +119,7 @@ public:
 		QUEUE_SPLITTER_POS, FULL_LIST_DL_LIMIT, AS_DELAY_HOURS, LAST_LIST_PROFILE, MAX_HASHING_THREADS, HASHERS_PER_VOLUME, SKIP_SUBTRACT, BLOOM_MODE, FAV_USERS_SPLITTER_POS, AWAY_IDLE_TIME, 
 		HISTORY_SEARCH_MAX, HISTORY_DIR_MAX, HISTORY_EXCLUDE_MAX, MIN_DUPE_CHECK_SIZE, DB_CACHE_SIZE, DL_AUTO_DISCONNECT_MODE, CUR_REMOVED_TREES, CUR_REMOVED_FILES, REFRESH_THREADING, MONITORING_MODE,
 		MONITORING_DELAY, DELAY_COUNT_MODE, MAX_RUNNING_BUNDLES, DEFAULT_SP, UPDATE_CHANNEL, COLOR_STATUS_FINISHED, COLOR_STATUS_SHARED, PROGRESS_LIGHTEN,
-		CONFIG_BUILD_NUMBER, PM_MESSAGE_CACHE, HUB_MESSAGE_CACHE, LOG_MESSAGE_CACHE,
+		CONFIG_BUILD_NUMBER, PM_MESSAGE_CACHE, HUB_MESSAGE_CACHE, LOG_MESSAGE_CACHE, LIST_CACHE_SIZE, INCOMING_SEARCH_QUEUE_SIZE, INCOMING_SEARCH_DROP_MODE,
 		INT_LAST };
 
 	enum BoolSetting { BOOL_FIRST = INT_LAST + 1,
@@ -169,7 +169,7 @@ public:
 		REMOVE_EXPIRED_AS, PM_LOG_GROUP_CID, SHARE_FOLLOW_SYMLINKS, SCAN_MONITORED_FOLDERS, FINISHED_NO_HASH, CONFIRM_FILE_DELETIONS, USE_DEFAULT_CERT_PATHS, STARTUP_REFRESH, FL_REPORT_FILE_DUPES,
 		FILTER_FL_SHARED, FILTER_FL_QUEUED, FILTER_FL_INVERSED, FILTER_FL_TOP, FILTER_FL_PARTIAL_DUPES, FILTER_FL_RESET_CHANGE, FILTER_SEARCH_SHARED, FILTER_SEARCH_QUEUED, FILTER_SEARCH_INVERSED, FILTER_SEARCH_TOP, FILTER_SEARCH_PARTIAL_DUPES, FILTER_SEARCH_RESET_CHANGE,
 		SEARCH_ASCH_ONLY, USE_UPLOAD_BUNDLES, CLOSE_USE_MINIMIZE, LOG_IGNORED, USERS_FILTER_IGNORE, NFO_EXTERNAL, SINGLE_CLICK_TRAY, QUEUE_SHOW_FINISHED, REMOVE_FINISHED_BUNDLES, LOG_CRC_OK,
-		FILTER_QUEUE_INVERSED, FILTER_QUEUE_TOP, FILTER_QUEUE_RESET_CHANGE, ALWAYS_CCPM, LOG_REMOVED_BUNDLES,
+		FILTER_QUEUE_INVERSED, FILTER_QUEUE_TOP, FILTER_QUEUE_RESET_CHANGE, ALWAYS_CCPM, LOG_REMOVED_BUNDLES, SEARCH_THREADING, FAST_SCHEDULED_REFRESH, HASH_DISK_ORDER, HASH_UNBUFFERED,
 		BOOL_LAST };
 
 	enum Int64Setting { INT64_FIRST = BOOL_LAST + 1,
@@ -203,6 +203,8 @@ public:
 
 	enum {  DELAY_DIR, DELAY_VOLUME, DELAY_ANY, DELAY_LAST };
 
+	enum {  SEARCH_DROP_NEW, SEARCH_DROP_FLOODING, SEARCH_DROP_LAST };
+
 	enum AutoSelectMethod { SELECT_MOST_SPACE, SELECT_LEAST_SPACE };
 
 	enum FileEvents { ON_FILE_COMPLETE, ON_DIR_CREATED};
@@ -22,12 +22,14 @@
 #include "AirUtil.h"
 #include "BZUtils.h"
 #include "ClientManager.h"
+#include "CompactShareTree.h"
 #include "File.h"
 #include "FilteredFile.h"
 #include "LogManager.h"
 #include "HashManager.h"
 #include "QueueManager.h"
 #include "ResourceManager.h"
+#include "SearchManager.h"
 #include "ScopedFunctor.h"
 #include "SearchResult.h"
 #include "ShareScannerManager.h"
@@ -45,6 +47,10 @@
 
 #include "concurrency.h"
 
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
 #ifdef _WIN32
 # include <ShlObj.h>
 #endif
@@ -61,15 +67,25 @@ using boost::range::remove_if;
 
 #define SHARE_CACHE_VERSION "3"
 
+// Smaller shares are searched with a single thread
+#define PARALLEL_SEARCH_MIN_FILES 20000
+
 #ifdef ATOMIC_FLAG_INIT
 atomic_flag ShareManager::refreshing = ATOMIC_FLAG_INIT;
 #else
 atomic_flag ShareManager::refreshing;
 #endif
 
-ShareManager::ShareManager() : bloom(new ShareBloom(1 << 20)), monitor(1, false)
+ShareManager::ShareManager() : ShareManager(true) {
+
+}
+
+ShareManager::ShareManager(bool aListenSettings) : bloom(new ShareBloom(1 << 20)), monitor(1, false)
 { 
-	SettingsManager::getInstance()->addListener(this);
+	if (aListenSettings) {
+		SettingsManager::getInstance()->addListener(this);
+	}
+
 #ifdef _WIN32
 	// don't share Windows directory
 	TCHAR path[MAX_PATH];
@@ -268,7 +284,7 @@ bool ShareManager::handleModifyInfo(DirModifyInfo& info, optional<OrderedStringS
 
 	//handle deleted files first
 	if (info.dirAction == DirModifyInfo::ACTION_DELETED) {
-		WLock l(cs);
+		TreeWLock l(*this);
 		//the whole dir removed
 		handleDeletedFile(info.path, true, dirtyProfiles_);
 		LogManager::getInstance()->message(STRING_F(SHARED_DIR_REMOVED, info.path), LogMessage::SEV_INFO);
@@ -279,7 +295,7 @@ bool ShareManager::handleModifyInfo(DirModifyInfo& info, optional<OrderedStringS
 		string removedPath;
 
 		{
-			WLock l(cs);
+			TreeWLock l(*this);
 			for (auto i = info.files.begin(); i != info.files.end();) {
 				if (i->second.action == DirModifyInfo::ACTION_DELETED) {
 					bool isDir = i->first.back() == PATH_SEPARATOR;
@@ -412,7 +428,7 @@ bool ShareManager::handleModifyInfo(DirModifyInfo& info, optional<OrderedStringS
 				try {
 					HashedFile hashedFile(ff.getLastModified(), size);
 					if (HashManager::getInstance()->checkTTH(Text::toLower(fi), fi, hashedFile)) {
-						WLock l(cs);
+						TreeWLock l(*this);
 						addFile(Util::getFileName(fi), dir, hashedFile, dirtyProfiles_);
 						hashedFiles++;
 						continue;
@@ -528,7 +544,7 @@ void ShareManager::on(DirectoryMonitorListener::FileRenamed, const string& aOldP
 	bool noSharing = false;
 
 	{
-		WLock l(cs);
+		TreeWLock l(*this);
 		auto parent = findDirectory(Util::getFilePath(aOldPath));
 		if (parent) {
 			auto fileNameOldLower = Text::toLower(Util::getFileName(aOldPath));
@@ -542,6 +558,7 @@ void ShareManager::on(DirectoryMonitorListener::FileRenamed, const string& aOldP
 
 					// remove from the dir name map
 					removeDirName(*d, lowerDirNameMap);
+					removeNgrams(*d, nullptr);
 
 					//rename
 					parent->directories.erase(p);
@@ -551,6 +568,7 @@ void ShareManager::on(DirectoryMonitorListener::FileRenamed, const string& aOldP
 
 					//add in bloom and dir name map
 					addDirName(d, lowerDirNameMap, *bloom.get());
+					addNgrams(*d, d->getVirtualNameLower());
 
 					//get files to convert in the hash database (recursive)
 					d->getRenameInfoList(Util::emptyString, toRename);
@@ -567,6 +585,7 @@ void ShareManager::on(DirectoryMonitorListener::FileRenamed, const string& aOldP
 						HashedFile fi((*f)->getTTH(), (*f)->getLastWrite(), (*f)->getSize());
 
 						//remove old
+						removeNgrams(*parent, *f);
 						cleanIndices(*parent, *f);
 						parent->files.erase(f);
 
@@ -688,6 +707,7 @@ bool ShareManager::handleDeletedFile(const string& aPath, bool isDirectory, Prof
 			auto fileNameLower = Text::toLower(Util::getFileName(aPath));
 			auto f = parent->files.find(fileNameLower);
 			if (f != parent->files.end()) {
+				removeNgrams(*parent, *f);
 				cleanIndices(*parent, *f);
 				parent->files.erase(f);
 				deleted = true;
@@ -739,6 +759,8 @@ void ShareManager::shutdown(function<void(float)> progressF) noexcept {
 }
 
 void ShareManager::setProfilesDirty(ProfileTokenSet aProfiles, bool aIsMajorChange /*false*/) noexcept {
+	listCache.invalidate(aProfiles);
+
 	if (!aProfiles.empty()) {
 		RLock l(cs);
 		for(const auto token: aProfiles) {
@@ -908,14 +930,84 @@ bool ShareManager::Directory::hasProfile(const OptionalProfileToken& aProfile) c
 	return false;
 }
 
+bool ShareManager::Directory::hasProfile(const ProfileMatcher& aProfile) const noexcept {
+	if (aProfile.matchesAll() || (profileDir && aProfile.matches(*profileDir))) {
+		return true;
+	}
+
+	if (parent) {
+		return parent->hasProfile(aProfile);
+	}
+
+	return false;
+}
+
 bool ShareManager::ProfileDirectory::hasRootProfile(ProfileToken aProfile) const noexcept {
 	return rootProfiles.find(aProfile) != rootProfiles.end();
 }
 
+// Profiles that have been assigned a bit (the index is the bit number)
+static ProfileToken maskProfiles[64];
+static atomic<size_t> maskProfileCount(0);
+static FastCriticalSection maskProfileCS;
+
+ShareManager::ProfileMask ShareManager::getProfileMask(ProfileToken aProfile) noexcept {
+	auto count = maskProfileCount.load(memory_order_acquire);
+	for (size_t i = 0; i < count; ++i) {
+		if (maskProfiles[i] == aProfile) {
+			return static_cast<ProfileMask>(1) << i;
+		}
+	}
+
+	return 0;
+}
+
+ShareManager::ProfileMask ShareManager::assignProfileMask(ProfileToken aProfile) noexcept {
+	FastLock l(maskProfileCS);
+	auto mask = getProfileMask(aProfile);
+	if (mask != 0) {
+		return mask;
+	}
+
+	auto count = maskProfileCount.load(memory_order_relaxed);
+	if (count == sizeof(ProfileMask) * 8) {
+		return 0;
+	}
+
+	maskProfiles[count] = aProfile;
+	maskProfileCount.store(count + 1, memory_order_release);
+	return static_cast<ProfileMask>(1) << count;
+}
+
+bool ShareManager::ProfileMatcher::matches(const ProfileDirectory& aDir) const noexcept {
+	if (!profile) {
+		return true;
+	}
+
+	if (mask != 0) {
+		return (aDir.getRootProfileMask() & mask) != 0;
+	}
+
+	return aDir.hasRootProfile(*profile);
+}
+
 ShareManager::ProfileDirectory::ProfileDirectory(const string& aRootPath, const string& aVname, const ProfileTokenSet& aProfiles, bool aIncoming) noexcept :
 	path(aRootPath), cacheDirty(false), virtualName(unique_ptr<DualString>(new DualString(aVname))), 
 	incoming(aIncoming), rootProfiles(aProfiles) {
 
+	updateRootProfileMask();
+}
+
+void ShareManager::ProfileDirectory::updateRootProfileMask() noexcept {
+	rootProfileMask = 0;
+	for (const auto p : rootProfiles) {
+		rootProfileMask |= assignProfileMask(p);
+	}
+}
+
+void ShareManager::ProfileDirectory::setRootProfiles(const ProfileTokenSet& aProfiles) noexcept {
+	rootProfiles = aProfiles;
+	updateRootProfileMask();
 }
 
 ShareManager::ProfileDirectory::Ptr ShareManager::ProfileDirectory::create(const string& aRootPath, const string& aVname, const ProfileTokenSet& aProfiles, bool aIncoming, Map& profileDirectories_) noexcept {
@@ -926,10 +1018,12 @@ ShareManager::ProfileDirectory::Ptr ShareManager::ProfileDirectory::create(const
 
 void ShareManager::ProfileDirectory::addRootProfile(ProfileToken aProfile) noexcept {
 	rootProfiles.emplace(aProfile);
+	rootProfileMask |= assignProfileMask(aProfile);
 }
 
 bool ShareManager::ProfileDirectory::removeRootProfile(ProfileToken aProfile) noexcept {
 	rootProfiles.erase(aProfile);
+	rootProfileMask &= ~getProfileMask(aProfile);
 	return rootProfiles.empty();
 }
 
@@ -1108,7 +1202,7 @@ void ShareManager::addTempShare(const string& aKey, const TTHValue& tth, const s
 	if(isFileShared(tth, aProfile)) {
 		return;
 	} else {
-		WLock l(cs);
+		TreeWLock l(*this);
 		const auto files = tempShares.equal_range(tth);
 		for(auto i = files.first; i != files.second; ++i) {
 			if(i->second.key == aKey)
@@ -1116,26 +1210,39 @@ void ShareManager::addTempShare(const string& aKey, const TTHValue& tth, const s
 		}
 		//didnt exist.. fine, add it.
 		tempShares.emplace(tth, TempShareInfo(aKey, filePath, aSize));
+		updateHashBlooms(tth, true);
 	}
 }
 void ShareManager::removeTempShare(const string& aKey, const TTHValue& tth) {
-	WLock l(cs);
+	TreeWLock l(*this);
 	const auto files = tempShares.equal_range(tth);
 	for(auto i = files.first; i != files.second; ++i) {
 		if(i->second.key == aKey) {
 			tempShares.erase(i);
+			updateHashBlooms(tth, false);
 			break;
 		}
 	}
 }
 
 void ShareManager::removeTempShare(const string& aPath) {
-	WLock l(cs);
-	tempShares.erase(boost::remove_if(tempShares | map_values, [&](const TempShareInfo& ti) { return Util::stricmp(aPath, ti.path) == 0; }).base(), tempShares.end());
+	TreeWLock l(*this);
+	for (auto i = tempShares.begin(); i != tempShares.end();) {
+		if (Util::stricmp(aPath, i->second.path) == 0) {
+			updateHashBlooms(i->first, false);
+			i = tempShares.erase(i);
+		} else {
+			++i;
+		}
+	}
 }
 
 void ShareManager::clearTempShares() {
-	WLock l(cs);
+	TreeWLock l(*this);
+	for (const auto& tth : tempShares | map_keys) {
+		updateHashBlooms(tth, false);
+	}
+
 	tempShares.clear();
 }
 
@@ -1245,7 +1352,8 @@ void ShareManager::loadProfile(SimpleXML& aXml, const string& aName, ProfileToke
 
 		auto j = rootPaths.find(realPath);
 		if (j == rootPaths.end()) {
-			Directory::createRoot(vName, 0, pd, rootPaths, lowerDirNameMap, *bloom.get());
+			auto root = Directory::createRoot(vName, 0, pd, rootPaths, lowerDirNameMap, *bloom.get());
+			addNgrams(*root, root->getVirtualNameLower());
 		}
 	}
 
@@ -1287,6 +1395,7 @@ void ShareManager::load(SimpleXML& aXml) {
 				return AirUtil::isSubLocal(dp.first, aPath); 
 			}).base() != rootPathsCopy.end()) {
 				removeDirName(*dp.second.get(), lowerDirNameMap);
+				removeNgrams(*dp.second.get(), nullptr);
 				rootPaths.erase(dp.first);
 
 				LogManager::getInstance()->message("The directory " + dp.first + " was not loaded: parent of this directory is shared in another profile, which is not supported in this client version.", LogMessage::SEV_WARNING);
@@ -1347,10 +1456,21 @@ static const string DATE = "Date";
 static const string SHARE = "Share";
 static const string SVERSION = "Version";
 
-struct ShareManager::ShareLoader : public SimpleXMLReader::ThreadedCallBack, public ShareManager::RefreshInfo {
+struct ShareManager::CacheLoader : public ShareManager::RefreshInfo {
+	CacheLoader(const string& aPath, const ShareManager::Directory::Ptr& aOldRoot, ShareManager::ShareBloom& aBloom) :
+		ShareManager::RefreshInfo(aPath, aOldRoot, 0, aBloom) { }
+
+	virtual ~CacheLoader() { }
+
+	// Build the new tree from the cache file, throws on errors
+	virtual void load() = 0;
+	virtual const string& getCachePath() const noexcept = 0;
+};
+
+struct ShareManager::ShareLoader : public SimpleXMLReader::ThreadedCallBack, public ShareManager::CacheLoader {
 	ShareLoader(const string& aPath, const ShareManager::Directory::Ptr& aOldRoot, ShareManager::ShareBloom& aBloom) :
-		ShareManager::RefreshInfo(aPath, aOldRoot, 0, aBloom),
 		ThreadedCallBack(aOldRoot->getProfileDir()->getCacheXmlPath()),
+		CacheLoader(aPath, aOldRoot, aBloom),
 		curDirPath(aOldRoot->getProfileDir()->getPath()),
 		curDirPathLower(Text::toLower(aOldRoot->getProfileDir()->getPath())),
 		bloom(aBloom)
@@ -1358,6 +1478,13 @@ struct ShareManager::ShareLoader : public SimpleXMLReader::ThreadedCallBack, pub
 		cur = newShareDirectory;
 	}
 
+	void load() {
+		SimpleXMLReader(this).parse(*file);
+	}
+
+	const string& getCachePath() const noexcept {
+		return xmlPath;
+	}
 
 	void startTag(const string& aName, StringPairList& attribs, bool simple) {
 		if(compare(aName, SDIRECTORY) == 0) {
@@ -1368,6 +1495,9 @@ struct ShareManager::ShareLoader : public SimpleXMLReader::ThreadedCallBack, pub
 				curDirPath += name + PATH_SEPARATOR;
 
 				cur = ShareManager::Directory::createNormal(name, cur, Util::toUInt32(date), lowerDirNameMapNew, bloom);
+
+				// The old cache format doesn't tell whether the content was complete
+				cur->setIncomplete(true);
 				curDirPathLower += cur->realName.getLower() + PATH_SEPARATOR;
 			}
 
@@ -1399,6 +1529,7 @@ struct ShareManager::ShareLoader : public SimpleXMLReader::ThreadedCallBack, pub
 				throw("Newer cache version"); //don't load those...
 
 			cur->setLastWrite(Util::toUInt32(getAttrib(attribs, DATE, 2)));
+			cur->setIncomplete(true);
 		}
 	}
 	void endTag(const string& name) {
@@ -1421,15 +1552,210 @@ private:
 	ShareManager::ShareBloom& bloom;
 };
 
-typedef shared_ptr<ShareManager::ShareLoader> ShareLoaderPtr;
-typedef vector<ShareLoaderPtr> LoaderList;
+// Binary share cache (native byte order)
+// Header: magic, version, date and flags of the root directory, content of the root directory
+// Directory content: file count, files (name, size, timestamp, TTH), directory count, directories (name, date, flags, directory content)
+// Names are stored as a 32 bit length followed by the UTF-8 string
+// Version 1 doesn't have the directory flags
+static const char SHARE_BINARY_CACHE_MAGIC[] = { 'A', 'S', 'C', 'B' };
+static const uint32_t SHARE_BINARY_CACHE_VERSION = 2;
+
+// Directory flags
+static const uint8_t SHARE_BINARY_CACHE_INCOMPLETE = 0x01;
+
+template<typename T>
+static void writeBinary(OutputStream& aStream, T aValue) {
+	aStream.write(&aValue, sizeof(T));
+}
+
+static void writeBinary(OutputStream& aStream, const string& aStr) {
+	writeBinary<uint32_t>(aStream, static_cast<uint32_t>(aStr.size()));
+	aStream.write(aStr);
+}
+
+struct ShareManager::ShareBinaryLoader : public ShareManager::CacheLoader {
+	ShareBinaryLoader(const string& aPath, const ShareManager::Directory::Ptr& aOldRoot, ShareManager::ShareBloom& aBloom) :
+		CacheLoader(aPath, aOldRoot, aBloom),
+		cachePath(aOldRoot->getProfileDir()->getCacheBinaryPath()),
+		rootPath(aOldRoot->getProfileDir()->getPath()),
+		bloom(aBloom)
+	{ 
+
+	}
+
+	void load() {
+		// The whole file is read at once, building the tree needs very little parsing after that
+		{
+			File f(cachePath, File::READ, File::OPEN);
+			data = f.read();
+		}
+
+		pos = 0;
+
+		char magic[sizeof(SHARE_BINARY_CACHE_MAGIC)];
+		readBytes(magic, sizeof(magic));
+		if (memcmp(magic, SHARE_BINARY_CACHE_MAGIC, sizeof(magic)) != 0) {
+			throw ShareException("Invalid cache file");
+		}
+
+		version = read<uint32_t>();
+		if (version != 1 && version != SHARE_BINARY_CACHE_VERSION) {
+			throw ShareException("Unsupported cache version");
+		}
+
+		newShareDirectory->setLastWrite(read<uint64_t>());
+		readFlags(newShareDirectory);
+		loadContent(newShareDirectory, rootPath, Text::toLower(rootPath), 0);
+
+		if (pos != data.size()) {
+			throw ShareException("Invalid cache file");
+		}
+
+		string().swap(data);
+	}
+
+	const string& getCachePath() const noexcept {
+		return cachePath;
+	}
+private:
+	// Deeper trees can't be created with the file systems that are in use
+	static const int MAX_DEPTH = 512;
+
+	void loadContent(const ShareManager::Directory::Ptr& aDir, const string& aPath, const string& aPathLower, int aDepth) {
+		if (aDepth > MAX_DEPTH) {
+			throw ShareException("Invalid cache file");
+		}
+
+		// Minimum size of a file entry: name length, size, timestamp, TTH
+		auto fileCount = readCount(sizeof(uint32_t) + sizeof(int64_t) + sizeof(uint64_t) + TTHValue::BYTES);
+
+		// The information must still match with the hash database (the cache may be outdated)
+		vector<DualString> names;
+		StringList paths, pathsLower;
+		vector<HashedFile> fileInfos;
+
+		names.reserve(fileCount);
+		paths.reserve(fileCount);
+		pathsLower.reserve(fileCount);
+		fileInfos.reserve(fileCount);
+		for (uint32_t i = 0; i < fileCount; ++i) {
+			DualString name(readString());
+			auto size = read<int64_t>();
+			auto timeStamp = read<uint64_t>();
+
+			TTHValue tth;
+			readBytes(tth.data, TTHValue::BYTES);
+
+			paths.push_back(aPath + name.getNormal());
+			pathsLower.push_back(aPathLower + name.getLower());
+			fileInfos.emplace_back(tth, timeStamp, size);
+			names.push_back(move(name));
+		}
+
+		auto found = HashManager::getInstance()->checkTTHs(pathsLower, paths, fileInfos);
+
+		aDir->files.reserve(fileCount);
+		for (uint32_t i = 0; i < fileCount; ++i) {
+			if (!found[i]) {
+				hashSize += fileInfos[i].getSize();
+				aDir->setIncomplete(true);
+				continue;
+			}
+
+			auto f = new ShareManager::Directory::File(move(names[i]), aDir, fileInfos[i]);
+			auto inserted = aDir->files.insert_sorted(f);
+			if (!inserted.second) {
+				delete f;
+				throw ShareException("Invalid cache file");
+			}
+
+			ShareManager::updateIndices(*aDir, f, bloom, addedSize, tthIndexNew);
+		}
+
+		// Minimum size of a directory entry: name length, date, file count, directory count
+		auto dirCount = readCount(sizeof(uint32_t) + sizeof(uint64_t) + sizeof(uint32_t) + sizeof(uint32_t));
+		aDir->directories.reserve(dirCount);
+		for (uint32_t i = 0; i < dirCount; ++i) {
+			DualString name(readString());
+			auto date = read<uint64_t>();
+
+			auto path = aPath + name.getNormal() + PATH_SEPARATOR;
+			auto pathLower = aPathLower + name.getLower() + PATH_SEPARATOR;
+
+			auto d = ShareManager::Directory::createNormal(move(name), aDir, date, lowerDirNameMapNew, bloom);
+			readFlags(d);
+			loadContent(d, path, pathLower, aDepth + 1);
+		}
+	}
+
+	void readFlags(const ShareManager::Directory::Ptr& aDir) {
+		if (version == 1) {
+			// Unknown, the directories need to be listed in the next fast refresh
+			aDir->setIncomplete(true);
+			return;
+		}
+
+		auto flags = read<uint8_t>();
+		if ((flags & SHARE_BINARY_CACHE_INCOMPLETE) == SHARE_BINARY_CACHE_INCOMPLETE) {
+			aDir->setIncomplete(true);
+		}
+	}
+
+	void readBytes(void* buf_, size_t aLen) {
+		if (data.size() - pos < aLen) {
+			throw ShareException("Invalid cache file");
+		}
+
+		memcpy(buf_, &data[pos], aLen);
+		pos += aLen;
+	}
+
+	template<typename T>
+	T read() {
+		T ret;
+		readBytes(&ret, sizeof(T));
+		return ret;
+	}
+
+	// Get the item count and make sure that the remaining data is large enough for the items
+	uint32_t readCount(size_t aMinItemSize) {
+		auto ret = read<uint32_t>();
+		if ((data.size() - pos) / aMinItemSize < ret) {
+			throw ShareException("Invalid cache file");
+		}
+
+		return ret;
+	}
+
+	string readString() {
+		auto len = read<uint32_t>();
+		if (len == 0 || data.size() - pos < len) {
+			throw ShareException("Invalid cache file");
+		}
+
+		string ret(&data[pos], len);
+		pos += len;
+		return ret;
+	}
+
+	string cachePath;
+	string rootPath;
+	string data;
+	size_t pos = 0;
+	uint32_t version = 0;
+
+	ShareManager::ShareBloom& bloom;
+};
+
+typedef shared_ptr<ShareManager::CacheLoader> CacheLoaderPtr;
+typedef vector<CacheLoaderPtr> LoaderList;
 
 bool ShareManager::loadCache(function<void(float)> progressF) noexcept{
 	HashManager::HashPauser pauser;
 
 	Util::migrate(Util::getPath(Util::PATH_SHARECACHE), "ShareCache_*");
 
-	// Get all cache XMLs
+	// Get all cache files
 	StringList fileList = File::findFiles(Util::getPath(Util::PATH_SHARECACHE), "ShareCache_*", File::TYPE_FILE);
 
 	if (fileList.empty()) {
@@ -1438,25 +1764,36 @@ bool ShareManager::loadCache(function<void(float)> progressF) noexcept{
 
 	LoaderList cacheLoaders;
 
-	// Create loaders
-	for (const auto& p : fileList) {
-		if (Util::getFileExt(p) == ".xml") {
-			// Find the corresponding directory pointer for this path
-			auto rp = find_if(rootPaths | map_values, [&p](const Directory::Ptr& aDir) {
-				return Util::stricmp(aDir->getProfileDir()->getCacheXmlPath(), p) == 0; 
-			});
+	// Create loaders (binary caches are preferred, XML caches from older versions are loaded if there's nothing else)
+	StringSet usedCaches;
+	for (const auto& rp : rootPaths) {
+		const auto& d = rp.second;
+		if (d->getParent()) {
+			continue;
+		}
 
-			if (rp.base() != rootPaths.end()) {
-				try {
-					auto loader = std::make_shared<ShareLoader>(rp.base()->first, *rp, *bloom.get());
-					cacheLoaders.emplace_back(loader);
-					continue;
-				} catch (...) {}
-			}
+		auto binaryPath = d->getProfileDir()->getCacheBinaryPath();
+		auto xmlPath = d->getProfileDir()->getCacheXmlPath();
+
+		if (boost::find_if(fileList, [&](const string& p) { return Util::stricmp(p, binaryPath) == 0; }) != fileList.end()) {
+			cacheLoaders.push_back(std::make_shared<ShareBinaryLoader>(rp.first, d, *bloom.get()));
+			usedCaches.insert(Text::toLower(binaryPath));
+		} else if (boost::find_if(fileList, [&](const string& p) { return Util::stricmp(p, xmlPath) == 0; }) != fileList.end()) {
+			try {
+				cacheLoaders.push_back(std::make_shared<ShareLoader>(rp.first, d, *bloom.get()));
+				usedCaches.insert(Text::toLower(xmlPath));
+
+				// Convert to the binary format when saving the cache next time
+				d->getProfileDir()->setCacheDirty(true);
+			} catch (...) {}
 		}
+	}
 
-		// No use for this cache file
-		File::deleteFile(p);
+	for (const auto& p : fileList) {
+		if (usedCaches.find(Text::toLower(p)) == usedCaches.end()) {
+			// No use for this cache file
+			File::deleteFile(p);
+		}
 	}
 
 	{
@@ -1469,18 +1806,19 @@ bool ShareManager::loadCache(function<void(float)> progressF) noexcept{
 		bool hasFailedCaches = false;
 
 		try {
-			parallel_for_each(cacheLoaders.begin(), cacheLoaders.end(), [&](ShareLoaderPtr& i) {
+			parallel_for_each(cacheLoaders.begin(), cacheLoaders.end(), [&](CacheLoaderPtr& i) {
 				//LogManager::getInstance()->message("Thread: " + Util::toString(::GetCurrentThreadId()) + "Size " + Util::toString(loader.size), LogMessage::SEV_INFO);
 				auto& loader = *i;
 				try {
-					SimpleXMLReader(&loader).parse(*loader.file);
-				} catch (SimpleXMLException& e) {
-					LogManager::getInstance()->message(STRING_F(LOAD_FAILED_X, loader.xmlPath % e.getError()), LogMessage::SEV_ERROR);
+					loader.load();
+					loader.prepareNgramChanges();
+				} catch (Exception& e) {
+					LogManager::getInstance()->message(STRING_F(LOAD_FAILED_X, loader.getCachePath() % e.getError()), LogMessage::SEV_ERROR);
 					hasFailedCaches = true;
-					File::deleteFile(loader.xmlPath);
+					File::deleteFile(loader.getCachePath());
 				} catch (...) {
 					hasFailedCaches = true;
-					File::deleteFile(loader.xmlPath);
+					File::deleteFile(loader.getCachePath());
 				}
 
 				if (progressF) {
@@ -1575,6 +1913,63 @@ void ShareManager::countStats(uint64_t& totalAge_, size_t& totalDirs_, int64_t&
 	}
 }
 
+size_t ShareManager::Directory::getMemoryUsage() const noexcept {
+	size_t ret = sizeof(Directory) + realName.getAllocatedSize();
+	ret += directories.capacity() * sizeof(Ptr) + files.capacity() * sizeof(File*);
+
+	for (const auto& f : files) {
+		ret += sizeof(File) + f->name.getAllocatedSize();
+	}
+
+	for (const auto& d : directories) {
+		ret += d->getMemoryUsage();
+	}
+
+	return ret;
+}
+
+size_t ShareManager::getMemoryUsage() const noexcept {
+	RLock l(cs);
+
+	size_t ret = tthIndex.getMemoryUsage();
+	for (const auto& d : rootPaths | map_values | filtered(Directory::IsParent())) {
+		ret += d->getMemoryUsage();
+	}
+
+	return ret;
+}
+
+unique_ptr<CompactShareTree> ShareManager::buildCompactTree() const noexcept {
+	CompactShareTree::Builder builder;
+
+	// Directories are added in breadth-first order
+	deque<const Directory*> dirs;
+
+	RLock l(cs);
+	for (const auto& d : rootPaths | map_values) {
+		const auto& profileDir = d->getProfileDir();
+		builder.addRoot(profileDir->getName(), profileDir->getPath(), d->getLastWrite(), profileDir->getRootProfiles());
+		dirs.push_back(d.get());
+	}
+
+	for (uint32_t i = 0; !dirs.empty(); ++i) {
+		auto dir = dirs.front();
+		dirs.pop_front();
+
+		builder.openDirectory(i);
+		for (const auto& d : dir->directories) {
+			builder.addDirectory(d->realName.getNormal(), d->realName.getLower(), d->getLastWrite());
+			dirs.push_back(d.get());
+		}
+
+		for (const auto& f : dir->files) {
+			builder.addFile(f->name.getNormal(), f->name.getLower(), f->getSize(), f->getLastWrite(), f->getTTH());
+		}
+	}
+
+	return builder.build();
+}
+
 optional<ShareManager::ShareStats> ShareManager::getShareStats() const noexcept {
 	unordered_set<TTHValue*> uniqueTTHs;
 
@@ -1603,6 +1998,9 @@ optional<ShareManager::ShareStats> ShareManager::getShareStats() const noexcept
 	stats.averageFileAge = GET_TIME() - (stats.totalFileCount == 0 ? 0 : totalAge / stats.totalFileCount);
 	stats.averageNameLength = static_cast<double>(stats.totalNameSize) / static_cast<double>(stats.totalFileCount + stats.totalDirectoryCount);
 	stats.rootDirectoryPercentage = (static_cast<double>(stats.profileDirectoryCount) / static_cast<double>(rootPaths.size())) *100.00;
+	stats.memoryUsage = getMemoryUsage();
+	stats.memoryPerFile = stats.totalFileCount == 0 ? 0 : static_cast<double>(stats.memoryUsage) / static_cast<double>(stats.totalFileCount);
+	listCache.getStats(stats.listCacheHits, stats.listCacheMisses, stats.listCacheSize);
 	return stats;
 }
 
@@ -1615,6 +2013,9 @@ string ShareManager::printStats() const noexcept {
 	auto stats = *optionalStats;
 	auto upseconds = static_cast<double>(GET_TICK()) / 1000.00;
 
+	// For comparison with the normal tree (the compact tree isn't used otherwise)
+	auto compactMemoryUsage = buildCompactTree()->getMemoryUsage();
+
 	string ret = boost::str(boost::format(
 "\r\n\r\n-=[ Share statistics ]=-\r\n\r\n\
 Share profiles: %d\r\n\
@@ -1624,7 +2025,10 @@ Total shared files: %d (of which %d%% are lowercase)\r\n\
 Unique TTHs: %d (%d%%)\r\n\
 Total shared directories: %d (%d files per directory)\r\n\
 Average age of a file: %s\r\n\
-Average name length of a shared item: %d bytes (total size %s)")
+Average name length of a shared item: %d bytes (total size %s)\r\n\
+Memory usage of the share tree: %s (%d bytes per file)\r\n\
+Memory usage of a compact share tree: %s (%d bytes per file)\r\n\
+Partial/TTH list cache: %d hits, %d misses (%s cached)")
 
 		% stats.profileCount
 		% stats.profileDirectoryCount % stats.rootDirectoryPercentage
@@ -1635,8 +2039,15 @@ Average name length of a shared item: %d bytes (total size %s)")
 		% Util::formatTime(stats.averageFileAge, false, true)
 		% stats.averageNameLength
 		% Util::formatBytes(stats.totalNameSize)
+		% Util::formatBytes(stats.memoryUsage) % stats.memoryPerFile
+		% Util::formatBytes(compactMemoryUsage) % (static_cast<double>(compactMemoryUsage) / static_cast<double>(stats.totalFileCount))
+		% stats.listCacheHits % stats.listCacheMisses % Util::formatBytes(stats.listCacheSize)
 	);
 
+	auto incomingStats = SearchManager::getInstance()->getIncomingSearchStats();
+	uint64_t searchCacheHits = 0, searchCacheMisses = 0;
+	searchCache.getStats(searchCacheHits, searchCacheMisses);
+
 	ret += boost::str(boost::format(
 "\r\n\r\n-=[ Search statistics ]=-\r\n\r\n\
 Total incoming searches: %d (%d per second)\r\n\
@@ -1645,7 +2056,10 @@ Filtered text searches: %d%% (%d%% of the matched ones returned results)\r\n\
 Average search tokens (non-filtered only): %d (%d bytes per token)\r\n\
 Auto searches (text, ADC only): %d%%\r\n\
 Average time for matching a recursive search: %d ms\r\n\
-TTH searches: %d%% (hash bloom mode: %s)")
+Search index: %d n-grams (%d directory entries)\r\n\
+TTH searches: %d%% (hash bloom mode: %s)\r\n\
+Cached text searches: %d%% (%d hits, %d misses)\r\n\
+Incoming search queue: %d queued, %d answered, %d dropped")
 
 		% totalSearches % (totalSearches / upseconds)
 		% recursiveSearches % ((recursiveSearches - filteredSearches) / upseconds)
@@ -1655,8 +2069,12 @@ TTH searches: %d%% (hash bloom mode: %s)")
 		% (searchTokenCount == 0 ? 0 : static_cast<double>(searchTokenLength) / static_cast<double>(searchTokenCount)) // search token length
 		% (recursiveSearches == 0 ? 0 : (static_cast<double>(autoSearches) / static_cast<double>(recursiveSearches))*100.00) // auto searches
 		% (recursiveSearches - filteredSearches == 0 ? 0 : recursiveSearchTime / (recursiveSearches - filteredSearches)) // search matching time
+		% ngramIndex.getNgramCount() % ngramIndex.getEntryCount() // search index
 		% (totalSearches == 0 ? 0 : (static_cast<double>(tthSearches) / static_cast<double>(totalSearches))*100.00) // TTH searches
 		% (SETTING(BLOOM_MODE) != SettingsManager::BLOOM_DISABLED ? "Enabled" : "Disabled") // bloom mode
+		% (searchCacheHits + searchCacheMisses == 0 ? 0 : (static_cast<double>(searchCacheHits) / static_cast<double>(searchCacheHits + searchCacheMisses))*100.00) // search cache
+		% searchCacheHits % searchCacheMisses
+		% incomingStats.queued % incomingStats.processed % incomingStats.dropped // incoming search queue
 	);
 
 	ret += "\r\n\r\n-=[ Monitoring statistics ]=-\r\n\r\n";
@@ -1758,10 +2176,12 @@ void ShareManager::getProfileInfo(ProfileToken aProfile, int64_t& size, size_t&
 		return;
 
 	if (sp->getProfileInfoDirty()) {
+		ProfileMatcher profileMatcher(aProfile);
+
 		{
 			RLock l(cs);
 			for (const auto& d : rootPaths | map_values) {
-				if (d->getProfileDir()->hasRootProfile(aProfile)) {
+				if (profileMatcher.matches(*d->getProfileDir())) {
 					d->getProfileInfo(aProfile, size, files);
 				}
 			}
@@ -1864,10 +2284,12 @@ bool ShareManager::isFileShared(const TTHValue& aTTH) const noexcept{
 }
 
 bool ShareManager::isFileShared(const TTHValue& aTTH, ProfileToken aProfile) const noexcept{
+	ProfileMatcher profileMatcher(aProfile);
+
 	RLock l (cs);
 	const auto files = tthIndex.equal_range(const_cast<TTHValue*>(&aTTH));
 	for(auto i = files.first; i != files.second; ++i) {
-		if(i->second->getParent()->hasProfile(aProfile)) {
+		if(i->second->getParent()->hasProfile(profileMatcher)) {
 			return true;
 		}
 	}
@@ -1876,14 +2298,66 @@ bool ShareManager::isFileShared(const TTHValue& aTTH, ProfileToken aProfile) con
 }
 
 void ShareManager::buildTree(const string& aPath, const string& aPathLower, const Directory::Ptr& aDir, Directory::MultiMap& directoryNameMapNew_, int64_t& hashSize_,
-	int64_t& addedSize_, HashFileMap& tthIndexNew_, ShareBloom& bloomNew_) {
+	int64_t& addedSize_, HashFileMap& tthIndexNew_, ShareBloom& bloomNew_, const Directory::Ptr& aOldDir, TreeBuildDirList* pendingDirs_) {
+
+	// Content of the existing directory (fast refresh)
+	// The old tree may be modified by other threads so the information needs to be copied
+	// The items are mapped by lowercase names
+	unordered_map<string, pair<string, Directory::Ptr>> oldDirs;
+	unordered_map<string, pair<string, HashedFile>> oldFiles;
+	bool unchanged = false;
+	if (aOldDir) {
+		RLock l(cs);
+		for (const auto& d : aOldDir->directories) {
+			oldDirs.emplace(d->realName.getLower(), make_pair(d->realName.getNormal(), d));
+		}
+
+		for (const auto& f : aOldDir->files) {
+			oldFiles.emplace(f->name.getLower(), make_pair(f->name.getNormal(), HashedFile(f->getTTH(), f->getLastWrite(), f->getSize())));
+		}
+
+		unchanged = !aOldDir->getIncomplete() && aDir->getLastWrite() != 0 && aOldDir->getLastWrite() == aDir->getLastWrite();
+	}
+
+	if (unchanged) {
+		// No items have been added, removed or renamed in this directory since the previous refresh and nothing was left out from it
+		// so there's no need to list it (modifying the content of a file doesn't change the modification date of the directory)
+		for (const auto& f : oldFiles) {
+			const auto& fi = f.second.second;
+			if (!checkSharedName(aPath + f.second.first, aPathLower + f.first, false, true, fi.getSize())) {
+				continue;
+			}
+
+			DualString dualName(f.second.first);
+
+			auto pos = aDir->files.insert_sorted(new ShareManager::Directory::File(move(dualName), aDir, fi));
+			updateIndices(*aDir, *pos.first, bloomNew_, addedSize_, tthIndexNew_);
+		}
+
+		// The subdirectories must be checked separately
+		for (const auto& d : oldDirs | map_values) {
+			auto lastWrite = File::getLastModified(aPath + d.first);
+			if (lastWrite == 0) {
+				continue;
+			}
+
+			buildTreeDirectory(aPath, aPathLower, aDir, d.first, lastWrite, directoryNameMapNew_, hashSize_, addedSize_, tthIndexNew_, bloomNew_, d.second, pendingDirs_);
+		}
+
+		return;
+	}
+
+	// Files that need to be checked from the hash database, all of them are looked up at once
+	vector<DualString> checkNames;
+	StringList checkPathsLower, checkPaths;
+	vector<HashedFile> checkInfos;
 
 	FileFindIter end;
 	for(FileFindIter i(aPath, "*"); i != end && !aShutdown; ++i) {
 		string name = i->getFileName();
 		if(name.empty()) {
 			LogManager::getInstance()->message("Invalid file name found while hashing folder " + aPath + ".", LogMessage::SEV_WARNING);
-			return;
+			break;
 		}
 
 		if(!SETTING(SHARE_HIDDEN) && i->isHidden())
@@ -1893,44 +2367,15 @@ void ShareManager::buildTree(const string& aPath, const string& aPathLower, cons
 			continue;
 
 		if(i->isDirectory()) {
-			DualString dualName(name);
-			string curPath = aPath + name + PATH_SEPARATOR;
-			string curPathLower = aPathLower + dualName.getLower() + PATH_SEPARATOR;
-
-			{
-				RLock l (refreshMatcherCS);
-				if (!checkSharedName(curPath, curPathLower, true)) {
-					continue;
-				}
-
-				// Check the queue so we dont add incomplete directories to share
-
-				// TODO
-				//auto bundle = QueueManager::getInstance()->findDirectoryBundle(curPath);
-				//if (bundle && bundle->getStatus() < Bundle::STATUS_HASHED) {
-				//	return;
-				//}
-
-				if (bundleDirs.find(curPathLower) != bundleDirs.end()) {
-					continue;
-				}
-
-				if (excludedPaths.find(curPath) != excludedPaths.end()) {
-					continue;
+			Directory::Ptr oldDir = nullptr;
+			if (!oldDirs.empty()) {
+				auto p = oldDirs.find(Text::toLower(name));
+				if (p != oldDirs.end()) {
+					oldDir = p->second.second;
 				}
 			}
 
-			auto dir = Directory::createNormal(move(dualName), aDir, i->getLastWriteTime(), directoryNameMapNew_, bloomNew_);
-			buildTree(curPath, curPathLower, dir, directoryNameMapNew_, hashSize_, addedSize_, tthIndexNew_, bloomNew_);
-
-			// Empty directory?
-			if (SETTING(SKIP_EMPTY_DIRS_SHARE) && dir->directories.empty() && dir->files.empty()) {
-				// Remove from parent
-				//cleanIndices(*dir.get());
-				removeDirName(*dir.get(), directoryNameMapNew_);
-				aDir->directories.erase_key(dir->realName.getLower());
-				continue;
-			}
+			buildTreeDirectory(aPath, aPathLower, aDir, name, i->getLastWriteTime(), directoryNameMapNew_, hashSize_, addedSize_, tthIndexNew_, bloomNew_, oldDir, pendingDirs_);
 		} else {
 			// Not a directory, assume it's a file...
 			int64_t size = i->getSize();
@@ -1940,67 +2385,218 @@ void ShareManager::buildTree(const string& aPath, const string& aPathLower, cons
 				continue;
 			}
 
-			try {
-				HashedFile fi(i->getLastWriteTime(), size);
-				if(HashManager::getInstance()->checkTTH(aPathLower + dualName.getLower(), aPath + name, fi)) {
-					auto pos = aDir->files.insert_sorted(new ShareManager::Directory::File(move(dualName), aDir, fi));
-					updateIndices(*aDir, *pos.first, bloomNew_, addedSize_, tthIndexNew_);
-				} else {
-					hashSize_ += size;
-				}
-			} catch(const HashException&) {
+			HashedFile fi(i->getLastWriteTime(), size);
+
+			// Unchanged files don't need to be checked from the hash database (fast refresh)
+			auto oldFile = oldFiles.find(dualName.getLower());
+			if (oldFile == oldFiles.end() || oldFile->second.second.getTimeStamp() != fi.getTimeStamp() || oldFile->second.second.getSize() != size) {
+				checkPathsLower.push_back(aPathLower + dualName.getLower());
+				checkPaths.push_back(aPath + name);
+				checkInfos.push_back(fi);
+				checkNames.push_back(move(dualName));
+				continue;
 			}
-		}
-	}
-}
 
-void ShareManager::updateIndices(Directory::Ptr& dir, ShareBloom& aBloom, int64_t& sharedSize, HashFileMap& tthIndex, Directory::MultiMap& aDirNames) noexcept {
-	// update all sub items
-	for(auto& d: dir->directories) {
-		updateIndices(d, aBloom, sharedSize, tthIndex, aDirNames);
+			auto pos = aDir->files.insert_sorted(new ShareManager::Directory::File(move(dualName), aDir, oldFile->second.second));
+			updateIndices(*aDir, *pos.first, bloomNew_, addedSize_, tthIndexNew_);
+		}
 	}
 
-	for(auto i = dir->files.begin(); i != dir->files.end(); i++) {
-		updateIndices(*dir, *i, aBloom, sharedSize, tthIndex);
+	if (checkNames.empty()) {
+		return;
 	}
-}
 
-#ifdef _DEBUG
-void ShareManager::checkAddedDirNameDebug(const Directory::Ptr& aDir, Directory::MultiMap& aDirNames) noexcept {
-	auto directories = aDirNames.equal_range(const_cast<string*>(&aDir->getVirtualNameLower()));
-	auto findByPtr = find(directories | map_values, aDir);
-	auto findByPath = find_if(directories | map_values, [&](const Directory::Ptr& d) {
-		return d->getRealPath() == aDir->getRealPath();
-	});
+	auto found = HashManager::getInstance()->checkTTHs(checkPathsLower, checkPaths, checkInfos);
+	for (size_t i = 0; i < checkNames.size(); ++i) {
+		if (!found[i]) {
+			hashSize_ += checkInfos[i].getSize();
+			aDir->setIncomplete(true);
+			continue;
+		}
 
-	dcassert(findByPtr.base() == directories.second);
-	dcassert(findByPath.base() == directories.second);
+		auto pos = aDir->files.insert_sorted(new ShareManager::Directory::File(move(checkNames[i]), aDir, checkInfos[i]));
+		updateIndices(*aDir, *pos.first, bloomNew_, addedSize_, tthIndexNew_);
+	}
 }
 
-void ShareManager::checkAddedTTHDebug(const Directory::File* aFile, HashFileMap& aTTHIndex) noexcept {
-	auto flst = aTTHIndex.equal_range(const_cast<TTHValue*>(&aFile->getTTH()));
-	auto p = find(flst | map_values, aFile);
-	dcassert(p.base() == flst.second);
-}
+void ShareManager::buildTreeDirectory(const string& aParentPath, const string& aParentPathLower, const Directory::Ptr& aParent, const string& aName, uint64_t aLastWrite, Directory::MultiMap& directoryNameMapNew_, int64_t& hashSize_,
+	int64_t& addedSize_, HashFileMap& tthIndexNew_, ShareBloom& bloomNew_, const Directory::Ptr& aOldDir, TreeBuildDirList* pendingDirs_) {
 
-void ShareManager::validateDirectoryTreeDebug() noexcept {
-	size_t totalDirs = 0, totalFiles = 0;
+	DualString dualName(aName);
+	string curPath = aParentPath + aName + PATH_SEPARATOR;
+	string curPathLower = aParentPathLower + dualName.getLower() + PATH_SEPARATOR;
 
-	auto start = GET_TICK();
 	{
-		RLock l(cs);
-		for (const auto& d : rootPaths | map_values) {
-			validateDirectoryRecursiveDebug(d, totalDirs, totalFiles);
+		RLock l (refreshMatcherCS);
+		if (!checkSharedName(curPath, curPathLower, true)) {
+			return;
 		}
-	}
-	auto end = GET_TICK();
-	dcdebug("Share tree checked in " U64_FMT " ms\n", end - start);
 
-	dcassert(totalFiles == tthIndex.size() && totalDirs == lowerDirNameMap.size());
-}
+		// Check the queue so we dont add incomplete directories to share
 
-void ShareManager::validateDirectoryRecursiveDebug(const Directory::Ptr& aDir, size_t& dirCount_, size_t& fileCount_) noexcept {
-	dirCount_++;
+		// TODO
+		//auto bundle = QueueManager::getInstance()->findDirectoryBundle(curPath);
+		//if (bundle && bundle->getStatus() < Bundle::STATUS_HASHED) {
+		//	return;
+		//}
+
+		if (bundleDirs.find(curPathLower) != bundleDirs.end()) {
+			aParent->setIncomplete(true);
+			return;
+		}
+
+		if (excludedPaths.find(curPath) != excludedPaths.end()) {
+			return;
+		}
+	}
+
+	auto dir = Directory::createNormal(move(dualName), aParent, aLastWrite, directoryNameMapNew_, bloomNew_);
+	if (pendingDirs_) {
+		// Scanned later (empty directories are also removed by the caller)
+		pendingDirs_->push_back({ curPath, curPathLower, dir, aOldDir });
+		return;
+	}
+
+	buildTree(curPath, curPathLower, dir, directoryNameMapNew_, hashSize_, addedSize_, tthIndexNew_, bloomNew_, aOldDir);
+
+	// Empty directory?
+	if (SETTING(SKIP_EMPTY_DIRS_SHARE) && dir->directories.empty() && dir->files.empty()) {
+		// Remove from parent
+		//cleanIndices(*dir.get());
+		removeDirName(*dir.get(), directoryNameMapNew_);
+		aParent->directories.erase_key(dir->realName.getLower());
+		aParent->setIncomplete(true);
+	}
+}
+
+void ShareManager::buildTreeParallel(const string& aPath, const string& aPathLower, const Directory::Ptr& aDir, Directory::MultiMap& directoryNameMapNew_, int64_t& hashSize_,
+	int64_t& addedSize_, HashFileMap& tthIndexNew_, ShareBloom& bloomNew_, const Directory::Ptr& aOldDir) {
+
+	// Results of a single thread
+	struct Fragment {
+		Fragment() : bloom(1 << 20) { }
+
+		Directory::MultiMap lowerDirNameMap;
+		HashFileMap tthIndex;
+		ShareBloom bloom;
+		int64_t hashSize = 0;
+		int64_t addedSize = 0;
+		TreeBuildDirList pendingDirs;
+	};
+
+	// A fragment is reserved for each running task so that the threads won't need to synchronize while scanning
+	vector<unique_ptr<Fragment>> fragments;
+	vector<Fragment*> freeFragments;
+	FastCriticalSection fcs;
+
+	auto scanDirectory = [&](const TreeBuildDir& aBuildDir) {
+		Fragment* f = nullptr;
+
+		{
+			FastLock l(fcs);
+			if (freeFragments.empty()) {
+				fragments.emplace_back(new Fragment);
+				f = fragments.back().get();
+			} else {
+				f = freeFragments.back();
+				freeFragments.pop_back();
+			}
+		}
+
+		buildTree(aBuildDir.path, aBuildDir.pathLower, aBuildDir.directory, f->lowerDirNameMap, f->hashSize, f->addedSize, f->tthIndex, f->bloom, aBuildDir.oldDirectory, &f->pendingDirs);
+
+		{
+			FastLock l(fcs);
+			freeFragments.push_back(f);
+		}
+	};
+
+	// Scan the tree one level at a time
+	vector<TreeBuildDirList> levels;
+	levels.push_back({ { aPath, aPathLower, aDir, aOldDir } });
+	while (!levels.back().empty() && !aShutdown) {
+		parallel_for_each(levels.back().begin(), levels.back().end(), scanDirectory);
+
+		TreeBuildDirList nextLevel;
+		for (auto& f : fragments) {
+			move(f->pendingDirs.begin(), f->pendingDirs.end(), back_inserter(nextLevel));
+			f->pendingDirs.clear();
+		}
+
+		levels.push_back(move(nextLevel));
+	}
+
+	// Merge the results
+	for (const auto& f : fragments) {
+		directoryNameMapNew_.insert(f->lowerDirNameMap.begin(), f->lowerDirNameMap.end());
+		tthIndexNew_.insert(f->tthIndex.begin(), f->tthIndex.end());
+		bloomNew_.merge(f->bloom);
+		hashSize_ += f->hashSize;
+		addedSize_ += f->addedSize;
+	}
+
+	// Remove empty directories (starting from the deepest ones so that the parents can be checked as well)
+	if (SETTING(SKIP_EMPTY_DIRS_SHARE)) {
+		for (auto l = levels.rbegin(); l != levels.rend(); ++l) {
+			for (const auto& d : *l) {
+				auto& dir = d.directory;
+				if (dir != aDir && dir->directories.empty() && dir->files.empty()) {
+					removeDirName(*dir, directoryNameMapNew_);
+					dir->getParent()->setIncomplete(true);
+					dir->getParent()->directories.erase_key(dir->realName.getLower());
+				}
+			}
+		}
+	}
+}
+
+void ShareManager::updateIndices(Directory::Ptr& dir, ShareBloom& aBloom, int64_t& sharedSize, HashFileMap& tthIndex, Directory::MultiMap& aDirNames) noexcept {
+	// update all sub items
+	for(auto& d: dir->directories) {
+		updateIndices(d, aBloom, sharedSize, tthIndex, aDirNames);
+	}
+
+	for(auto i = dir->files.begin(); i != dir->files.end(); i++) {
+		updateIndices(*dir, *i, aBloom, sharedSize, tthIndex);
+	}
+}
+
+#ifdef _DEBUG
+void ShareManager::checkAddedDirNameDebug(const Directory::Ptr& aDir, Directory::MultiMap& aDirNames) noexcept {
+	auto directories = aDirNames.equal_range(const_cast<string*>(&aDir->getVirtualNameLower()));
+	auto findByPtr = find(directories | map_values, aDir);
+	auto findByPath = find_if(directories | map_values, [&](const Directory::Ptr& d) {
+		return d->getRealPath() == aDir->getRealPath();
+	});
+
+	dcassert(findByPtr.base() == directories.second);
+	dcassert(findByPath.base() == directories.second);
+}
+
+void ShareManager::checkAddedTTHDebug(const Directory::File* aFile, HashFileMap& aTTHIndex) noexcept {
+	auto flst = aTTHIndex.equal_range(const_cast<TTHValue*>(&aFile->getTTH()));
+	auto p = find(flst | map_values, aFile);
+	dcassert(p.base() == flst.second);
+}
+
+void ShareManager::validateDirectoryTreeDebug() noexcept {
+	size_t totalDirs = 0, totalFiles = 0;
+
+	auto start = GET_TICK();
+	{
+		RLock l(cs);
+		for (const auto& d : rootPaths | map_values) {
+			validateDirectoryRecursiveDebug(d, totalDirs, totalFiles);
+		}
+	}
+	auto end = GET_TICK();
+	dcdebug("Share tree checked in " U64_FMT " ms\n", end - start);
+
+	dcassert(totalFiles == tthIndex.size() && totalDirs == lowerDirNameMap.size());
+}
+
+void ShareManager::validateDirectoryRecursiveDebug(const Directory::Ptr& aDir, size_t& dirCount_, size_t& fileCount_) noexcept {
+	dirCount_++;
 
 	{
 		Directory::List dirs;
@@ -2197,7 +2793,7 @@ void ShareManager::setDefaultProfile(ProfileToken aNewDefault) noexcept {
 	auto oldDefault = SETTING(DEFAULT_SP);
 
 	{
-		WLock l(cs);
+		TreeWLock l(*this);
 		// Put the default profile on top
 		auto p = find(shareProfiles, aNewDefault);
 		rotate(shareProfiles.begin(), p, shareProfiles.end());
@@ -2234,7 +2830,7 @@ void ShareManager::renameProfiles(const ShareProfileInfo::List& aProfiles) noexc
 
 void ShareManager::addProfile(const ShareProfilePtr& aProfile) noexcept {
 	{
-		WLock l(cs);
+		TreeWLock l(*this);
 
 		// Hidden profile should always be the last one
 		shareProfiles.insert(shareProfiles.end() - 1, aProfile);
@@ -2251,7 +2847,7 @@ bool ShareManager::removeProfile(ProfileToken aToken) noexcept {
 	StringList removedPaths;
 
 	{
-		WLock l(cs);
+		TreeWLock l(*this);
 		// Remove all directories
 		for (auto& root : rootPaths) {
 			auto profiles = root.second->getProfileDir()->getRootProfiles();
@@ -2284,7 +2880,7 @@ bool ShareManager::addRootDirectory(const ShareDirectoryInfoPtr& aDirectoryInfo)
 	const auto& path = aDirectoryInfo->path;
 
 	{
-		WLock l(cs);
+		TreeWLock l(*this);
 		auto i = rootPaths.find(path);
 		if (i != rootPaths.end()) {
 			return false;
@@ -2295,6 +2891,7 @@ bool ShareManager::addRootDirectory(const ShareDirectoryInfoPtr& aDirectoryInfo)
 			auto profileDir = ProfileDirectory::create(path, aDirectoryInfo->virtualName, aDirectoryInfo->profiles, aDirectoryInfo->incoming, profileDirs);
 
 			newRoot = Directory::createRoot(Util::getLastDir(path), File::getLastModified(path), profileDir, rootPaths, lowerDirNameMap, *bloom.get());
+			addNgrams(*newRoot, newRoot->getVirtualNameLower());
 		}
 	}
 
@@ -2314,7 +2911,7 @@ bool ShareManager::removeRootDirectory(const string& aPath) noexcept {
 	ProfileTokenSet dirtyProfiles;
 
 	{
-		WLock l(cs);
+		TreeWLock l(*this);
 		auto k = rootPaths.find(aPath);
 		if (k == rootPaths.end()) {
 			return false;
@@ -2329,6 +2926,7 @@ bool ShareManager::removeRootDirectory(const string& aPath) noexcept {
 		// Remove the root
 		cleanIndices(*sd);
 		File::deleteFile(sd->getProfileDir()->getCacheXmlPath());
+		File::deleteFile(sd->getProfileDir()->getCacheBinaryPath());
 	}
 
 	removeMonitoring({ aPath });
@@ -2364,7 +2962,7 @@ bool ShareManager::updateRootDirectory(const ShareDirectoryInfoPtr& aDirectoryIn
 	ProfileTokenSet dirtyProfiles = aDirectoryInfo->profiles;
 
 	{
-		WLock l(cs);
+		TreeWLock l(*this);
 		auto vName = validateVirtualName(aDirectoryInfo->virtualName);
 
 		auto p = rootPaths.find(aDirectoryInfo->path);
@@ -2375,8 +2973,10 @@ bool ShareManager::updateRootDirectory(const ShareDirectoryInfoPtr& aDirectoryIn
 			dirtyProfiles.insert(profileDir->getRootProfiles().begin(), profileDir->getRootProfiles().end());
 
 			removeDirName(*p->second, lowerDirNameMap);
+			removeNgrams(*p->second, nullptr);
 			profileDir->setName(vName);
 			addDirName(p->second, lowerDirNameMap, *bloom.get());
+			addNgrams(*p->second, p->second->getVirtualNameLower());
 
 			profileDir->setIncoming(aDirectoryInfo->incoming);
 			profileDir->setRootProfiles(aDirectoryInfo->profiles);
@@ -2572,6 +3172,11 @@ void ShareManager::runTasks(function<void (float)> progressF /*nullptr*/) noexce
 		int64_t totalHash = 0;
 		ProfileTokenSet dirtyProfiles;
 
+		auto multithreaded = SETTING(REFRESH_THREADING) == SettingsManager::MULTITHREAD_ALWAYS || (SETTING(REFRESH_THREADING) == SettingsManager::MULTITHREAD_MANUAL && (task->type == TYPE_MANUAL || task->type == TYPE_STARTUP_BLOCKING));
+
+		// Only check the directories that have been modified (changes in existing files won't be detected)
+		auto fastRefresh = task->type == TYPE_SCHEDULED && SETTING(FAST_SCHEDULED_REFRESH);
+
 		auto doRefresh = [&](const RefreshInfoPtr& i) {
 			auto& ri = *i.get();
 			const auto& path = ri.path;
@@ -2581,7 +3186,12 @@ void ShareManager::runTasks(function<void (float)> progressF /*nullptr*/) noexce
 			// Build the tree
 			bool succeed = false;
 			try {
-				buildTree(path, Text::toLower(ri.path), ri.newShareDirectory, ri.lowerDirNameMapNew, ri.hashSize, ri.addedSize, ri.tthIndexNew, *refreshBloom);
+				auto oldDir = fastRefresh ? ri.oldShareDirectory : nullptr;
+				if (multithreaded) {
+					buildTreeParallel(path, Text::toLower(ri.path), ri.newShareDirectory, ri.lowerDirNameMapNew, ri.hashSize, ri.addedSize, ri.tthIndexNew, *refreshBloom, oldDir);
+				} else {
+					buildTree(path, Text::toLower(ri.path), ri.newShareDirectory, ri.lowerDirNameMapNew, ri.hashSize, ri.addedSize, ri.tthIndexNew, *refreshBloom, oldDir);
+				}
 				succeed = true;
 			} catch (const std::bad_alloc&) {
 				LogManager::getInstance()->message(STRING_F(DIR_REFRESH_FAILED, path % STRING(OUT_OF_MEMORY)), LogMessage::SEV_ERROR);
@@ -2593,12 +3203,25 @@ void ShareManager::runTasks(function<void (float)> progressF /*nullptr*/) noexce
 			if (aShutdown)
 				return;
 
+			ri.prepareNgramChanges();
+
+			// Collect the removed content without blocking searches and uploads
+			{
+				RLock l(cs);
+				ri.prepareRemovedContent(treeRevision);
+			}
+
+			ShareNgramIndex::sortChanges(ri.ngramChangesOld);
+
 			// Apply the changes
 			{
-				WLock l(cs);
+				TreeWLock l(*this);
 				applyRefreshChanges(ri, totalHash, &dirtyProfiles);
 			}
 
+			// Release the replaced tree after unlocking
+			ri.oldShareDirectory = nullptr;
+
 			// Finish up
 			setRefreshState(ri.path, RefreshState::STATE_NORMAL, succeed);
 			if (progressF) {
@@ -2607,7 +3230,7 @@ void ShareManager::runTasks(function<void (float)> progressF /*nullptr*/) noexce
 		};
 
 		try {
-			if (SETTING(REFRESH_THREADING) == SettingsManager::MULTITHREAD_ALWAYS || (SETTING(REFRESH_THREADING) == SettingsManager::MULTITHREAD_MANUAL && (task->type == TYPE_MANUAL || task->type == TYPE_STARTUP_BLOCKING))) {
+			if (multithreaded) {
 				TaskScheduler s;
 				parallel_for_each(refreshDirs.begin(), refreshDirs.end(), doRefresh);
 			} else {
@@ -2624,7 +3247,7 @@ void ShareManager::runTasks(function<void (float)> progressF /*nullptr*/) noexce
 		if(t.first == REFRESH_ALL) {
 			// Reset the bloom so that removed files are nulled (which won't happen with partial refreshes)
 
-			WLock l(cs);
+			TreeWLock l(*this);
 			bloom.reset(refreshBloom);
 		}
 
@@ -2649,7 +3272,38 @@ void ShareManager::runTasks(function<void (float)> progressF /*nullptr*/) noexce
 	refreshing.clear();
 }
 
-void ShareManager::RefreshInfo::mergeRefreshChanges(Directory::MultiMap& lowerDirNameMap_, Directory::Map& rootPaths_, HashFileMap& tthIndex_, int64_t& totalHash_, int64_t& totalAdded_, ProfileTokenSet* dirtyProfiles_) noexcept {
+void ShareManager::RefreshInfo::prepareNgramChanges() noexcept {
+	ngramChangesNew.clear();
+	getNgramChanges(*newShareDirectory, ngramChangesNew, true);
+	ShareNgramIndex::sortChanges(ngramChangesNew);
+}
+
+void ShareManager::RefreshInfo::prepareRemovedContent(uint64_t aTreeRevision) noexcept {
+	ngramChangesOld.clear();
+	removedDirs.clear();
+	removedFiles.clear();
+	removedContentRevision = aTreeRevision;
+	if (!oldShareDirectory) {
+		return;
+	}
+
+	getNgramChanges(*oldShareDirectory, ngramChangesOld, true);
+
+	function<void(const Directory&)> collect = [&](const Directory& aDir) {
+		removedDirs.push_back(&aDir);
+		for (const auto& f : aDir.files) {
+			removedFiles.push_back(f);
+		}
+
+		for (const auto& d : aDir.directories) {
+			collect(*d);
+		}
+	};
+
+	collect(*oldShareDirectory);
+}
+
+void ShareManager::RefreshInfo::mergeRefreshChanges(Directory::MultiMap& lowerDirNameMap_, Directory::Map& rootPaths_, HashFileMap& tthIndex_, ShareNgramIndex& ngramIndex_, int64_t& totalHash_, int64_t& totalAdded_, ProfileTokenSet* dirtyProfiles_) noexcept {
 #ifdef _DEBUG
 	for (const auto& d: lowerDirNameMapNew | map_values) {
 		checkAddedDirNameDebug(d, lowerDirNameMap_);
@@ -2662,6 +3316,7 @@ void ShareManager::RefreshInfo::mergeRefreshChanges(Directory::MultiMap& lowerDi
 
 	lowerDirNameMap_.insert(lowerDirNameMapNew.begin(), lowerDirNameMapNew.end());
 	tthIndex_.insert(tthIndexNew.begin(), tthIndexNew.end());
+	ngramIndex_.insert(ngramChangesNew);
 
 	for (const auto& rp : rootPathsNew) {
 		dcassert(rootPaths_.find(rp.first) == rootPaths_.end());
@@ -2676,9 +3331,13 @@ void ShareManager::RefreshInfo::mergeRefreshChanges(Directory::MultiMap& lowerDi
 	}
 
 	// Save some memory
+	// The old tree is released by the caller (possibly after unlocking)
 	lowerDirNameMapNew.clear();
 	tthIndexNew.clear();
-	oldShareDirectory = nullptr;
+	ShareNgramIndex::ChangeList().swap(ngramChangesNew);
+	ShareNgramIndex::ChangeList().swap(ngramChangesOld);
+	vector<const Directory*>().swap(removedDirs);
+	vector<const Directory::File*>().swap(removedFiles);
 	newShareDirectory = nullptr;
 }
 
@@ -2713,7 +3372,12 @@ void ShareManager::setRefreshState(const string& aRefreshPath, RefreshState aSta
 bool ShareManager::applyRefreshChanges(RefreshInfo& ri, int64_t& totalHash_, ProfileTokenSet* aDirtyProfiles) {
 	// Recursively remove the content of this dir from TTHIndex and directory name map
 	if (ri.oldShareDirectory) {
-		cleanIndices(*ri.oldShareDirectory);
+		if (!ri.removedDirs.empty() && ri.removedContentRevision == treeRevision) {
+			// Nothing has been modified since the content was collected
+			removeIndices(ri);
+		} else {
+			cleanIndices(*ri.oldShareDirectory);
+		}
 	}
 
 	// Remove this path from root paths
@@ -2753,7 +3417,10 @@ bool ShareManager::applyRefreshChanges(RefreshInfo& ri, int64_t& totalHash_, Pro
 		parent->updateModifyDate();
 	}
 
-	ri.mergeRefreshChanges(lowerDirNameMap, rootPaths, tthIndex, totalHash_, sharedSize, aDirtyProfiles);
+	// Hash blooms created after this would already contain the new files (the tree is locked while a bloom is being created)
+	addHashBlooms(ri.tthIndexNew);
+
+	ri.mergeRefreshChanges(lowerDirNameMap, rootPaths, tthIndex, ngramIndex, totalHash_, sharedSize, aDirtyProfiles);
 	dcdebug("Share changes applied for the directory %s\n", ri.path.c_str());
 	return true;
 }
@@ -2830,13 +3497,43 @@ ShareDirectoryInfoList ShareManager::getRootInfos() const noexcept {
 	return ret;
 }
 		
-void ShareManager::getBloom(HashBloom& bloom_) const noexcept {
+// Maximum number of different hash blooms to keep updated
+#define MAX_CACHED_HASH_BLOOMS 3
+
+void ShareManager::getBloom(ByteVector& v_, size_t aK, size_t aM, size_t aH) const noexcept {
 	RLock l(cs);
-	for(const auto tth: tthIndex | map_keys)
-		bloom_.add(*tth);
+	Lock bl(hashBloomCS);
+
+	auto i = find_if(hashBlooms.begin(), hashBlooms.end(), [&](const CachedHashBloom& b) { return b.bloom->hasParams(aK, aM, aH); });
+	if (i == hashBlooms.end()) {
+		if (hashBlooms.size() >= MAX_CACHED_HASH_BLOOMS) {
+			hashBlooms.erase(min_element(hashBlooms.begin(), hashBlooms.end(), [](const CachedHashBloom& a, const CachedHashBloom& b) { return a.lastUsed < b.lastUsed; }));
+		}
+
+		unique_ptr<CountingHashBloom> bloom(new CountingHashBloom(aK, aM, aH));
+		for (const auto tth : tthIndex | map_keys)
+			bloom->add(*tth);
 
-	for(const auto& tth: tempShares | map_keys)
-		bloom_.add(tth);
+		for (const auto& tth : tempShares | map_keys)
+			bloom->add(tth);
+
+		hashBlooms.push_back({ move(bloom), 0 });
+		i = prev(hashBlooms.end());
+	}
+
+	i->lastUsed = GET_TICK();
+	v_ = i->bloom->getBytes();
+}
+
+void ShareManager::updateHashBlooms(const TTHValue& aTTH, bool aAdded) noexcept {
+	Lock l(hashBloomCS);
+	for (auto& b : hashBlooms) {
+		if (aAdded) {
+			b.bloom->add(aTTH);
+		} else {
+			b.bloom->remove(aTTH);
+		}
+	}
 }
 
 string ShareManager::generateOwnList(ProfileToken aProfile) throw(ShareException) {
@@ -2845,6 +3542,108 @@ string ShareManager::generateOwnList(ProfileToken aProfile) throw(ShareException
 }
 
 
+// Size of the data chunks passed from the file list writer to the compressor and the maximum number of queued chunks
+#define FILE_LIST_CHUNK_SIZE 256*1024
+#define FILE_LIST_MAX_CHUNKS 4
+
+// Passes the generated file list from the writer thread to the compressor in chunks
+// The writer is blocked while the queue is full so the memory usage doesn't depend on the size of the list
+class FileListChunkQueue : public OutputStream {
+public:
+	using OutputStream::write;
+
+	FileListChunkQueue(size_t aChunkSize, size_t aMaxChunks) : chunkSize(aChunkSize), maxChunks(aMaxChunks) {
+		chunk.reserve(chunkSize);
+	}
+
+	size_t write(const void* aBuf, size_t aLen) {
+		auto buf = static_cast<const char*>(aBuf);
+		auto left = aLen;
+		while (left > 0) {
+			auto n = min(chunkSize - chunk.size(), left);
+			chunk.append(buf, n);
+			buf += n;
+			left -= n;
+
+			if (chunk.size() == chunkSize) {
+				push();
+			}
+		}
+
+		return aLen;
+	}
+
+	size_t flush() {
+		if (!chunk.empty()) {
+			push();
+		}
+
+		return 0;
+	}
+
+	// Called by the writer when there is no more data (the exception is rethrown to the reader if the writing failed)
+	void close(exception_ptr aError) noexcept {
+		std::lock_guard<std::mutex> l(cs);
+		closed = true;
+		error = aError;
+		dataAvailable.notify_all();
+	}
+
+	// Called by the reader if the rest of the data isn't needed (the writer will throw on the next write)
+	void cancel() noexcept {
+		std::lock_guard<std::mutex> l(cs);
+		cancelled = true;
+		spaceAvailable.notify_all();
+	}
+
+	// Get the next chunk, returns false when all data has been read
+	bool pop(string& chunk_) {
+		std::unique_lock<std::mutex> l(cs);
+		dataAvailable.wait(l, [this] { return !chunks.empty() || closed; });
+		if (chunks.empty()) {
+			if (error) {
+				rethrow_exception(error);
+			}
+
+			return false;
+		}
+
+		chunk_ = move(chunks.front());
+		chunks.pop_front();
+		spaceAvailable.notify_all();
+		return true;
+	}
+private:
+	void push() {
+		std::unique_lock<std::mutex> l(cs);
+		spaceAvailable.wait(l, [this] { return chunks.size() < maxChunks || cancelled; });
+		if (cancelled) {
+			throw Exception("Cancelled");
+		}
+
+		chunks.push_back(move(chunk));
+		dataAvailable.notify_all();
+
+		chunk = string();
+		chunk.reserve(chunkSize);
+	}
+
+	const size_t chunkSize;
+	const size_t maxChunks;
+
+	// Chunk that is being written
+	string chunk;
+
+	std::mutex cs;
+	std::condition_variable dataAvailable;
+	std::condition_variable spaceAvailable;
+
+	deque<string> chunks;
+	bool closed = false;
+	bool cancelled = false;
+	exception_ptr error;
+};
+
 //forwards the calls to createFileList for creating the filelist that was reguested.
 FileList* ShareManager::generateXmlList(ProfileToken aProfile, bool forced /*false*/) throw(ShareException) {
 	FileList* fl = nullptr;
@@ -2863,27 +3662,43 @@ FileList* ShareManager::generateXmlList(ProfileToken aProfile, bool forced /*fal
 	{
 		Lock lFl(fl->cs);
 		if (fl->allowGenerateNew(forced)) {
-			auto tmpName = fl->getFileName().substr(0, fl->getFileName().length() - 4);
 			try {
 				{
-					File f(tmpName, File::RW, File::TRUNCATE | File::CREATE, File::BUFFER_SEQUENTIAL, false);
-
-					toFilelist(f, "/", aProfile, true);
-
-					fl->setXmlListLen(f.getSize());
-
 					File bz(fl->getFileName(), File::WRITE, File::TRUNCATE | File::CREATE, File::BUFFER_SEQUENTIAL, false);
 					// We don't care about the leaves...
 					CalcOutputStream<TTFilter<1024 * 1024 * 1024>, false> bzTree(&bz);
-					FilteredOutputStream<BZFilter, false> bzipper(&bzTree);
+					FilteredOutputStream<ParallelBZFilter, false> bzipper(&bzTree);
 					CalcOutputStream<TTFilter<1024 * 1024 * 1024>, false> newXmlFile(&bzipper);
 
-					newXmlFile.write(f.read());
+					// The list is written by a separate thread (while holding the share lock) and compressed in here as the data arrives
+					FileListChunkQueue chunks(FILE_LIST_CHUNK_SIZE, FILE_LIST_MAX_CHUNKS);
+					std::thread writer([&] {
+						try {
+							toFilelist(chunks, "/", aProfile, true);
+							chunks.flush();
+							chunks.close(nullptr);
+						} catch (...) {
+							chunks.close(current_exception());
+						}
+					});
+
+					ScopedFunctor([&] {
+						// Don't leave the writer waiting if the compression failed
+						chunks.cancel();
+						writer.join();
+					});
+
+					string chunk;
+					while (chunks.pop(chunk)) {
+						newXmlFile.write(chunk);
+					}
+
 					newXmlFile.flush();
 
 					newXmlFile.getFilter().getTree().finalize();
 					bzTree.getFilter().getTree().finalize();
 
+					fl->setXmlListLen(newXmlFile.getFilter().getTree().getFileSize());
 					fl->setXmlRoot(newXmlFile.getFilter().getTree().getRoot());
 					fl->setBzXmlRoot(bzTree.getFilter().getTree().getRoot());
 				}
@@ -2900,8 +3715,6 @@ FileList* ShareManager::generateXmlList(ProfileToken aProfile, bool forced /*fal
 					throw ShareException(UserConnection::FILE_NOT_AVAILABLE);
 				}
 			}
-
-			File::deleteFile(tmpName);
 		}
 	}
 	return fl;
@@ -2913,6 +3726,14 @@ MemoryInputStream* ShareManager::generatePartialList(const string& aVirtualPath,
 
 	string xml = Util::emptyString;
 
+	// Lists without a profile are generated for own use only
+	if (aProfile && listCache.get(ListCache::TYPE_PARTIAL_LIST, *aProfile, aVirtualPath, aRecursive, xml)) {
+		dcdebug("Partial list loaded from cache (%s)\n", aVirtualPath.c_str());
+		return new MemoryInputStream(xml);
+	}
+
+	auto cacheVersion = listCache.getVersion();
+
 	{
 		StringOutputStream sos(xml);
 		toFilelist(sos, aVirtualPath, aProfile, aRecursive);
@@ -2923,10 +3744,209 @@ MemoryInputStream* ShareManager::generatePartialList(const string& aVirtualPath,
 		return nullptr;
 	} else {
 		dcdebug("Partial list generated (%s)\n", aVirtualPath.c_str());
+		if (aProfile) {
+			listCache.put(ListCache::TYPE_PARTIAL_LIST, *aProfile, aVirtualPath, aRecursive, xml, cacheVersion);
+		}
+
 		return new MemoryInputStream(xml);
 	}
 }
 
+string ShareManager::ListCache::getKey(ListType aType, ProfileToken aProfile, const string& aPath, bool aRecursive) noexcept {
+	return Util::toString(aType) + "|" + Util::toString(aProfile) + "|" + (aRecursive ? "1" : "0") + "|" + aPath;
+}
+
+bool ShareManager::ListCache::get(ListType aType, ProfileToken aProfile, const string& aPath, bool aRecursive, string& list_) noexcept {
+	FastLock l(cs);
+	auto i = entryMap.find(getKey(aType, aProfile, aPath, aRecursive));
+	if (i == entryMap.end()) {
+		misses++;
+		return false;
+	}
+
+	// Move to front
+	entries.splice(entries.begin(), entries, i->second);
+
+	hits++;
+	list_ = i->second->data;
+	return true;
+}
+
+void ShareManager::ListCache::put(ListType aType, ProfileToken aProfile, const string& aPath, bool aRecursive, const string& aList, uint64_t aVersion) noexcept {
+	const auto maxSize = static_cast<size_t>(SETTING(LIST_CACHE_SIZE)) * 1024 * 1024;
+
+	// Don't let a single list to take over the cache
+	if (aList.size() > maxSize / 4) {
+		return;
+	}
+
+	FastLock l(cs);
+	if (aVersion != version) {
+		// The share has changed while the list was being generated
+		return;
+	}
+
+	auto key = getKey(aType, aProfile, aPath, aRecursive);
+	auto i = entryMap.find(key);
+	if (i != entryMap.end()) {
+		removeEntry(i->second);
+	}
+
+	while (!entries.empty() && totalSize + aList.size() > maxSize) {
+		removeEntry(prev(entries.end()));
+	}
+
+	entries.push_front({ key, aProfile, aList });
+	entryMap.emplace(move(key), entries.begin());
+	totalSize += aList.size();
+}
+
+void ShareManager::ListCache::removeEntry(EntryList::iterator aEntry) noexcept {
+	totalSize -= aEntry->data.size();
+	entryMap.erase(aEntry->key);
+	entries.erase(aEntry);
+}
+
+uint64_t ShareManager::ListCache::getVersion() const noexcept {
+	FastLock l(cs);
+	return version;
+}
+
+void ShareManager::ListCache::invalidate(const ProfileTokenSet& aProfiles) noexcept {
+	FastLock l(cs);
+	version++;
+
+	for (auto i = entries.begin(); i != entries.end();) {
+		auto cur = i++;
+		if (aProfiles.find(cur->profile) != aProfiles.end()) {
+			removeEntry(cur);
+		}
+	}
+}
+
+void ShareManager::ListCache::getStats(uint64_t& hits_, uint64_t& misses_, size_t& size_) const noexcept {
+	FastLock l(cs);
+	hits_ = hits;
+	misses_ = misses;
+	size_ = totalSize;
+}
+
+// How long the results of a search are kept in the cache (ms)
+#define SEARCH_CACHE_TTL 5000
+
+// Maximum number of searches in the cache
+#define SEARCH_CACHE_MAX_ENTRIES 500
+
+string ShareManager::SearchCache::getKey(const SearchQuery& aSearch, const OptionalProfileToken& aProfile, const string& aDir) noexcept {
+	string ret;
+	auto addString = [&ret](const string& aStr) {
+		ret += Util::toString(aStr.size());
+		ret += ':';
+		ret += aStr;
+	};
+
+	auto addPatterns = [&](const StringSearch& aPatterns) {
+		ret += Util::toString(aPatterns.count());
+		ret += '|';
+		for (const auto& p : aPatterns.getPatterns()) {
+			addString(p.str());
+		}
+	};
+
+	auto addStrings = [&](const StringList& aStrings) {
+		ret += Util::toString(aStrings.size());
+		ret += '|';
+		for (const auto& str : aStrings) {
+			addString(str);
+		}
+	};
+
+	addPatterns(aSearch.include);
+	addPatterns(aSearch.exclude);
+	addStrings(aSearch.ext);
+	addStrings(aSearch.noExt);
+
+	ret += Util::toString(aSearch.gt) + '|' + Util::toString(aSearch.lt) + '|';
+	ret += Util::toString(static_cast<int64_t>(aSearch.minDate)) + '|' + Util::toString(static_cast<int64_t>(aSearch.maxDate)) + '|';
+	ret += Util::toString(aSearch.maxResults) + '|' + Util::toString(aSearch.matchType) + '|' + Util::toString(aSearch.itemType) + '|';
+	ret += aSearch.addParents ? "1|" : "0|";
+	ret += aProfile ? Util::toString(*aProfile) : "-";
+	ret += '|';
+	addString(aDir);
+	return ret;
+}
+
+bool ShareManager::SearchCache::get(const string& aKey, uint64_t aTreeRevision, SearchResultList& results_) noexcept {
+	FastLock l(cs);
+	if (!enabled) {
+		return false;
+	}
+
+	removeExpired(GET_TICK());
+
+	auto i = entries.find(aKey);
+	if (i == entries.end() || i->second.treeRevision != aTreeRevision) {
+		misses++;
+		return false;
+	}
+
+	hits++;
+	results_.insert(results_.end(), i->second.results.begin(), i->second.results.end());
+	return true;
+}
+
+void ShareManager::SearchCache::put(const string& aKey, uint64_t aTreeRevision, const SearchResultList& aResults) noexcept {
+	auto tick = GET_TICK();
+
+	FastLock l(cs);
+	if (!enabled) {
+		return;
+	}
+
+	removeExpired(tick);
+
+	while (expirations.size() >= SEARCH_CACHE_MAX_ENTRIES) {
+		removeFirst();
+	}
+
+	auto& entry = entries[aKey];
+	entry.results = aResults;
+	entry.treeRevision = aTreeRevision;
+	entry.expires = tick + SEARCH_CACHE_TTL;
+
+	expirations.emplace_back(entry.expires, aKey);
+}
+
+void ShareManager::SearchCache::removeExpired(uint64_t aTick) noexcept {
+	while (!expirations.empty() && expirations.front().first <= aTick) {
+		removeFirst();
+	}
+}
+
+void ShareManager::SearchCache::removeFirst() noexcept {
+	auto i = entries.find(expirations.front().second);
+
+	// The entry may have been replaced with a newer one
+	if (i != entries.end() && i->second.expires == expirations.front().first) {
+		entries.erase(i);
+	}
+
+	expirations.pop_front();
+}
+
+void ShareManager::SearchCache::getStats(uint64_t& hits_, uint64_t& misses_) const noexcept {
+	FastLock l(cs);
+	hits_ = hits;
+	misses_ = misses;
+}
+
+void ShareManager::SearchCache::setEnabled(bool aEnabled) noexcept {
+	FastLock l(cs);
+	enabled = aEnabled;
+	entries.clear();
+	expirations.clear();
+}
+
 void ShareManager::toFilelist(OutputStream& os_, const string& aVirtualPath, const OptionalProfileToken& aProfile, bool aRecursive) const {
 	FileListDir listRoot(Util::emptyString, 0, 0);
 	Directory::List childDirectories;
@@ -3111,6 +4131,10 @@ string ShareManager::ProfileDirectory::getCacheXmlPath() const noexcept {
 	return Util::getPath(Util::PATH_SHARECACHE) + "ShareCache_" + Util::validateFileName(path) + ".xml";
 }
 
+string ShareManager::ProfileDirectory::getCacheBinaryPath() const noexcept {
+	return Util::getPath(Util::PATH_SHARECACHE) + "ShareCache_" + Util::validateFileName(path) + ".bin";
+}
+
 void ShareManager::ProfileDirectory::setName(const string& aName) noexcept {
 	virtualName.reset(new DualString(aName));
 }
@@ -3140,35 +4164,26 @@ void ShareManager::saveXmlList(function<void(float)> progressF /*nullptr*/) noex
 
 		try {
 			parallel_for_each(dirtyDirs.begin(), dirtyDirs.end(), [&](const Directory::Ptr& d) {
-				string path = d->getProfileDir()->getCacheXmlPath();
+				string path = d->getProfileDir()->getCacheBinaryPath();
 				try {
-					string indent, tmp;
-
 					//create a backup first in case we get interrupted on creation.
 					File ff(path + ".tmp", File::WRITE, File::TRUNCATE | File::CREATE);
-					BufferedOutputStream<false> xmlFile(&ff);
+					BufferedOutputStream<false> cacheFile(&ff);
 
-					xmlFile.write(SimpleXML::utf8Header);
-					xmlFile.write(LITERAL("<Share Version=\"" SHARE_CACHE_VERSION));
-					xmlFile.write(LITERAL("\" Path=\""));
-					xmlFile.write(SimpleXML::escape(d->getProfileDir()->getPath(), tmp, true));
+					cacheFile.write(SHARE_BINARY_CACHE_MAGIC, sizeof(SHARE_BINARY_CACHE_MAGIC));
+					writeBinary<uint32_t>(cacheFile, SHARE_BINARY_CACHE_VERSION);
+					writeBinary<uint64_t>(cacheFile, d->getLastWrite());
+					writeBinary<uint8_t>(cacheFile, d->getIncomplete() ? SHARE_BINARY_CACHE_INCOMPLETE : 0);
+					d->toBinaryCache(cacheFile);
 
-					xmlFile.write(LITERAL("\" Date=\""));
-					xmlFile.write(SimpleXML::escape(Util::toString(d->getLastWrite()), tmp, true));
-					xmlFile.write(LITERAL("\">\r\n"));
-					indent += '\t';
-
-					for (const auto& child : d->directories) {
-						child->toXmlList(xmlFile, indent, tmp);
-					}
-					d->filesToXmlList(xmlFile, indent, tmp);
-
-					xmlFile.write(LITERAL("</Share>"));
-					xmlFile.flush();
+					cacheFile.flush();
 					ff.close();
 
 					File::deleteFile(path);
 					File::renameFile(path + ".tmp", path);
+
+					// Remove the cache from older versions
+					File::deleteFile(d->getProfileDir()->getCacheXmlPath());
 				} catch (Exception& e) {
 					LogManager::getInstance()->message(STRING_F(SAVE_FAILED_X, path % e.getError()), LogMessage::SEV_WARNING);
 				}
@@ -3209,12 +4224,36 @@ void ShareManager::Directory::toXmlList(OutputStream& xmlFile, string& indent, s
 	xmlFile.write(LITERAL("</Directory>\r\n"));
 }
 
+void ShareManager::Directory::toBinaryCache(OutputStream& aStream) const {
+	writeBinary<uint32_t>(aStream, static_cast<uint32_t>(files.size()));
+	for (const auto& f : files) {
+		writeBinary(aStream, f->name.lowerCaseOnly() ? f->name.getLower() : f->name.getNormal());
+		writeBinary<int64_t>(aStream, f->getSize());
+		writeBinary<uint64_t>(aStream, f->getLastWrite());
+		aStream.write(f->getTTH().data, TTHValue::BYTES);
+	}
+
+	writeBinary<uint32_t>(aStream, static_cast<uint32_t>(directories.size()));
+	for (const auto& d : directories) {
+		writeBinary(aStream, d->realName.lowerCaseOnly() ? d->realName.getLower() : d->realName.getNormal());
+		writeBinary<uint64_t>(aStream, d->getLastWrite());
+		writeBinary<uint8_t>(aStream, d->getIncomplete() ? SHARE_BINARY_CACHE_INCOMPLETE : 0);
+		d->toBinaryCache(aStream);
+	}
+}
+
 MemoryInputStream* ShareManager::generateTTHList(const string& dir, bool recurse, ProfileToken aProfile) const noexcept {
 	
 	if(aProfile == SP_HIDDEN)
 		return nullptr;
 	
 	string tths;
+	if (listCache.get(ListCache::TYPE_TTH_LIST, aProfile, dir, recurse, tths)) {
+		return new MemoryInputStream(tths);
+	}
+
+	auto cacheVersion = listCache.getVersion();
+
 	string tmp;
 	StringOutputStream sos(tths);
 	Directory::List result;
@@ -3234,6 +4273,7 @@ MemoryInputStream* ShareManager::generateTTHList(const string& dir, bool recurse
 		dcdebug("Partial NULL");
 		return nullptr;
 	} else {
+		listCache.put(ListCache::TYPE_TTH_LIST, aProfile, dir, recurse, tths, cacheVersion);
 		return new MemoryInputStream(tths);
 	}
 }
@@ -3312,7 +4352,7 @@ void ShareManager::nmdcSearch(SearchResultList& l, const string& nmdcString, int
 * but not the parents...
 */
 
-void ShareManager::Directory::search(SearchResultInfo::Set& results_, SearchQuery& aStrings, int aLevel) const noexcept{
+void ShareManager::Directory::search(SearchResultInfo::Set& results_, SearchQuery& aStrings, int aLevel, bool aRecursive) const noexcept{
 	const auto& dirName = getVirtualNameLower();
 	if (aStrings.isExcludedLower(dirName)) {
 		return;
@@ -3328,29 +4368,18 @@ void ShareManager::Directory::search(SearchResultInfo::Set& results_, SearchQuer
 		bool positionsComplete = aStrings.positionsComplete();
 		if (aStrings.itemType != SearchQuery::TYPE_FILE && positionsComplete && aStrings.gt == 0 && aStrings.matchesDate(lastWrite)) {
 			// Full match
-			results_.insert(Directory::SearchResultInfo(this, aStrings, aLevel));
+			auto scores = SearchQuery::getRelevanceScore(aStrings, aLevel, true, realName.getLower());
+			if (results_.accepts(scores)) {
+				results_.insert(Directory::SearchResultInfo(this, scores));
+			}
 			//if (aStrings.matchType == SearchQuery::MATCH_FULL_PATH) {
 			//	return;
 			//}
 		} 
 		
-		if (aStrings.matchType == Search::MATCH_PATH_PARTIAL) {
-			bool hasValidResult = positionsComplete;
-			if (!hasValidResult) {
-				// Partial match; ignore if all matches are less than 3 chars in length
-				const auto& positions = aStrings.getLastPositions();
-				for (size_t j = 0; j < positions.size(); ++j) {
-					if (positions[j] != string::npos && aStrings.include.getPatterns()[j].size() > 2) {
-						hasValidResult = true;
-						break;
-					}
-				}
-			}
-
-			if (hasValidResult) {
-				rec.reset(new SearchQuery::Recursion(aStrings, dirName));
-				aStrings.recursion = rec.get();
-			}
+		if (aStrings.matchType == Search::MATCH_PATH_PARTIAL && aStrings.isValidRecursion(positionsComplete)) {
+			rec.reset(new SearchQuery::Recursion(aStrings, dirName));
+			aStrings.recursion = rec.get();
 		}
 	}
 
@@ -3367,15 +4396,21 @@ void ShareManager::Directory::search(SearchResultInfo::Set& results_, SearchQuer
 				continue;
 			}
 
-			results_.insert(Directory::SearchResultInfo(f, aStrings, aLevel));
+			auto scores = SearchQuery::getRelevanceScore(aStrings, aLevel, false, f->name.getLower());
+			if (results_.accepts(scores)) {
+				results_.insert(Directory::SearchResultInfo(f, scores));
+			}
+
 			if (aStrings.addParents)
 				break;
 		}
 	}
 
 	// Match directories
-	for(const auto& d: directories) {
-		d->search(results_, aStrings, aLevel);
+	if (aRecursive) {
+		for(const auto& d: directories) {
+			d->search(results_, aStrings, aLevel);
+		}
 	}
 
 	// Moving to a lower level
@@ -3386,18 +4421,233 @@ void ShareManager::Directory::search(SearchResultInfo::Set& results_, SearchQuer
 	aStrings.recursion = old;
 }
 
+void ShareManager::Directory::searchWithParents(SearchResultInfo::Set& results_, SearchQuery& aStrings, const Directory* aRoot) const noexcept {
+	vector<const Directory*> parents;
+	for (auto cur = this; cur != aRoot; ) {
+		cur = cur->getParent();
+		parents.push_back(cur);
+	}
+
+	auto old = aStrings.recursion;
+	vector<unique_ptr<SearchQuery::Recursion>> recursions;
+
+	// Go through the parents in the same way as search does (the parents can't be results themselves)
+	int level = 0;
+	bool excluded = false;
+	for (auto i = parents.rbegin(); i != parents.rend(); ++i) {
+		const auto& dirName = (*i)->getVirtualNameLower();
+		if (aStrings.isExcludedLower(dirName)) {
+			excluded = true;
+			break;
+		}
+
+		if (aStrings.matchesAnyDirectoryLower(dirName) && aStrings.matchType == Search::MATCH_PATH_PARTIAL && aStrings.isValidRecursion(aStrings.positionsComplete())) {
+			recursions.emplace_back(new SearchQuery::Recursion(aStrings, dirName));
+			aStrings.recursion = recursions.back().get();
+		}
+
+		level++;
+		if (aStrings.recursion) {
+			aStrings.recursion->increase(dirName.length());
+		}
+	}
+
+	if (!excluded) {
+		search(results_, aStrings, level);
+	}
+
+	aStrings.recursion = old;
+}
+
+void ShareManager::Directory::SearchResultInfo::Set::insert(SearchResultInfo&& aInfo) noexcept {
+	dcassert(accepts(aInfo.scores));
+
+	auto dupe = findDuplicate(aInfo);
+	if (dupe != heap.end()) {
+		// Keep the one with the best scores
+		if (aInfo.scores > dupe->scores) {
+			aInfo.order = inserted++;
+			*dupe = move(aInfo);
+			make_heap(heap.begin(), heap.end(), Sort());
+		}
+
+		return;
+	}
+
+	aInfo.order = inserted++;
+	if (heap.size() == maxResults) {
+		// Drop the lowest ranked item
+		pop_heap(heap.begin(), heap.end(), Sort());
+		heap.back() = move(aInfo);
+	} else {
+		heap.push_back(move(aInfo));
+	}
+
+	push_heap(heap.begin(), heap.end(), Sort());
+}
+
+vector<ShareManager::Directory::SearchResultInfo>::iterator ShareManager::Directory::SearchResultInfo::Set::findDuplicate(const SearchResultInfo& aInfo) noexcept {
+	// Directories with the same virtual path are combined into a single result
+	if (aInfo.getType() != DIRECTORY) {
+		return heap.end();
+	}
+
+	auto getResultPath = [this](const Directory* d) {
+		return addParents ? Util::getNmdcParentDir(d->getFullName()) : d->getFullName();
+	};
+
+	optional<string> path;
+	for (auto i = heap.begin(); i != heap.end(); ++i) {
+		if (i->getType() != DIRECTORY || (!addParents && i->directory->getVirtualNameLower() != aInfo.directory->getVirtualNameLower())) {
+			continue;
+		}
+
+		if (!path) {
+			path = getResultPath(aInfo.directory);
+		}
+
+		if (getResultPath(i->directory) == *path) {
+			return i;
+		}
+	}
+
+	return heap.end();
+}
+
+void ShareManager::Directory::SearchResultInfo::Set::merge(Set& aOther) noexcept {
+	for (auto& i : aOther.takeSorted()) {
+		if (!accepts(i.scores)) {
+			// Everything else is ranked lower
+			break;
+		}
+
+		insert(move(i));
+	}
+}
+
+vector<ShareManager::Directory::SearchResultInfo> ShareManager::Directory::SearchResultInfo::Set::takeSorted() noexcept {
+	sort_heap(heap.begin(), heap.end(), Sort());
+
+	vector<SearchResultInfo> ret;
+	ret.swap(heap);
+	return ret;
+}
+
+bool ShareManager::getSearchCandidates(const SearchQuery& aSearch, ShareNgramIndex::List& candidates_) const noexcept {
+	// Results must include each pattern in the name of the item or one of its parent directories,
+	// so it's enough to search from the directories matching the pattern with the least directories
+	optional<ShareNgramIndex::List> ret;
+	for (const auto& p : aSearch.include.getPatterns()) {
+		ShareNgramIndex::List dirs;
+		if (!ngramIndex.find(p.str(), dirs)) {
+			continue;
+		}
+
+		if (!ret || dirs.size() < (*ret).size()) {
+			ret = move(dirs);
+			if ((*ret).empty()) {
+				break;
+			}
+		}
+	}
+
+	if (!ret) {
+		return false;
+	}
+
+	candidates_ = move(*ret);
+	return true;
+}
+
+void ShareManager::runSearchTasks(const vector<SearchTask>& aTasks, SearchQuery& aSearch, Directory::SearchResultInfo::Set& results_) const noexcept {
+	auto runTask = [](const SearchTask& aTask, SearchQuery& aQuery, Directory::SearchResultInfo::Set& aResults) {
+		if (aTask.root) {
+			aTask.directory->searchWithParents(aResults, aQuery, aTask.root);
+		} else {
+			aTask.directory->search(aResults, aQuery, 0, aTask.recursive);
+		}
+	};
+
+	if (!SETTING(SEARCH_THREADING)) {
+		for (const auto& t : aTasks) {
+			runTask(t, aSearch, results_);
+		}
+
+		return;
+	}
+
+	// Split the full trees by their subdirectories so that a single large root won't be searched by one thread
+	vector<SearchTask> tasks;
+	for (const auto& t : aTasks) {
+		if (t.root || t.directory->directories.empty()) {
+			tasks.push_back(t);
+			continue;
+		}
+
+		tasks.emplace_back(t.directory, nullptr, false);
+		for (const auto& d : t.directory->directories) {
+			tasks.emplace_back(d.get(), t.directory, true);
+		}
+	}
+
+	// Use at most one task group per thread, the overhead of the other threads isn't worth it with small shares
+	auto groupCount = min<size_t>(tasks.size(), max(thread::hardware_concurrency(), 1U));
+	if (groupCount <= 1 || tthIndex.size() < PARALLEL_SEARCH_MIN_FILES) {
+		for (const auto& t : tasks) {
+			runTask(t, aSearch, results_);
+		}
+
+		return;
+	}
+
+	// Each group has its own matching state and results (the patterns are shared)
+	// The first group uses the original query
+	struct GroupResults {
+		GroupResults(const SearchQuery& aSearch, bool aCopyQuery) : queryCopy(aCopyQuery ? new SearchQuery(aSearch) : nullptr), results(aSearch) { }
+
+		unique_ptr<SearchQuery> queryCopy;
+		Directory::SearchResultInfo::Set results;
+	};
+
+	vector<GroupResults> groupResults;
+	groupResults.reserve(groupCount);
+	for (size_t i = 0; i < groupCount; ++i) {
+		groupResults.emplace_back(aSearch, i > 0);
+	}
+
+	vector<size_t> indexes(groupCount);
+	iota(indexes.begin(), indexes.end(), 0);
+
+	parallel_for_each(indexes.begin(), indexes.end(), [&](size_t aGroup) {
+		auto& r = groupResults[aGroup];
+		auto& query = r.queryCopy ? *r.queryCopy : aSearch;
+
+		// Interleave the tasks so that the large and small ones get spread evenly
+		for (auto i = aGroup; i < tasks.size(); i += groupCount) {
+			runTask(tasks[i], query, r.results);
+		}
+	});
+
+	// Merge in the group order to keep the results consistent
+	for (auto& r : groupResults) {
+		results_.merge(r.results);
+	}
+}
+
 void ShareManager::adcSearch(SearchResultList& results, SearchQuery& srch, const OptionalProfileToken& aProfile, const CID& cid, const string& aDir, bool isAutoSearch) throw(ShareException) {
 	totalSearches++;
 	if (aProfile == SP_HIDDEN) {
 		return;
 	}
 
+	ProfileMatcher profileMatcher(aProfile);
+
 	RLock l(cs);
 	if(srch.root) {
 		tthSearches++;
 		const auto i = tthIndex.equal_range(const_cast<TTHValue*>(&(*srch.root)));
 		for(auto& f: i | map_values) {
-			if (f->hasProfile(aProfile) && AirUtil::isParentOrExactAdc(aDir, f->getADCPath())) {
+			if (f->hasProfile(profileMatcher) && AirUtil::isParentOrExactAdc(aDir, f->getADCPath())) {
 				f->addSR(results, srch.addParents);
 				return;
 			}
@@ -3425,6 +4675,13 @@ void ShareManager::adcSearch(SearchResultList& results, SearchQuery& srch, const
 		}
 	}
 
+	auto cacheKey = SearchCache::getKey(srch, aProfile, aDir);
+	if (searchCache.get(cacheKey, treeRevision, results)) {
+		if (!results.empty())
+			recursiveSearchesResponded++;
+		return;
+	}
+
 	if (srch.itemType == SearchQuery::TYPE_DIRECTORY && srch.matchType == Search::MATCH_NAME_EXACT) {
 		if (srch.include.getPatterns().empty()) {
 			// Invalid query
@@ -3434,7 +4691,7 @@ void ShareManager::adcSearch(SearchResultList& results, SearchQuery& srch, const
 		// Optimized version for exact directory matches
 		const auto i = lowerDirNameMap.equal_range(const_cast<string*>(&srch.include.getPatterns().front().str()));
 		for(const auto& d: i | map_values) {
-			if (!d->hasProfile(aProfile) || !srch.matchesDate(d->getLastWrite())) {
+			if (!d->hasProfile(profileMatcher) || !srch.matchesDate(d->getLastWrite())) {
 				continue;
 			}
 
@@ -3448,6 +4705,7 @@ void ShareManager::adcSearch(SearchResultList& results, SearchQuery& srch, const
 			}
 		}
 
+		searchCache.put(cacheKey, treeRevision, results);
 		return;
 	}
 
@@ -3462,11 +4720,50 @@ void ShareManager::adcSearch(SearchResultList& results, SearchQuery& srch, const
 	auto start = GET_TICK();
 
 	// go them through recursively
-	Directory::SearchResultInfo::Set resultInfos;
-	for (const auto& d: roots) {
-		d->search(resultInfos, srch, 0);
+	vector<SearchTask> tasks;
+
+	ShareNgramIndex::List candidates;
+	if (!getSearchCandidates(srch, candidates)) {
+		for (const auto& d : roots) {
+			tasks.emplace_back(d.get(), nullptr, true);
+		}
+	} else if (!candidates.empty()) {
+		// Only the subtrees containing the rarest pattern need to be searched
+		auto isCandidate = [&candidates](const Directory* d) { return binary_search(candidates.begin(), candidates.end(), d); };
+
+		// Roots inside a candidate directory are searched entirely
+		unordered_set<const Directory*> partialRoots;
+		for (const auto& root : roots) {
+			const Directory* d = root.get();
+			while (d && !isCandidate(d)) {
+				d = d->getParent();
+			}
+
+			if (d) {
+				tasks.emplace_back(root.get(), nullptr, true);
+			} else {
+				partialRoots.insert(root.get());
+			}
+		}
+
+		for (const auto& c : candidates) {
+			// Candidates with a candidate parent will be searched from the parent
+			for (const Directory* d = c; d; d = d->getParent()) {
+				if (partialRoots.find(d) != partialRoots.end()) {
+					tasks.emplace_back(c, d, true);
+					break;
+				}
+
+				if (d != c && isCandidate(d)) {
+					break;
+				}
+			}
+		}
 	}
 
+	Directory::SearchResultInfo::Set resultInfos(srch);
+	runSearchTasks(tasks, srch, resultInfos);
+
 	// update statistics
 	auto end = GET_TICK();
 	recursiveSearchTime += end - start;
@@ -3476,8 +4773,7 @@ void ShareManager::adcSearch(SearchResultList& results, SearchQuery& srch, const
 
 
 	// pick the results to return
-	for (auto i = resultInfos.begin(); (i != resultInfos.end()) && (results.size() < srch.maxResults); ++i) {
-		auto& info = *i;
+	for (const auto& info: resultInfos.takeSorted()) {
 		if (info.getType() == Directory::SearchResultInfo::DIRECTORY) {
 			addDirResult(info.directory, results, aProfile, srch);
 		} else {
@@ -3485,6 +4781,7 @@ void ShareManager::adcSearch(SearchResultList& results, SearchQuery& srch, const
 		}
 	}
 
+	searchCache.put(cacheKey, treeRevision, results);
 	if (!results.empty())
 		recursiveSearchesResponded++;
 }
@@ -3495,10 +4792,70 @@ void ShareManager::cleanIndices(Directory& dir, const Directory::File* f) noexce
 
 	auto flst = tthIndex.equal_range(const_cast<TTHValue*>(&f->getTTH()));
 	auto p = find(flst | map_values, f);
-	if (p.base() != flst.second)
+	if (p.base() != flst.second) {
 		tthIndex.erase(p.base());
-	else
+		updateHashBlooms(f->getTTH(), false);
+	} else {
 		dcassert(0);
+	}
+}
+
+void ShareManager::getNgramChanges(const Directory& aDir, ShareNgramIndex::ChangeList& changes_, bool aRecursive) noexcept {
+	vector<uint32_t> ngrams;
+	ShareNgramIndex::getNgrams(aDir.getVirtualNameLower(), ngrams);
+	for (const auto& f : aDir.files) {
+		ShareNgramIndex::getNgrams(f->name.getLower(), ngrams);
+	}
+
+	sort(ngrams.begin(), ngrams.end());
+	ngrams.erase(unique(ngrams.begin(), ngrams.end()), ngrams.end());
+	ShareNgramIndex::addChanges(ngrams, &aDir, changes_);
+
+	if (aRecursive) {
+		for (const auto& d : aDir.directories) {
+			getNgramChanges(*d, changes_, true);
+		}
+	}
+}
+
+void ShareManager::addNgrams(const Directory& aDir, const string& aNameLower) noexcept {
+	vector<uint32_t> ngrams;
+	ShareNgramIndex::getNgrams(aNameLower, ngrams);
+
+	ShareNgramIndex::ChangeList changes;
+	ShareNgramIndex::addChanges(ngrams, &aDir, changes);
+	ngramIndex.insert(changes);
+}
+
+void ShareManager::removeNgrams(const Directory& aDir, const Directory::File* aFile) noexcept {
+	vector<uint32_t> removed;
+	ShareNgramIndex::getNgrams(aFile ? aFile->name.getLower() : aDir.getVirtualNameLower(), removed);
+	if (removed.empty()) {
+		return;
+	}
+
+	// Keep the n-grams that are still used by other items in this directory
+	vector<uint32_t> remaining;
+	if (aFile) {
+		ShareNgramIndex::getNgrams(aDir.getVirtualNameLower(), remaining);
+	}
+
+	for (const auto& f : aDir.files) {
+		if (f != aFile) {
+			ShareNgramIndex::getNgrams(f->name.getLower(), remaining);
+		}
+	}
+
+	sort(removed.begin(), removed.end());
+	sort(remaining.begin(), remaining.end());
+
+	vector<uint32_t> unused;
+	set_difference(removed.begin(), removed.end(), remaining.begin(), remaining.end(), back_inserter(unused));
+	unused.erase(unique(unused.begin(), unused.end()), unused.end());
+
+	ShareNgramIndex::ChangeList changes;
+	ShareNgramIndex::addChanges(unused, &aDir, changes);
+	ngramIndex.erase(changes);
 }
 
 void ShareManager::addDirName(const Directory::Ptr& aDir, Directory::MultiMap& aDirNames, ShareBloom& aBloom) noexcept {
@@ -3523,12 +4880,60 @@ void ShareManager::removeDirName(const Directory& aDir, Directory::MultiMap& aDi
 }
 
 void ShareManager::cleanIndices(Directory& dir) noexcept {
+	ShareNgramIndex::ChangeList removedNgrams;
+	cleanDirectoryIndices(dir, &removedNgrams);
+
+	ngramIndex.erase(removedNgrams);
+}
+
+void ShareManager::removeIndices(const RefreshInfo& aInfo) noexcept {
+	for (const auto d : aInfo.removedDirs) {
+		removeDirName(*d, lowerDirNameMap);
+	}
+
+	for (const auto f : aInfo.removedFiles) {
+		sharedSize -= f->getSize();
+
+		auto flst = tthIndex.equal_range(const_cast<TTHValue*>(&f->getTTH()));
+		auto p = find(flst | map_values, f);
+		if (p.base() != flst.second) {
+			tthIndex.erase(p.base());
+		} else {
+			dcassert(0);
+		}
+	}
+
+	{
+		Lock l(hashBloomCS);
+		for (auto& b : hashBlooms) {
+			for (const auto f : aInfo.removedFiles) {
+				b.bloom->remove(f->getTTH());
+			}
+		}
+	}
+
+	ngramIndex.erase(const_cast<RefreshInfo&>(aInfo).ngramChangesOld);
+}
+
+void ShareManager::addHashBlooms(const HashFileMap& aTTHIndex) noexcept {
+	Lock l(hashBloomCS);
+	for (auto& b : hashBlooms) {
+		for (const auto tth : aTTHIndex | map_keys) {
+			b.bloom->add(*tth);
+		}
+	}
+}
+
+void ShareManager::cleanDirectoryIndices(Directory& dir, ShareNgramIndex::ChangeList* removedNgrams_) noexcept {
 	for(auto& d: dir.directories) {
-		cleanIndices(*d);
+		cleanDirectoryIndices(*d, removedNgrams_);
 	}
 
 	//remove from the name map
 	removeDirName(dir, lowerDirNameMap);
+	if (removedNgrams_) {
+		getNgramChanges(dir, *removedNgrams_, false);
+	}
 
 	//remove all files
 	for(auto i = dir.files.begin(); i != dir.files.end(); ++i) {
@@ -3641,6 +5046,7 @@ ShareManager::Directory::Ptr ShareManager::getDirectory(const string& aRealPath,
 
 			curDir->updateModifyDate();
 			curDir = Directory::createNormal(DualString(currentName), curDir, File::getLastModified(pathLower), lowerDirNameMap, *bloom.get());
+			addNgrams(*curDir, curDir->getVirtualNameLower());
 		}
 	}
 
@@ -3656,7 +5062,7 @@ ShareManager::Directory::Ptr ShareManager::findDirectory(const string& aRealPath
 void ShareManager::onFileHashed(const string& fname, HashedFile& fileInfo) noexcept {
 	ProfileTokenSet dirtyProfiles;
 	{
-		WLock l(cs);
+		TreeWLock l(*this);
 		auto d = getDirectory(Util::getFilePath(fname), false);
 		if (!d) {
 			return;
@@ -3679,6 +5085,8 @@ void ShareManager::addFile(const string& aName, Directory::Ptr& aDir, const Hash
 
 	auto it = aDir->files.insert_sorted(new Directory::File(move(dualName), aDir, fi)).first;
 	updateIndices(*aDir, *it, *bloom.get(), sharedSize, tthIndex);
+	updateHashBlooms((*it)->getTTH(), true);
+	addNgrams(*aDir, (*it)->name.getLower());
 
 	aDir->copyRootProfiles(dirtyProfiles_, true);
 }
@@ -3712,7 +5120,7 @@ ShareProfileInfo::List ShareManager::getProfileInfos() const noexcept {
 }
 
 void ShareManager::setExcludedPaths(const StringSet& aPaths) noexcept {
-	WLock l(cs);
+	TreeWLock l(*this);
 	excludedPaths = aPaths;
 }
 
@@ -32,9 +32,12 @@
 #include "DualString.h"
 #include "DupeType.h"
 #include "Exception.h"
+#include "FastAlloc.h"
+#include "FlatMultiMap.h"
 #include "HashBloom.h"
 #include "HashedFile.h"
 #include "MerkleTree.h"
+#include "NgramIndex.h"
 #include "Pointer.h"
 #include "SearchQuery.h"
 #include "ShareDirectoryInfo.h"
@@ -50,6 +53,7 @@
 
 namespace dcpp {
 
+class CompactShareTree;
 class File;
 class OutputStream;
 class MemoryInputStream;
@@ -180,8 +184,9 @@ public:
 	// Get share size and number of files for a specified profile
 	void getProfileInfo(ProfileToken aProfile, int64_t& size, size_t& files) const noexcept;
 	
-	// Adds all shared TTHs (permanent and temp) to the filter
-	void getBloom(HashBloom& bloom) const noexcept;
+	// Get a hash bloom of all shared TTHs (permanent and temp) with the wanted parameters
+	// The filters are cached and updated as files are added or removed
+	void getBloom(ByteVector& v_, size_t aK, size_t aM, size_t aH) const noexcept;
 
 	// Removes path characters from virtual name
 	string validateVirtualName(const string& aName) const noexcept;
@@ -231,6 +236,9 @@ public:
 	// Get a printable version of various share-related statistics
 	string printStats() const noexcept;
 
+	// Build a compact copy of the current share tree (the copy isn't updated after this)
+	unique_ptr<CompactShareTree> buildCompactTree() const noexcept;
+
 	struct ShareStats {
 		int profileCount = 0;
 		size_t profileDirectoryCount = 0;
@@ -246,6 +254,12 @@ public:
 		double averageNameLength = 0;
 		size_t totalNameSize = 0;
 		time_t averageFileAge = 0;
+		size_t memoryUsage = 0;
+		double memoryPerFile = 0;
+
+		uint64_t listCacheHits = 0;
+		uint64_t listCacheMisses = 0;
+		size_t listCacheSize = 0;
 	};
 	optional<ShareStats> getShareStats() const noexcept;
 
@@ -292,7 +306,9 @@ public:
 
 	mutable SharedMutex cs;
 
+	struct CacheLoader;
 	struct ShareLoader;
+	struct ShareBinaryLoader;
 
 	// Called when the monitoring mode has been changed
 	void rebuildMonitoring() noexcept;
@@ -311,6 +327,9 @@ public:
 	void shareBundle(const BundlePtr& aBundle) noexcept;
 	void onFileHashed(const string& fname, HashedFile& fileInfo) noexcept;
 private:
+	// Approximate memory usage of the share trees and the TTH index
+	size_t getMemoryUsage() const noexcept;
+
 	void countStats(uint64_t& totalAge_, size_t& totalDirs_, int64_t& totalSize_, size_t& totalFiles, size_t& lowerCaseFiles, size_t& totalStrLen_, size_t& roots_) const noexcept;
 
 	DirectoryMonitor monitor;
@@ -326,6 +345,29 @@ private:
 	uint64_t autoSearches = 0;
 	typedef BloomFilter<5> ShareBloom;
 
+	// Share profiles are mapped to bits so that the visibility of a directory can be checked without set lookups
+	// The bits are never released; profiles that don't fit in the mask are checked from the profile sets instead
+	typedef uint64_t ProfileMask;
+
+	// Returns 0 if the profile hasn't been assigned a bit
+	static ProfileMask getProfileMask(ProfileToken aProfile) noexcept;
+	static ProfileMask assignProfileMask(ProfileToken aProfile) noexcept;
+
+	class ProfileDirectory;
+
+	// Visibility check for a single profile (the profile bit is resolved only once)
+	class ProfileMatcher {
+	public:
+		explicit ProfileMatcher(const OptionalProfileToken& aProfile) noexcept : profile(aProfile), mask(aProfile ? getProfileMask(*aProfile) : 0) { }
+
+		// Matches all directories if no profile was given
+		bool matchesAll() const noexcept { return !profile; }
+		bool matches(const ProfileDirectory& aDir) const noexcept;
+	private:
+		OptionalProfileToken profile;
+		ProfileMask mask;
+	};
+
 	class ProfileDirectory : public intrusive_ptr_base<ProfileDirectory>, boost::noncopyable {
 		public:
 			typedef boost::intrusive_ptr<ProfileDirectory> Ptr;
@@ -335,7 +377,10 @@ private:
 
 			GETSET(string, path, Path);
 
-			GETSET(ProfileTokenSet, rootProfiles, RootProfiles);
+			const ProfileTokenSet& getRootProfiles() const noexcept { return rootProfiles; }
+			void setRootProfiles(const ProfileTokenSet& aProfiles) noexcept;
+			ProfileMask getRootProfileMask() const noexcept { return rootProfileMask; }
+
 			IGETSET(bool, cacheDirty, CacheDirty, false);
 			IGETSET(bool, incoming, Incoming, false);
 			IGETSET(RefreshState, refreshState, RefreshState, RefreshState::STATE_NORMAL);
@@ -358,10 +403,14 @@ private:
 
 			void setName(const string& aName) noexcept;
 			string getCacheXmlPath() const noexcept;
+			string getCacheBinaryPath() const noexcept;
 		private:
 			ProfileDirectory(const string& aRootPath, const string& aVname, const ProfileTokenSet& aProfiles, bool aIncoming) noexcept;
+			void updateRootProfileMask() noexcept;
 
 			unique_ptr<DualString> virtualName;
+			ProfileTokenSet rootProfiles;
+			ProfileMask rootProfileMask = 0;
 	};
 
 	typedef vector<ProfileDirectory::Ptr> ProfileDirectoryList;
@@ -380,7 +429,8 @@ private:
 			const string& operator()(const Ptr& a) const { return a->realName.getLower(); }
 		};
 
-		class File {
+		// Files are allocated from a pool as there are usually millions of them
+		class File : public CachedFastAlloc<File> {
 		public:
 			struct NameLower {
 				const string& operator()(const File* a) const { return a->name.getLower(); }
@@ -396,6 +446,7 @@ private:
 			inline string getFullName() const noexcept{ return parent->getFullName() + name.getNormal(); }
 			inline string getRealPath() const noexcept { return parent->getRealPath(name.getNormal()); }
 			inline bool hasProfile(const OptionalProfileToken& aProfile) const noexcept { return parent->hasProfile(aProfile); }
+			inline bool hasProfile(const ProfileMatcher& aProfile) const noexcept { return parent->hasProfile(aProfile); }
 
 			void toXml(OutputStream& xmlFile, string& indent, string& tmp2, bool addDate) const;
 			void addSR(SearchResultList& aResults, bool addParent) const noexcept;
@@ -410,21 +461,43 @@ private:
 
 		class SearchResultInfo {
 		public:
-			struct Sort {
-				bool operator()(const SearchResultInfo& left, const SearchResultInfo& right) const { return left.scores > right.scores; }
+			// Keeps the best results up to the maximum result count (lowest scores are dropped first)
+			class Set {
+			public:
+				explicit Set(const SearchQuery& aSearch) noexcept : maxResults(aSearch.maxResults), addParents(aSearch.addParents) { }
+
+				// Would an item with these scores get into the results?
+				bool accepts(double aScores) const noexcept { return heap.size() < maxResults || (maxResults > 0 && aScores > heap.front().scores); }
+				void insert(SearchResultInfo&& aInfo) noexcept;
+
+				// Add the results from another set (the other set is emptied)
+				void merge(Set& aOther) noexcept;
+
+				// Results in descending order of scores (items with equal scores are kept in the order they were inserted)
+				vector<SearchResultInfo> takeSorted() noexcept;
+
+				size_t size() const noexcept { return heap.size(); }
+			private:
+				// Returns the existing result with the same path
+				vector<SearchResultInfo>::iterator findDuplicate(const SearchResultInfo& aInfo) noexcept;
+
+				vector<SearchResultInfo> heap;
+				size_t inserted = 0;
+
+				const size_t maxResults;
+				const bool addParents;
 			};
 
-			explicit SearchResultInfo(const File* f, const SearchQuery& aSearch, int aLevel) :
-				file(f), type(FILE), scores(SearchQuery::getRelevanceScore(aSearch, aLevel, false, f->name.getLower())) {
+			explicit SearchResultInfo(const File* f, double aScores) :
+				file(f), type(FILE), scores(aScores) {
 
 			}
 
-			explicit SearchResultInfo(const Directory* d, const SearchQuery& aSearch, int aLevel) :
-				directory(d), type(DIRECTORY), scores(SearchQuery::getRelevanceScore(aSearch, aLevel, true, d->realName.getLower())) {
+			explicit SearchResultInfo(const Directory* d, double aScores) :
+				directory(d), type(DIRECTORY), scores(aScores) {
 
 			}
 
-			typedef multiset<SearchResultInfo, Sort> Set;
 			enum Type: uint8_t {
 				FILE,
 				DIRECTORY
@@ -437,8 +510,16 @@ private:
 
 			Type getType() const { return type; }
 		private:
+			// Is this item ranked before the other one?
+			struct Sort {
+				bool operator()(const SearchResultInfo& left, const SearchResultInfo& right) const { 
+					return left.scores > right.scores || (left.scores == right.scores && left.order < right.order);
+				}
+			};
+
 			Type type;
 			double scores;
+			size_t order = 0;
 		};
 
 		typedef SortedVector<Ptr, std::vector, string, Compare, NameLower> Set;
@@ -453,7 +534,7 @@ private:
 			bool operator()(const Ptr& d) const noexcept {
 				return d->hasProfile(profile);
 			}
-			const OptionalProfileToken& profile;
+			const ProfileMatcher profile;
 
 			HasRootProfile& operator=(const HasRootProfile&) = delete;
 		};
@@ -473,13 +554,18 @@ private:
 
 		bool hasProfile(const ProfileTokenSet& aProfiles) const noexcept;
 		bool hasProfile(const OptionalProfileToken& aProfile) const noexcept;
+		bool hasProfile(const ProfileMatcher& aProfile) const noexcept;
 
 		void getContentInfo(int64_t& size_, size_t& files_, size_t& folders_) const noexcept;
 		int64_t getSize() const noexcept;
 		int64_t getTotalSize() const noexcept;
 		void getProfileInfo(ProfileToken aProfile, int64_t& totalSize, size_t& filesCount) const noexcept;
 
-		void search(SearchResultInfo::Set& aResults, SearchQuery& aStrings, int aLevel) const noexcept;
+		// Subdirectories won't be searched with aRecursive == false
+		void search(SearchResultInfo::Set& aResults, SearchQuery& aStrings, int aLevel, bool aRecursive = true) const noexcept;
+
+		// Search from a subdirectory of aRoot (matching state of the parent directories will be restored first)
+		void searchWithParents(SearchResultInfo::Set& aResults, SearchQuery& aStrings, const Directory* aRoot) const noexcept;
 
 		void toFileList(FileListDir& aListDir, bool aRecursive);
 		void toTTHList(OutputStream& tthList, string& tmp2, bool recursive) const;
@@ -488,10 +574,17 @@ private:
 		void toXmlList(OutputStream& xmlFile, string& indent, string& tmp);
 		void filesToXmlList(OutputStream& xmlFile, string& indent, string& tmp2) const;
 
+		// Write the content of the directory in binary share cache format
+		void toBinaryCache(OutputStream& aStream) const;
+
 		GETSET(uint64_t, lastWrite, LastWrite);
 		GETSET(Directory*, parent, Parent);
 		GETSET(ProfileDirectory::Ptr, profileDir, ProfileDir);
 
+		// Some of the content was left out when the directory was listed (unhashed files, queued or empty subdirectories)
+		// Adding the content later won't change the modification date, so fast refreshes must always list these directories
+		IGETSET(bool, incomplete, Incomplete, false);
+
 		~Directory();
 
 		void copyRootProfiles(ProfileTokenSet& profiles_, bool setCacheDirty) const noexcept;
@@ -501,6 +594,9 @@ private:
 		//void addBloom(ShareBloom& aBloom) const noexcept;
 
 		void countStats(uint64_t& totalAge_, size_t& totalDirs_, int64_t& totalSize_, size_t& totalFiles, size_t& lowerCaseFiles, size_t& totalStrLen_) const noexcept;
+
+		// Approximate memory usage of the tree (excluding the indexes)
+		size_t getMemoryUsage() const noexcept;
 		DualString realName;
 
 		// check for an updated modify date from filesystem
@@ -533,6 +629,24 @@ private:
 		void filesToXml(OutputStream& xmlFile, string& indent, string& tmp2, bool addDate) const;
 	};
 
+	// Directories containing the n-gram in their own name or in a name of a direct child file
+	typedef NgramIndex<const Directory*> ShareNgramIndex;
+	ShareNgramIndex ngramIndex;
+
+	// Increased whenever a write lock of the share tree is released
+	// Allows preparing changes while holding a read lock only (the prepared data is valid if the revision hasn't changed)
+	// Note that this isn't a snapshot: searches and uploads still wait for the writers, preparing only makes the locked part shorter
+	uint64_t treeRevision = 0;
+
+	class TreeWLock : boost::noncopyable {
+	public:
+		TreeWLock(ShareManager& aSm) : l(aSm.cs), revision(aSm.treeRevision) { }
+		~TreeWLock() { revision++; }
+	private:
+		WLock l;
+		uint64_t& revision;
+	};
+
 	ShareDirectoryInfoPtr getRootInfo(const Directory::Ptr& aDir) const noexcept;
 
 	void addAsyncTask(AsyncF aF) noexcept;
@@ -541,13 +655,114 @@ private:
 	void getDirsByName(const string& aPath, Directory::List& dirs_) const noexcept;
 
 	friend class Singleton<ShareManager>;
+	friend class ShareSearchBenchmark;
+
+	// Memory-limited LRU cache for generated partial file lists and TTH lists
+	class ListCache {
+	public:
+		enum ListType {
+			TYPE_PARTIAL_LIST,
+			TYPE_TTH_LIST
+		};
+
+		// Returns false if the list wasn't found from the cache
+		bool get(ListType aType, ProfileToken aProfile, const string& aPath, bool aRecursive, string& list_) noexcept;
+
+		// The version must have been retrieved before the list was generated (lists generated before invalidation won't be added)
+		void put(ListType aType, ProfileToken aProfile, const string& aPath, bool aRecursive, const string& aList, uint64_t aVersion) noexcept;
+		uint64_t getVersion() const noexcept;
+
+		// Remove all lists of the profiles
+		void invalidate(const ProfileTokenSet& aProfiles) noexcept;
+
+		void getStats(uint64_t& hits_, uint64_t& misses_, size_t& size_) const noexcept;
+	private:
+		struct Entry {
+			string key;
+			ProfileToken profile;
+			string data;
+		};
+
+		typedef list<Entry> EntryList;
+
+		static string getKey(ListType aType, ProfileToken aProfile, const string& aPath, bool aRecursive) noexcept;
+		void removeEntry(EntryList::iterator aEntry) noexcept;
+
+		// Most recently used lists first
+		EntryList entries;
+		unordered_map<string, EntryList::iterator> entryMap;
 
-	typedef unordered_multimap<TTHValue*, const Directory::File*> HashFileMap;
+		size_t totalSize = 0;
+		uint64_t version = 0;
+		uint64_t hits = 0;
+		uint64_t misses = 0;
+
+		mutable FastCriticalSection cs;
+	};
+
+	mutable ListCache listCache;
+
+	// Results of recent text searches (the same search is often received from multiple hubs within a short time)
+	class SearchCache {
+	public:
+		static string getKey(const SearchQuery& aSearch, const OptionalProfileToken& aProfile, const string& aDir) noexcept;
+
+		// Returns false if there is no valid entry for the search
+		// The revision of the share tree must be read while holding the tree lock
+		bool get(const string& aKey, uint64_t aTreeRevision, SearchResultList& results_) noexcept;
+		void put(const string& aKey, uint64_t aTreeRevision, const SearchResultList& aResults) noexcept;
+
+		void getStats(uint64_t& hits_, uint64_t& misses_) const noexcept;
+
+		// Disabled cache won't return or store any results (existing entries are removed)
+		void setEnabled(bool aEnabled) noexcept;
+	private:
+		struct Entry {
+			SearchResultList results;
+			uint64_t treeRevision;
+			uint64_t expires;
+		};
+
+		typedef unordered_map<string, Entry> EntryMap;
+
+		void removeExpired(uint64_t aTick) noexcept;
+		void removeFirst() noexcept;
+
+		EntryMap entries;
+
+		// Keys in the order of expiration
+		deque<pair<uint64_t, string>> expirations;
+
+		uint64_t hits = 0;
+		uint64_t misses = 0;
+		bool enabled = true;
+
+		mutable FastCriticalSection cs;
+	};
+
+	mutable SearchCache searchCache;
+
+	// Hash blooms requested by the hubs (there are usually only a few different parameter sets in use)
+	struct CachedHashBloom {
+		unique_ptr<CountingHashBloom> bloom;
+		uint64_t lastUsed;
+	};
+
+	mutable vector<CachedHashBloom> hashBlooms;
+	mutable CriticalSection hashBloomCS;
+
+	// Must be called while holding the tree write lock
+	void updateHashBlooms(const TTHValue& aTTH, bool aAdded) noexcept;
+
+	typedef FlatMultiMap<TTHValue*, const Directory::File*> HashFileMap;
 	HashFileMap tthIndex;
 	
 	ShareManager();
 	~ShareManager();
 
+	// Private instances (search benchmark) don't listen to settings changes
+	explicit ShareManager(bool aListenSettings);
+
 	struct TaskData {
 		virtual ~TaskData() { }
 	};
@@ -559,6 +774,22 @@ private:
 
 	bool addDirResult(const Directory* aDir, SearchResultList& aResults, const OptionalProfileToken& aProfile, SearchQuery& srch) const noexcept;
 
+	// Get the directories containing the least common include pattern (sorted by pointer value)
+	// Returns false if the query can't be matched with the n-gram index
+	bool getSearchCandidates(const SearchQuery& aSearch, ShareNgramIndex::List& candidates_) const noexcept;
+
+	// A single directory (tree) to search
+	struct SearchTask {
+		SearchTask(const Directory* aDirectory, const Directory* aRoot, bool aRecursive) noexcept : directory(aDirectory), root(aRoot), recursive(aRecursive) { }
+
+		const Directory* directory;
+		const Directory* root; // Parent directory where the search starts from (if not the directory itself)
+		bool recursive;
+	};
+
+	// Run the search tasks (in parallel if enabled)
+	void runSearchTasks(const vector<SearchTask>& aTasks, SearchQuery& aSearch, Directory::SearchResultInfo::Set& results_) const noexcept;
+
 	ProfileDirectory::Map profileDirs;
 
 	TaskQueue tasks;
@@ -602,10 +833,23 @@ private:
 		Directory::Map rootPathsNew;
 		Directory::MultiMap lowerDirNameMapNew;
 		HashFileMap tthIndexNew;
+		ShareNgramIndex::ChangeList ngramChangesNew;
+
+		// Index entries of the old tree, valid only for the tree revision that they were collected from
+		ShareNgramIndex::ChangeList ngramChangesOld;
+		vector<const Directory*> removedDirs;
+		vector<const Directory::File*> removedFiles;
+		uint64_t removedContentRevision = 0;
 
 		string path;
 
-		void mergeRefreshChanges(Directory::MultiMap& aDirNameMap, Directory::Map& aRootPaths, HashFileMap& aTTHIndex, int64_t& totalHash, int64_t& totalAdded, ProfileTokenSet* dirtyProfiles) noexcept;
+		// Collect the n-grams of the new tree (the tree must not be accessed by other threads yet)
+		void prepareNgramChanges() noexcept;
+
+		// Collect the index entries of the old tree (the caller must hold a read lock)
+		void prepareRemovedContent(uint64_t aTreeRevision) noexcept;
+
+		void mergeRefreshChanges(Directory::MultiMap& aDirNameMap, Directory::Map& aRootPaths, HashFileMap& aTTHIndex, ShareNgramIndex& aNgramIndex, int64_t& totalHash, int64_t& totalAdded, ProfileTokenSet* dirtyProfiles) noexcept;
 	};
 
 	typedef shared_ptr<RefreshInfo> RefreshInfoPtr;
@@ -627,8 +871,28 @@ private:
 	// Safe to call with non-root directories
 	void setRefreshState(const string& aPath, RefreshState aState, bool aUpdateRefreshTime) noexcept;
 
+	struct TreeBuildDir {
+		string path;
+		string pathLower;
+		Directory::Ptr directory;
+		Directory::Ptr oldDirectory;
+	};
+
+	typedef vector<TreeBuildDir> TreeBuildDirList;
+
 	// Recursive function for building a new share tree from a path
-	void buildTree(const string& aPath, const string& aPathLower, const Directory::Ptr& aDir, Directory::MultiMap& directoryNameMapNew_, int64_t& hashSize_, int64_t& addedSize_, HashFileMap& tthIndexNew_, ShareBloom& bloomNew_);
+	// If the old directory is given, content of complete directories with an unchanged modification date is copied from the old tree
+	// and files with an unchanged size and modification date are copied from the old tree in listed directories (fast refresh)
+	// If the list of pending directories is given, the created subdirectories are added in there instead of being scanned recursively
+	void buildTree(const string& aPath, const string& aPathLower, const Directory::Ptr& aDir, Directory::MultiMap& directoryNameMapNew_, int64_t& hashSize_, int64_t& addedSize_, HashFileMap& tthIndexNew_, ShareBloom& bloomNew_, 
+		const Directory::Ptr& aOldDir = nullptr, TreeBuildDirList* pendingDirs_ = nullptr);
+
+	// Add a subdirectory for the tree
+	void buildTreeDirectory(const string& aParentPath, const string& aParentPathLower, const Directory::Ptr& aParent, const string& aName, uint64_t aLastWrite, Directory::MultiMap& directoryNameMapNew_, int64_t& hashSize_, int64_t& addedSize_, HashFileMap& tthIndexNew_, ShareBloom& bloomNew_, 
+		const Directory::Ptr& aOldDir, TreeBuildDirList* pendingDirs_);
+
+	// Scan the directories of each tree level in parallel (the results of each thread are merged at the end)
+	void buildTreeParallel(const string& aPath, const string& aPathLower, const Directory::Ptr& aDir, Directory::MultiMap& directoryNameMapNew_, int64_t& hashSize_, int64_t& addedSize_, HashFileMap& tthIndexNew_, ShareBloom& bloomNew_, const Directory::Ptr& aOldDir = nullptr);
 
 	void addFile(const string& aName, Directory::Ptr& aDir, const HashedFile& fi, ProfileTokenSet& dirtyProfiles_) noexcept;
 
@@ -638,6 +902,26 @@ private:
 	void cleanIndices(Directory& dir) noexcept;
 	void cleanIndices(Directory& dir, const Directory::File* f) noexcept;
 
+	// Removed n-grams are collected only if the list is given (pass nullptr if the changes have been collected beforehand)
+	void cleanDirectoryIndices(Directory& dir, ShareNgramIndex::ChangeList* removedNgrams_) noexcept;
+
+	// Remove the index entries collected with RefreshInfo::prepareRemovedContent
+	void removeIndices(const RefreshInfo& aInfo) noexcept;
+
+	// Add the files of a refreshed tree in the hash blooms
+	// Must be called while holding the tree write lock, otherwise a bloom created in between would miss the files
+	void addHashBlooms(const HashFileMap& aTTHIndex) noexcept;
+
+	// Get the n-gram index entries for the directory name and its files
+	static void getNgramChanges(const Directory& aDir, ShareNgramIndex::ChangeList& changes_, bool aRecursive) noexcept;
+
+	// Add n-grams of a new directory item in the index (pass the directory name for directories)
+	void addNgrams(const Directory& aDir, const string& aNameLower) noexcept;
+
+	// Remove n-grams of a directory item (or the directory name if aFile isn't set) that aren't used by other items of the directory
+	// Should be called before the item is removed or renamed
+	void removeNgrams(const Directory& aDir, const Directory::File* aFile) noexcept;
+
 	static void addDirName(const Directory::Ptr& dir, Directory::MultiMap& aDirNames, ShareBloom& aBloom) noexcept;
 	static void removeDirName(const Directory& dir, Directory::MultiMap& aDirNames) noexcept;
 
@@ -0,0 +1,344 @@
+/*
+ * Copyright (C) 2011-2016 AirDC++ Project
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+#include "stdinc.h"
+#include "ShareSearchBenchmark.h"
+
+#include "CompactShareTree.h"
+#include "ScopedFunctor.h"
+#include "SearchQuery.h"
+#include "SearchResult.h"
+#include "SettingsManager.h"
+#include "ShareManager.h"
+#include "TimerManager.h"
+#include "Util.h"
+
+namespace dcpp {
+
+// Number of share items that are sampled for generating the benchmark queries
+#define SEARCH_BENCHMARK_SAMPLES 5000
+
+// Layout of the synthetic share (files per directory and directories per group directory)
+#define SEARCH_BENCHMARK_DIR_FILES 20
+#define SEARCH_BENCHMARK_GROUP_DIRS 50
+
+void ShareSearchBenchmark::addSyntheticRoot(ShareManager& aShare, size_t aFiles) noexcept {
+	typedef ShareManager::Directory Directory;
+
+	// The path is never accessed
+	auto path = Util::getTempPath() + "AirDC++ search benchmark" + PATH_SEPARATOR;
+
+	Directory::Ptr root = nullptr;
+	{
+		ShareManager::TreeWLock l(aShare);
+		auto profileDir = ShareManager::ProfileDirectory::create(path, "Search benchmark", { SETTING(DEFAULT_SP) }, false, aShare.profileDirs);
+		root = Directory::createRoot(Util::getLastDir(path), 0, profileDir, aShare.rootPaths, aShare.lowerDirNameMap, *aShare.bloom.get());
+		aShare.addNgrams(*root, root->getVirtualNameLower());
+	}
+
+	// Build the content like in a refresh
+	ShareManager::RefreshInfo ri(path, root, GET_TIME(), *aShare.bloom.get());
+
+	static const char* words[] = {
+		"alpha", "amber", "autumn", "blue", "broken", "city", "cold", "dance", "dark", "dream",
+		"echo", "electric", "empire", "fire", "forest", "ghost", "gold", "green", "heart", "highway",
+		"island", "last", "light", "love", "midnight", "mirror", "moon", "night", "ocean", "paper",
+		"radio", "river", "road", "shadow", "silver", "sky", "stone", "storm", "summer", "sun",
+		"tiger", "time", "violet", "water", "white", "wild", "winter", "wolf", "world", "young"
+	};
+
+	static const char* extensions[] = { "mp3", "flac", "mkv", "avi", "mp4", "jpg", "png", "nfo", "sfv", "rar", "zip", "iso", "pdf", "epub", "txt" };
+
+	auto getWord = [] { return string(words[Util::rand(sizeof(words) / sizeof(words[0]))]); };
+
+	Directory::Ptr group = nullptr, dir = nullptr;
+	for (size_t i = 0; i < aFiles; ++i) {
+		if (i % (SEARCH_BENCHMARK_DIR_FILES * SEARCH_BENCHMARK_GROUP_DIRS) == 0) {
+			auto name = getWord() + " " + getWord() + " " + Util::toString(i / (SEARCH_BENCHMARK_DIR_FILES * SEARCH_BENCHMARK_GROUP_DIRS));
+			group = Directory::createNormal(DualString(name), ri.newShareDirectory, GET_TIME(), ri.lowerDirNameMapNew, *aShare.bloom.get());
+		}
+
+		if (i % SEARCH_BENCHMARK_DIR_FILES == 0) {
+			auto name = getWord() + "_" + getWord() + "-" + getWord() + "_" + getWord() + "-" + Util::toString(1990 + Util::rand(30)) + "-" + Util::toString(i / SEARCH_BENCHMARK_DIR_FILES);
+			dir = Directory::createNormal(DualString(name), group, GET_TIME(), ri.lowerDirNameMapNew, *aShare.bloom.get());
+		}
+
+		auto num = i % SEARCH_BENCHMARK_DIR_FILES + 1;
+		auto name = (num < 10 ? "0" : "") + Util::toString(num) + "-" + getWord() + "_" + getWord() + "." + extensions[Util::rand(sizeof(extensions) / sizeof(extensions[0]))];
+
+		uint8_t tth[TTHValue::BYTES];
+		for (auto& b : tth) {
+			b = static_cast<uint8_t>(Util::rand(256));
+		}
+
+		auto pos = dir->files.insert_sorted(new Directory::File(DualString(name), dir, HashedFile(TTHValue(tth), GET_TIME(), 1024 * 1024 + Util::rand(100 * 1024 * 1024))));
+		ShareManager::updateIndices(*dir, *pos.first, *aShare.bloom.get(), ri.addedSize, ri.tthIndexNew);
+	}
+
+	ri.prepareNgramChanges();
+
+	{
+		RLock l(aShare.cs);
+		ri.prepareRemovedContent(aShare.treeRevision);
+	}
+
+	ShareManager::ShareNgramIndex::sortChanges(ri.ngramChangesOld);
+
+	{
+		int64_t hashSize = 0;
+		ShareManager::TreeWLock l(aShare);
+		aShare.applyRefreshChanges(ri, hashSize, nullptr);
+	}
+}
+
+string ShareSearchBenchmark::run(size_t aSearches, size_t aSyntheticFiles) noexcept {
+	if (aSyntheticFiles == 0) {
+		return runSearches(*ShareManager::getInstance(), aSearches, "own share");
+	}
+
+	// The generated files are shared only in a private tree so that the benchmark won't affect the own share
+	// (hash blooms, events, file lists...)
+	ShareManager share(false);
+	addSyntheticRoot(share, aSyntheticFiles);
+	return runSearches(share, aSearches, boost::str(boost::format("private share with %d generated files") % aSyntheticFiles));
+}
+
+string ShareSearchBenchmark::runSearches(ShareManager& aShare, size_t aSearches, const string& aShareDescription) noexcept {
+	struct SampleFile {
+		string name;
+		string parentName;
+		TTHValue tth;
+	};
+
+	// Cached results would make repeated queries unrealistically fast
+	aShare.searchCache.setEnabled(false);
+	ScopedFunctor([&] { aShare.searchCache.setEnabled(true); });
+
+	// Pick random items from the share (reservoir sampling)
+	vector<SampleFile> files;
+	StringList directories;
+
+	{
+		RLock l(aShare.cs);
+		size_t n = 0;
+		for (const auto& f : aShare.tthIndex | map_values) {
+			auto pos = n < SEARCH_BENCHMARK_SAMPLES ? n : Util::rand(static_cast<uint32_t>(n + 1));
+			n++;
+
+			if (pos < files.size()) {
+				files[pos] = { f->name.getLower(), f->getParent()->realName.getLower(), f->getTTH() };
+			} else if (pos == files.size()) {
+				files.push_back({ f->name.getLower(), f->getParent()->realName.getLower(), f->getTTH() });
+			}
+		}
+
+		n = 0;
+		for (const auto& d : aShare.lowerDirNameMap | map_keys) {
+			auto pos = n < SEARCH_BENCHMARK_SAMPLES ? n : Util::rand(static_cast<uint32_t>(n + 1));
+			n++;
+
+			if (pos < directories.size()) {
+				directories[pos] = *d;
+			} else if (pos == directories.size()) {
+				directories.push_back(*d);
+			}
+		}
+	}
+
+	if (files.empty() || directories.empty()) {
+		return "No files shared";
+	}
+
+	auto getToken = [](const string& aName) {
+		StringList tokens;
+		string::size_type start = 0;
+		for (string::size_type i = 0; i <= aName.size(); ++i) {
+			if (i == aName.size() || !isalnum(static_cast<unsigned char>(aName[i]))) {
+				if (i - start >= 3) {
+					tokens.push_back(aName.substr(start, i - start));
+				}
+				start = i + 1;
+			}
+		}
+
+		return tokens.empty() ? aName : tokens[Util::rand(static_cast<uint32_t>(tokens.size()))];
+	};
+
+	enum QueryType {
+		QUERY_TTH,
+		QUERY_PARTIAL_PATH,
+		QUERY_DIRECTORY_EXACT,
+		QUERY_EXTENSION,
+		QUERY_EXCLUDED,
+		QUERY_NO_MATCH,
+		QUERY_LAST
+	};
+
+	const char* queryNames[QUERY_LAST] = { "TTH", "Partial path", "Exact directory", "Extension", "Excluded terms", "No matches" };
+
+	// Percentage of each query type (TTH searches are the most common ones in ADC hubs)
+	const int queryWeights[QUERY_LAST] = { 40, 25, 10, 10, 10, 5 };
+
+	auto getQueryType = [&queryWeights] {
+		auto r = static_cast<int>(Util::rand(100));
+		for (int i = 0; i < QUERY_LAST; ++i) {
+			r -= queryWeights[i];
+			if (r < 0) {
+				return static_cast<QueryType>(i);
+			}
+		}
+
+		return QUERY_NO_MATCH;
+	};
+
+	// Generate the queries first so that they won't affect the timings
+	vector<pair<QueryType, StringList>> queries;
+	for (size_t i = 0; i < aSearches; ++i) {
+		const auto& f = files[Util::rand(static_cast<uint32_t>(files.size()))];
+
+		StringList params;
+		auto type = getQueryType();
+		switch (type) {
+			case QUERY_TTH: {
+				params.push_back("TR" + f.tth.toBase32());
+				break;
+			}
+			case QUERY_PARTIAL_PATH: {
+				params.push_back("AN" + getToken(f.parentName));
+				params.push_back("AN" + getToken(f.name));
+				break;
+			}
+			case QUERY_DIRECTORY_EXACT: {
+				params.push_back("TY" + Util::toString(SearchQuery::TYPE_DIRECTORY));
+				params.push_back("MT" + Util::toString(Search::MATCH_NAME_EXACT));
+				params.push_back("AN" + directories[Util::rand(static_cast<uint32_t>(directories.size()))]);
+				break;
+			}
+			case QUERY_EXTENSION: {
+				params.push_back("AN" + getToken(f.parentName));
+				auto ext = Util::getFileExt(f.name);
+				if (ext.size() > 1) {
+					params.push_back("EX" + ext.substr(1));
+				}
+				break;
+			}
+			case QUERY_EXCLUDED: {
+				params.push_back("AN" + getToken(f.name));
+				params.push_back("NO" + getToken(files[Util::rand(static_cast<uint32_t>(files.size()))].name));
+				break;
+			}
+			case QUERY_NO_MATCH:
+			default: {
+				params.push_back("AN" + Util::toString(Util::rand()) + "xq");
+				break;
+			}
+		}
+
+		queries.emplace_back(type, move(params));
+	}
+
+	auto getPercentile = [](vector<uint64_t>& aValues, double aPercentile) -> uint64_t {
+		if (aValues.empty()) {
+			return 0;
+		}
+
+		auto pos = min(static_cast<size_t>(static_cast<double>(aValues.size()) * aPercentile), aValues.size() - 1);
+		nth_element(aValues.begin(), aValues.begin() + pos, aValues.end());
+		return aValues[pos];
+	};
+
+	// Run the searches with the wanted tree
+	auto profile = SETTING(DEFAULT_SP);
+	auto runQueries = [&](const string& aTitle, function<void (SearchResultList&, SearchQuery&)> aSearchF) {
+		vector<uint64_t> latencies;
+		vector<uint64_t> typeLatencies[QUERY_LAST];
+		size_t totalResults = 0;
+
+		auto start = std::chrono::steady_clock::now();
+		for (const auto& q : queries) {
+			auto searchStart = std::chrono::steady_clock::now();
+
+			SearchResultList results;
+			SearchQuery query(q.second, 10);
+			try {
+				aSearchF(results, query);
+			} catch (const ShareException&) {
+				// Not possible with the root path
+			}
+
+			auto micros = static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - searchStart).count());
+			latencies.push_back(micros);
+			typeLatencies[q.first].push_back(micros);
+			totalResults += results.size();
+		}
+
+		auto totalMicros = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+
+		string ret = boost::str(boost::format(
+"\r\n%s:\r\n\
+Searches: %d (%d per second)\r\n\
+Latency: %d us (median), %d us (99th percentile), %d us (max)\r\n\
+Average results per search: %.2f\r\n")
+
+			% aTitle
+			% queries.size() % (totalMicros == 0 ? 0 : static_cast<double>(queries.size()) * 1000000.00 / static_cast<double>(totalMicros))
+			% getPercentile(latencies, 0.5) % getPercentile(latencies, 0.99) % (latencies.empty() ? 0 : *max_element(latencies.begin(), latencies.end()))
+			% (queries.empty() ? 0 : static_cast<double>(totalResults) / static_cast<double>(queries.size()))
+		);
+
+		ret += "Per query type (searches, median, 99th percentile):\r\n";
+		for (int i = 0; i < QUERY_LAST; ++i) {
+			ret += boost::str(boost::format("%s: %d, %d us, %d us\r\n") % queryNames[i] % typeLatencies[i].size() % getPercentile(typeLatencies[i], 0.5) % getPercentile(typeLatencies[i], 0.99));
+		}
+
+		return ret;
+	};
+
+	auto shareResults = runQueries("Share tree", [&](SearchResultList& results_, SearchQuery& aQuery) {
+		aShare.adcSearch(results_, aQuery, profile, CID(), "/", false);
+	});
+
+	// The same queries with the compact tree (no search index or caches)
+	auto compactTree = aShare.buildCompactTree();
+	auto compactResults = runQueries("Compact tree", [&](SearchResultList& results_, SearchQuery& aQuery) {
+		compactTree->search(results_, aQuery, profile, "/");
+	});
+
+	auto fileCount = static_cast<double>(compactTree->getFileCount());
+	auto shareMemory = aShare.getMemoryUsage();
+	auto compactMemory = compactTree->getMemoryUsage();
+
+	string ret = boost::str(boost::format(
+"\r\n\r\n-=[ Search benchmark ]=-\r\n\r\n\
+Share: %s\r\n\
+Sampled items: %d files, %d directories\r\n\
+Memory usage of the share tree: %s (%d bytes per file)\r\n\
+Memory usage of the compact tree: %s (%d bytes per file)\r\n")
+
+		% aShareDescription
+		% files.size() % directories.size()
+		% Util::formatBytes(shareMemory) % (static_cast<double>(shareMemory) / fileCount)
+		% Util::formatBytes(compactMemory) % (static_cast<double>(compactMemory) / fileCount)
+	);
+
+	ret += shareResults;
+	ret += compactResults;
+	return ret;
+}
+
+} // namespace dcpp
@@ -0,0 +1,45 @@
+/*
+ * Copyright (C) 2011-2016 AirDC++ Project
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+#ifndef DCPLUSPLUS_DCPP_SHARE_SEARCH_BENCHMARK_H
+#define DCPLUSPLUS_DCPP_SHARE_SEARCH_BENCHMARK_H
+
+#include "typedefs.h"
+
+namespace dcpp {
+
+class ShareManager;
+
+/* Runs generated searches against a share tree and its compact copy and reports the search rate, latencies and memory usage (debug) */
+class ShareSearchBenchmark {
+public:
+	// Run the wanted number of searches against the own share (the queries are generated from sampled share items)
+	// If synthetic files are wanted, the searches are run against a private share tree with the given number of generated files instead
+	// The own share is never modified
+	// Returns a printable report
+	static string run(size_t aSearches, size_t aSyntheticFiles = 0) noexcept;
+private:
+	// Fill a private share with a generated directory tree that doesn't exist on disk
+	static void addSyntheticRoot(ShareManager& aShare, size_t aFiles) noexcept;
+
+	static string runSearches(ShareManager& aShare, size_t aSearches, const string& aShareDescription) noexcept;
+};
+
+} // namespace dcpp
+
+#endif // !defined(DCPLUSPLUS_DCPP_SHARE_SEARCH_BENCHMARK_H)
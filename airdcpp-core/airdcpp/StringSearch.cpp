@@ -89,13 +89,18 @@ size_t StringSearch::Pattern::matchLower(const string& aText, int aStartPos) con
 
 
 void StringSearch::addString(const string& aStr) {
-	if (!aStr.empty())
-		patterns.emplace_back(Text::toLower(aStr));
+	if (aStr.empty())
+		return;
+
+	// Never modify the shared list, the copies may be used by other threads
+	auto newPatterns = make_shared<PatternList>(*patterns);
+	newPatterns->emplace_back(Text::toLower(aStr));
+	patterns = move(newPatterns);
 }
 
 bool StringSearch::match_all(const string& aText) const {
 	auto text = Text::toLower(aText);
-	for (const auto& p : patterns) {
+	for (const auto& p : *patterns) {
 		if (p.matchLower(text) == string::npos) {
 			return false;
 		}
@@ -105,7 +110,7 @@ bool StringSearch::match_all(const string& aText) const {
 }
 
 bool StringSearch::match_any_lower(const string& aText) const {
-	for (const auto& p : patterns) {
+	for (const auto& p : *patterns) {
 		if (p.matchLower(aText) != string::npos) {
 			return true;
 		}
@@ -120,7 +125,7 @@ bool StringSearch::match_any(const string& aText) const {
 
 int StringSearch::matchLower(const string& aText, bool aResumeOnNoMatch, ResultList* results_) const {
 	int matches = 0, listPos = 0;
-	for (const auto& p: patterns) {
+	for (const auto& p: *patterns) {
 		size_t addPos = string::npos;
 		for (;;) {
 			size_t curPos = p.matchLower(aText, addPos == string::npos ? 0 : addPos + 1);
@@ -158,7 +163,7 @@ int StringSearch::matchLower(const string& aText, bool aResumeOnNoMatch, ResultL
 }
 
 void StringSearch::clear() {
-	patterns.clear();
+	patterns = make_shared<PatternList>();
 }
 
 }
\ No newline at end of file
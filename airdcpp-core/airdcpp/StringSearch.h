@@ -72,11 +72,12 @@ public:
 	void addString(const string& aPattern);
 	void clear();
 
-	inline size_t count() const { return patterns.size(); }
-	inline bool empty() const { return patterns.empty(); }
-	inline const PatternList& getPatterns() const { return patterns; }
+	inline size_t count() const { return patterns->size(); }
+	inline bool empty() const { return patterns->empty(); }
+	inline const PatternList& getPatterns() const { return *patterns; }
 private:
-	PatternList patterns;
+	// Copies share the same immutable patterns (adding a pattern creates a new list)
+	shared_ptr<const PatternList> patterns = make_shared<PatternList>();
 };
 
 } // namespace dcpp
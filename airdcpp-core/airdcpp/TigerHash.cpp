@@ -42,6 +42,19 @@
 #define TIGER_ARCH64
 #endif
 
+// Multi-buffer compression with AVX2/AVX-512 (selected at runtime)
+#if (defined(_M_X64) || defined(__amd64__) || defined(__x86_64__)) && (defined(_MSC_VER) || defined(__GNUC__))
+#define TIGER_SIMD
+
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#define TIGER_TARGET(x)
+#else
+#define TIGER_TARGET(x) __attribute__((target(x)))
+#endif
+#endif
+
 namespace dcpp {
 
 #define PASSES 3
@@ -249,6 +262,259 @@ uint8_t* TigerHash::finalize() {
 	return getResult();
 }
 
+#ifdef TIGER_SIMD
+
+// The message words and states are stored with one row per word so that each row contains the word of all lanes
+#define MAX_LANES 8
+
+#define vround(a,b,c,x,mul) \
+	c = VXOR(c, x); \
+	a = VSUB(a, VXOR(VXOR(VGATHER(t1, VBYTE(c, 0)), VGATHER(t2, VBYTE(c, 2))), \
+	     VXOR(VGATHER(t3, VBYTE(c, 4)), VGATHER(t4, VBYTE(c, 6))))); \
+	b = VADD(b, VXOR(VXOR(VGATHER(t4, VBYTE(c, 1)), VGATHER(t3, VBYTE(c, 3))), \
+	     VXOR(VGATHER(t2, VBYTE(c, 5)), VGATHER(t1, VBYTE(c, 7))))); \
+	b = vmul_##mul(b);
+
+#define vmul_5(b) VADD(VSLL(b, 2), b)
+#define vmul_7(b) VSUB(VSLL(b, 3), b)
+#define vmul_9(b) VADD(VSLL(b, 3), b)
+
+#define VBYTE(c, n) VAND(VSRL(c, (n)*8), mask)
+#define VNOT(x) VXOR(x, ones)
+
+#define vpass(a,b,c,mul) \
+	vround(a,b,c,x0,mul) \
+	vround(b,c,a,x1,mul) \
+	vround(c,a,b,x2,mul) \
+	vround(a,b,c,x3,mul) \
+	vround(b,c,a,x4,mul) \
+	vround(c,a,b,x5,mul) \
+	vround(a,b,c,x6,mul) \
+	vround(b,c,a,x7,mul)
+
+#define vkey_schedule \
+	x0 = VSUB(x0, VXOR(x7, VSET1(_ULL(0xA5A5A5A5A5A5A5A5)))); \
+	x1 = VXOR(x1, x0); \
+	x2 = VADD(x2, x1); \
+	x3 = VSUB(x3, VXOR(x2, VSLL(VNOT(x1), 19))); \
+	x4 = VXOR(x4, x3); \
+	x5 = VADD(x5, x4); \
+	x6 = VSUB(x6, VXOR(x5, VSRL(VNOT(x4), 23))); \
+	x7 = VXOR(x7, x6); \
+	x0 = VADD(x0, x7); \
+	x1 = VSUB(x1, VXOR(x0, VSLL(VNOT(x7), 19))); \
+	x2 = VXOR(x2, x1); \
+	x3 = VADD(x3, x2); \
+	x4 = VSUB(x4, VXOR(x3, VSRL(VNOT(x2), 23))); \
+	x5 = VXOR(x5, x4); \
+	x6 = VADD(x6, x5); \
+	x7 = VSUB(x7, VXOR(x6, VSET1(_ULL(0x0123456789ABCDEF))));
+
+#define vcompress_lanes(words, state) \
+{ \
+	const VEC mask = VSET1(0xFF); \
+	const VEC ones = VSET1(~_ULL(0)); \
+	\
+	VEC a = VLOAD(state), b = VLOAD(state + MAX_LANES), c = VLOAD(state + MAX_LANES * 2); \
+	VEC aa = a, bb = b, cc = c; \
+	\
+	VEC x0 = VLOAD(words), x1 = VLOAD(words + MAX_LANES), x2 = VLOAD(words + MAX_LANES * 2), x3 = VLOAD(words + MAX_LANES * 3), \
+		x4 = VLOAD(words + MAX_LANES * 4), x5 = VLOAD(words + MAX_LANES * 5), x6 = VLOAD(words + MAX_LANES * 6), x7 = VLOAD(words + MAX_LANES * 7); \
+	\
+	vpass(a,b,c,5) \
+	vkey_schedule \
+	vpass(c,a,b,7) \
+	vkey_schedule \
+	vpass(b,c,a,9) \
+	\
+	VSTORE(state, VXOR(a, aa)); \
+	VSTORE(state + MAX_LANES, VSUB(b, bb)); \
+	VSTORE(state + MAX_LANES * 2, VADD(c, cc)); \
+}
+
+#define VEC __m256i
+#define VLOAD(p) _mm256_loadu_si256((const __m256i*)(p))
+#define VSTORE(p, x) _mm256_storeu_si256((__m256i*)(p), x)
+#define VSET1(x) _mm256_set1_epi64x((long long)(x))
+#define VXOR(a, b) _mm256_xor_si256(a, b)
+#define VAND(a, b) _mm256_and_si256(a, b)
+#define VADD(a, b) _mm256_add_epi64(a, b)
+#define VSUB(a, b) _mm256_sub_epi64(a, b)
+#define VSLL(a, n) _mm256_slli_epi64(a, n)
+#define VSRL(a, n) _mm256_srli_epi64(a, n)
+#define VGATHER(t, idx) _mm256_i64gather_epi64((const long long*)(t), idx, 8)
+
+TIGER_TARGET("avx2") static void tigerCompressAVX2(const uint64_t* table, const uint64_t* words, uint64_t* state) {
+	vcompress_lanes(words, state);
+}
+
+#undef VEC
+#undef VLOAD
+#undef VSTORE
+#undef VSET1
+#undef VXOR
+#undef VAND
+#undef VADD
+#undef VSUB
+#undef VSLL
+#undef VSRL
+#undef VGATHER
+
+#define VEC __m512i
+#define VLOAD(p) _mm512_loadu_si512((const void*)(p))
+#define VSTORE(p, x) _mm512_storeu_si512((void*)(p), x)
+#define VSET1(x) _mm512_set1_epi64((long long)(x))
+#define VXOR(a, b) _mm512_xor_si512(a, b)
+#define VAND(a, b) _mm512_and_si512(a, b)
+#define VADD(a, b) _mm512_add_epi64(a, b)
+#define VSUB(a, b) _mm512_sub_epi64(a, b)
+#define VSLL(a, n) _mm512_slli_epi64(a, n)
+#define VSRL(a, n) _mm512_srli_epi64(a, n)
+#define VGATHER(t, idx) _mm512_i64gather_epi64(idx, (const void*)(t), 8)
+
+TIGER_TARGET("avx512f") static void tigerCompressAVX512(const uint64_t* table, const uint64_t* words, uint64_t* state) {
+	vcompress_lanes(words, state);
+}
+
+#undef VEC
+#undef VLOAD
+#undef VSTORE
+#undef VSET1
+#undef VXOR
+#undef VAND
+#undef VADD
+#undef VSUB
+#undef VSLL
+#undef VSRL
+#undef VGATHER
+
+typedef void(*MultiCompressF)(const uint64_t* table, const uint64_t* words, uint64_t* state);
+
+struct MultiCompressor {
+	MultiCompressF compressLanes;
+	size_t lanes;
+};
+
+static MultiCompressor getMultiCompressor() {
+#ifdef _MSC_VER
+	int info[4];
+	__cpuid(info, 0);
+	if (info[0] >= 7) {
+		__cpuid(info, 1);
+		bool osxsave = (info[2] & (1 << 27)) != 0;
+
+		__cpuidex(info, 7, 0);
+		if (osxsave) {
+			// The OS must save the YMM (and ZMM/opmask) registers
+			auto xcr0 = _xgetbv(0);
+			if ((info[1] & (1 << 16)) && (xcr0 & 0xE6) == 0xE6) {
+				return { tigerCompressAVX512, 8 };
+			}
+
+			if ((info[1] & (1 << 5)) && (xcr0 & 0x6) == 0x6) {
+				return { tigerCompressAVX2, 4 };
+			}
+		}
+	}
+#else
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx512f")) {
+		return { tigerCompressAVX512, 8 };
+	}
+
+	if (__builtin_cpu_supports("avx2")) {
+		return { tigerCompressAVX2, 4 };
+	}
+#endif
+
+	return { nullptr, 1 };
+}
+
+#endif
+
+void TigerHash::hashMultiple(uint8_t aPrefix, const uint8_t* aData, size_t aLen, size_t aCount, uint8_t* results_) {
+	size_t lanes = 1;
+
+#ifdef TIGER_SIMD
+	static const auto compressor = getMultiCompressor();
+	lanes = compressor.lanes;
+#endif
+
+	size_t i = 0;
+
+#ifdef TIGER_SIMD
+	const uint64_t totalLen = aLen + 1;
+	const size_t blocks = static_cast<size_t>((totalLen + sizeof(uint64_t)) / BLOCK_SIZE + 1);
+
+	uint64_t words[8 * MAX_LANES];
+	uint64_t state[3 * MAX_LANES];
+	uint8_t block[BLOCK_SIZE];
+
+	// A single remaining message is left for the scalar version
+	for (; lanes > 1 && i + 1 < aCount; i += lanes) {
+		auto groupLanes = min(lanes, aCount - i);
+
+		for (size_t l = 0; l < lanes; ++l) {
+			state[l] = _ULL(0x0123456789ABCDEF);
+			state[MAX_LANES + l] = _ULL(0xFEDCBA9876543210);
+			state[MAX_LANES * 2 + l] = _ULL(0xF096A5B4C3B2E187);
+		}
+
+		for (size_t b = 0; b < blocks; ++b) {
+			const uint64_t blockPos = static_cast<uint64_t>(b) * BLOCK_SIZE;
+
+			// Unused lanes will hash the first message of the group
+			for (size_t l = 0; l < lanes; ++l) {
+				auto msg = aData + (i + (l < groupLanes ? l : 0)) * aLen;
+
+				const uint8_t* src = block;
+				if (blockPos + BLOCK_SIZE <= totalLen) {
+					if (b == 0) {
+						block[0] = aPrefix;
+						memcpy(block + 1, msg, BLOCK_SIZE - 1);
+					} else {
+						src = msg + blockPos - 1;
+					}
+				} else {
+					// Padding
+					memzero(block, BLOCK_SIZE);
+					for (uint64_t p = blockPos; p < totalLen && p < blockPos + BLOCK_SIZE; ++p) {
+						block[p - blockPos] = p == 0 ? aPrefix : msg[p - 1];
+					}
+
+					if (totalLen >= blockPos && totalLen < blockPos + BLOCK_SIZE) {
+						block[totalLen - blockPos] = 0x01;
+					}
+
+					if (b == blocks - 1) {
+						uint64_t bits = totalLen << 3;
+						memcpy(block + BLOCK_SIZE - sizeof(uint64_t), &bits, sizeof(uint64_t));
+					}
+				}
+
+				for (size_t w = 0; w < 8; ++w) {
+					memcpy(&words[w * MAX_LANES + l], src + w * sizeof(uint64_t), sizeof(uint64_t));
+				}
+			}
+
+			compressor.compressLanes(table, words, state);
+		}
+
+		for (size_t l = 0; l < groupLanes; ++l) {
+			uint64_t res[3] = { state[l], state[MAX_LANES + l], state[MAX_LANES * 2 + l] };
+			memcpy(results_ + (i + l) * BYTES, res, BYTES);
+		}
+	}
+#endif
+
+	for (; i < aCount; ++i) {
+		TigerHash h;
+		h.update(&aPrefix, 1);
+		h.update(aData + i * aLen, aLen);
+		memcpy(results_ + i * BYTES, h.finalize(), BYTES);
+	}
+}
+
 uint64_t TigerHash::table[4*256] = {
 	_ULL(0x02AAB17CF7E90C5E)   /*    0 */,    _ULL(0xAC424B03E243A8EC)   /*    1 */,
 		_ULL(0x72CD5BE30DD5FCD3)   /*    2 */,    _ULL(0x6D019B93F6F97F3A)   /*    3 */,
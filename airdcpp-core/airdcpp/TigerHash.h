@@ -57,6 +57,13 @@ public:
 	uint8_t* finalize();
 
 	uint8_t* getResult() { return (uint8_t*) res; }
+
+	/**
+	 * Calculates the hashes of aCount consecutive messages of aLen bytes, each one prefixed with aPrefix
+	 * (such as the Tiger tree leaves). The messages are compressed in parallel if the CPU supports AVX2/AVX-512.
+	 * @param results_ Space for aCount * BYTES bytes
+	 */
+	static void hashMultiple(uint8_t aPrefix, const uint8_t* aData, size_t aLen, size_t aCount, uint8_t* results_);
 private:
 	enum { BLOCK_SIZE = 512/8 };
 	/** 512 bit blocks for the compress function */
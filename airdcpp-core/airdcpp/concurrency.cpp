@@ -0,0 +1,149 @@
+/*
+ * Copyright (C) 2011-2016 AirDC++ Project
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+#include "stdinc.h"
+#include "concurrency.h"
+
+#if !defined(HAVE_INTEL_TBB) && !defined(_MSC_VER)
+
+#include "debug.h"
+
+namespace dcpp {
+
+// Index of the worker running in the current thread
+static thread_local size_t currentWorker = static_cast<size_t>(-1);
+
+WorkStealingPool& WorkStealingPool::getInstance() {
+	// The calling thread participates in parallel loops so leave one core for it
+	static WorkStealingPool pool(std::max(std::thread::hardware_concurrency(), 2U) - 1);
+	return pool;
+}
+
+WorkStealingPool::WorkStealingPool(size_t aThreads) {
+	for (size_t i = 0; i < aThreads; ++i) {
+		workers.emplace_back(new Worker);
+	}
+
+	for (size_t i = 0; i < aThreads; ++i) {
+		threads.emplace_back([this, i] { runWorker(i); });
+	}
+}
+
+WorkStealingPool::~WorkStealingPool() {
+	{
+		std::lock_guard<std::mutex> l(cs);
+		stopping = true;
+	}
+
+	taskAvailable.notify_all();
+	for (auto& t : threads) {
+		t.join();
+	}
+}
+
+void WorkStealingPool::run(Task&& aTask) {
+	if (workers.empty()) {
+		aTask();
+		return;
+	}
+
+	auto worker = currentWorker < workers.size() ? currentWorker : nextWorker++ % workers.size();
+
+	// Count the task before it can be popped
+	{
+		std::lock_guard<std::mutex> l(cs);
+		queuedTasks++;
+	}
+
+	{
+		std::lock_guard<std::mutex> l(workers[worker]->cs);
+		workers[worker]->tasks.push_back(move(aTask));
+	}
+
+	taskAvailable.notify_one();
+}
+
+bool WorkStealingPool::popTask(size_t aWorker, Task& task_) {
+	if (queuedTasks == 0) {
+		return false;
+	}
+
+	// Own tasks first (newest first)
+	if (aWorker < workers.size()) {
+		auto& w = *workers[aWorker];
+		std::lock_guard<std::mutex> l(w.cs);
+		if (!w.tasks.empty()) {
+			task_ = move(w.tasks.back());
+			w.tasks.pop_back();
+			queuedTasks--;
+			return true;
+		}
+	}
+
+	// Steal the oldest task from another worker
+	for (size_t i = 1; i <= workers.size(); ++i) {
+		auto& w = *workers[(aWorker + i) % workers.size()];
+		std::lock_guard<std::mutex> l(w.cs);
+		if (!w.tasks.empty()) {
+			task_ = move(w.tasks.front());
+			w.tasks.pop_front();
+			queuedTasks--;
+			return true;
+		}
+	}
+
+	return false;
+}
+
+bool WorkStealingPool::runPending() {
+	Task task;
+	if (!popTask(currentWorker < workers.size() ? currentWorker : 0, task)) {
+		return false;
+	}
+
+	task();
+	return true;
+}
+
+void WorkStealingPool::runWorker(size_t aWorker) {
+	currentWorker = aWorker;
+
+	for (;;) {
+		Task task;
+		if (popTask(aWorker, task)) {
+			try {
+				task();
+			} catch (...) {
+				// Tasks should handle their own exceptions
+				dcassert(0);
+			}
+
+			continue;
+		}
+
+		std::unique_lock<std::mutex> l(cs);
+		taskAvailable.wait(l, [this] { return stopping || queuedTasks > 0; });
+		if (stopping) {
+			return;
+		}
+	}
+}
+
+} // namespace dcpp
+
+#endif
@@ -73,8 +73,15 @@ public:
 
 #else
 
+#include <atomic>
+#include <condition_variable>
 #include <deque>
-#include "CriticalSection.h"
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
 
 namespace dcpp {
 
@@ -84,20 +91,206 @@ public:
 	~TaskScheduler() { }
 };
 
-#define parallel_for_each for_each
+// Thread pool with a separate task deque for each worker
+// Workers take the newest tasks from their own deque and steal the oldest ones from the others when idle
+class WorkStealingPool {
+public:
+	typedef std::function<void()> Task;
+
+	static WorkStealingPool& getInstance();
+	~WorkStealingPool();
+
+	// Queue a task (to the deque of the current thread when called from a worker)
+	void run(Task&& aTask);
+
+	// Run a single queued task in the calling thread
+	// Returns false if there were no queued tasks
+	bool runPending();
+
+	size_t getThreadCount() const { return threads.size(); }
+
+	WorkStealingPool(const WorkStealingPool&) = delete;
+	WorkStealingPool& operator=(const WorkStealingPool&) = delete;
+private:
+	WorkStealingPool(size_t aThreads);
+
+	struct Worker {
+		std::mutex cs;
+		std::deque<Task> tasks;
+	};
+
+	bool popTask(size_t aWorker, Task& task_);
+	void runWorker(size_t aWorker);
+
+	std::vector<std::unique_ptr<Worker>> workers;
+	std::vector<std::thread> threads;
+
+	std::atomic<size_t> nextWorker { 0 };
+	std::atomic<size_t> queuedTasks { 0 };
+
+	std::mutex cs;
+	std::condition_variable taskAvailable;
+	bool stopping = false;
+};
+
+// Calls the function for each item using the pool threads and the calling thread
+// The first exception thrown by the function is rethrown after all running calls have returned
+template<class IterT, class FuncT>
+void parallel_for_each(IterT aBegin, IterT aEnd, const FuncT& aFunc) {
+	struct State {
+		std::vector<IterT> items;
+		std::atomic<size_t> next { 0 };
+		const FuncT* func = nullptr;
+
+		std::mutex cs;
+		std::condition_variable finished;
+		size_t running = 0;
+		std::exception_ptr exception;
+
+		void process() {
+			for (;;) {
+				auto pos = next++;
+				if (pos >= items.size()) {
+					break;
+				}
+
+				try {
+					(*func)(*items[pos]);
+				} catch (...) {
+					std::lock_guard<std::mutex> l(cs);
+					if (!exception) {
+						exception = std::current_exception();
+					}
+
+					// Skip the remaining items
+					next = items.size();
+				}
+			}
+		}
+	};
+
+	auto state = std::make_shared<State>();
+	for (auto i = aBegin; i != aEnd; ++i) {
+		state->items.push_back(i);
+	}
+
+	state->func = &aFunc;
+
+	auto& pool = WorkStealingPool::getInstance();
+	auto helpers = std::min(pool.getThreadCount(), state->items.size() > 0 ? state->items.size() - 1 : 0);
+	for (size_t i = 0; i < helpers; ++i) {
+		pool.run([state] {
+			{
+				// The function may not exist anymore if all items have been processed
+				std::lock_guard<std::mutex> l(state->cs);
+				if (state->next >= state->items.size()) {
+					return;
+				}
+
+				state->running++;
+			}
+
+			state->process();
+
+			std::lock_guard<std::mutex> l(state->cs);
+			if (--state->running == 0) {
+				state->finished.notify_all();
+			}
+		});
+	}
+
+	state->process();
+
+	// Wait for the helpers that are still processing their last items
+	std::unique_lock<std::mutex> l(state->cs);
+	state->finished.wait(l, [&state] { return state->running == 0; });
+
+	if (state->exception) {
+		std::rethrow_exception(state->exception);
+	}
+}
+
+class task_group {
+public:
+	task_group() : state(std::make_shared<State>()) { }
+	~task_group() {
+		try {
+			wait();
+		} catch (...) {
+		}
+	}
+
+	template<class FuncT>
+	void run(const FuncT& aFunc) {
+		{
+			std::lock_guard<std::mutex> l(state->cs);
+			state->pending++;
+		}
+
+		auto s = state;
+		WorkStealingPool::getInstance().run([s, aFunc] {
+			try {
+				aFunc();
+			} catch (...) {
+				std::lock_guard<std::mutex> l(s->cs);
+				if (!s->exception) {
+					s->exception = std::current_exception();
+				}
+			}
+
+			std::lock_guard<std::mutex> l(s->cs);
+			if (--s->pending == 0) {
+				s->finished.notify_all();
+			}
+		});
+	}
+
+	// Helps with running the queued tasks while waiting so that nested groups won't block the pool
+	void wait() {
+		auto& pool = WorkStealingPool::getInstance();
+		for (;;) {
+			{
+				std::unique_lock<std::mutex> l(state->cs);
+				if (state->pending == 0) {
+					break;
+				}
+			}
+
+			if (!pool.runPending()) {
+				std::unique_lock<std::mutex> l(state->cs);
+				state->finished.wait_for(l, std::chrono::milliseconds(10), [this] { return state->pending == 0; });
+			}
+		}
+
+		std::exception_ptr e;
+		std::swap(e, state->exception);
+		if (e) {
+			std::rethrow_exception(e);
+		}
+	}
+private:
+	struct State {
+		std::mutex cs;
+		std::condition_variable finished;
+		size_t pending = 0;
+		std::exception_ptr exception;
+	};
+
+	std::shared_ptr<State> state;
+};
 
 	template <typename T>
 	class concurrent_queue {
 	public:
 		bool push(const T& t) {
-			WLock l(cs);
+			std::lock_guard<std::mutex> l(cs);
 			queue.push_back(t);
 			return true;
 		}
 
 		template <typename U>
 		bool try_pop(U& t) {
-			WLock l(cs);
+			std::lock_guard<std::mutex> l(cs);
 			if (!queue.empty()) {
 				t = std::move(queue.front());
 				queue.pop_front();
@@ -106,7 +299,7 @@ public:
 			return false;
 		}
 	private:
-		SharedMutex cs;
+		std::mutex cs;
 		std::deque<T> queue;
 	};
 }
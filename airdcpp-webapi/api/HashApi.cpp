@@ -77,11 +77,17 @@ namespace webserver {
 
 		HashManager::getInstance()->getStats(curFile, bytesLeft, filesLeft, speed, hashers);
 
+		int64_t readBytesInFlight = 0;
+		uint64_t readWaitTime = 0;
+		HashManager::getInstance()->getReadStats(readBytesInFlight, readWaitTime);
+
 		json j = {
 			{ "hash_speed", speed },
 			{ "hash_bytes_left", bytesLeft },
 			{ "hash_files_left", filesLeft },
 			{ "hashers", hashers },
+			{ "read_bytes_in_flight", readBytesInFlight },
+			{ "read_wait_time", readWaitTime },
 		};
 
 		if (previousStats == j)
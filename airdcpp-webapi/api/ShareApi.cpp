@@ -23,6 +23,7 @@
 
 #include <web-server/JsonUtil.h>
 
+#include <airdcpp/SearchManager.h>
 #include <airdcpp/ShareManager.h>
 #include <airdcpp/HubEntry.h>
 
@@ -31,6 +32,8 @@ namespace webserver {
 
 		METHOD_HANDLER("grouped_root_paths", Access::ANY, ApiRequest::METHOD_GET, (), false, ShareApi::handleGetGroupedRootPaths);
 		METHOD_HANDLER("stats", Access::ANY, ApiRequest::METHOD_GET, (), false, ShareApi::handleGetStats);
+		METHOD_HANDLER("search_stats", Access::ANY, ApiRequest::METHOD_GET, (), false, ShareApi::handleGetSearchStats);
+		METHOD_HANDLER("search_stats", Access::SETTINGS_EDIT, ApiRequest::METHOD_DELETE, (), false, ShareApi::handleClearSearchStats);
 		METHOD_HANDLER("find_dupe_paths", Access::ANY, ApiRequest::METHOD_POST, (), true, ShareApi::handleFindDupePaths);
 
 		METHOD_HANDLER("refresh", Access::SETTINGS_EDIT, ApiRequest::METHOD_POST, (), false, ShareApi::handleRefreshShare);
@@ -99,12 +102,74 @@ namespace webserver {
 			{ "average_file_age", stats.averageFileAge },
 			{ "profile_count", stats.profileCount },
 			{ "profile_root_count", stats.profileDirectoryCount},
+			{ "memory_usage", stats.memoryUsage },
+			{ "memory_per_file", stats.memoryPerFile },
+			{ "list_cache_hits", stats.listCacheHits },
+			{ "list_cache_misses", stats.listCacheMisses },
+			{ "list_cache_size", stats.listCacheSize },
 		};
 
 		aRequest.setResponseBody(j);
 		return websocketpp::http::status_code::ok;
 	}
 
+	json ShareApi::serializeSearchCounters(const SearchStatistics::Counters& aCounters) noexcept {
+		return {
+			{ "count", aCounters.count },
+			{ "average_time", aCounters.count == 0 ? 0 : aCounters.totalTime / aCounters.count },
+			{ "p50_time", aCounters.getLatencyPercentile(50) },
+			{ "p90_time", aCounters.getLatencyPercentile(90) },
+			{ "p99_time", aCounters.getLatencyPercentile(99) },
+			{ "max_time", aCounters.maxTime },
+			{ "average_queue_time", aCounters.count == 0 ? 0 : aCounters.totalQueueTime / aCounters.count },
+			{ "p50_queue_time", aCounters.getQueueLatencyPercentile(50) },
+			{ "p90_queue_time", aCounters.getQueueLatencyPercentile(90) },
+			{ "p99_queue_time", aCounters.getQueueLatencyPercentile(99) },
+			{ "max_queue_time", aCounters.maxQueueTime },
+			{ "average_results", aCounters.count == 0 ? 0 : static_cast<double>(aCounters.totalResults) / static_cast<double>(aCounters.count) },
+			{ "latency_histogram", aCounters.latencies },
+			{ "queue_latency_histogram", aCounters.queueLatencies },
+			{ "result_histogram", aCounters.results },
+		};
+	}
+
+	api_return ShareApi::handleGetSearchStats(ApiRequest& aRequest) {
+		auto stats = SearchManager::getInstance()->getSearchStatistics();
+		auto queueStats = SearchManager::getInstance()->getIncomingSearchStats();
+
+		json types;
+		for (int i = 0; i < SearchStatistics::QUERY_LAST; ++i) {
+			auto type = static_cast<SearchStatistics::QueryType>(i);
+			types[SearchStatistics::getQueryTypeStr(type)] = serializeSearchCounters(stats.types[i]);
+		}
+
+		auto hubs = json::array();
+		for (const auto& h : stats.hubs) {
+			auto hub = serializeSearchCounters(h.second);
+			hub["hub_url"] = h.first;
+			hubs.push_back(hub);
+		}
+
+		aRequest.setResponseBody({
+			// Times are in microseconds, the buckets list the inclusive upper bounds (the last bucket has no limit)
+			// Queue times are measured from receiving the search until its processing starts
+			{ "latency_buckets", SearchStatistics::latencyBuckets },
+			{ "result_buckets", SearchStatistics::resultBuckets },
+			{ "types", types },
+			{ "hubs", hubs },
+			{ "queued", queueStats.queued },
+			{ "processed", queueStats.processed },
+			{ "dropped", queueStats.dropped },
+		});
+
+		return websocketpp::http::status_code::ok;
+	}
+
+	api_return ShareApi::handleClearSearchStats(ApiRequest& aRequest) {
+		SearchManager::getInstance()->clearSearchStatistics();
+		return websocketpp::http::status_code::ok;
+	}
+
 	api_return ShareApi::handleGetGroupedRootPaths(ApiRequest& aRequest) {
 		auto ret = json::array();
 
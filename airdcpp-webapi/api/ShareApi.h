@@ -24,6 +24,7 @@
 #include <api/ApiModule.h>
 
 #include <airdcpp/typedefs.h>
+#include <airdcpp/SearchStatistics.h>
 #include <airdcpp/ShareManagerListener.h>
 
 namespace webserver {
@@ -41,6 +42,8 @@ namespace webserver {
 		api_return handleRefreshVirtual(ApiRequest& aRequest);
 
 		api_return handleGetStats(ApiRequest& aRequest);
+		api_return handleGetSearchStats(ApiRequest& aRequest);
+		api_return handleClearSearchStats(ApiRequest& aRequest);
 
 		api_return handleGetGroupedRootPaths(ApiRequest& aRequest);
 		api_return handleFindDupePaths(ApiRequest& aRequest);
@@ -50,6 +53,7 @@ namespace webserver {
 		void onShareRefreshed(const RefreshPathList& aRealPaths, uint8_t aTaskType) noexcept;
 
 		static string refreshTypeToString(uint8_t aTaskType) noexcept;
+		static json serializeSearchCounters(const SearchStatistics::Counters& aCounters) noexcept;
 	};
 }
 
@@ -28,6 +28,8 @@
 #include <airdcpp/FavoriteManager.h>
 #include <airdcpp/LogManager.h>
 #include <airdcpp/SettingsManager.h>
+#include <airdcpp/ShareManager.h>
+#include <airdcpp/ShareSearchBenchmark.h>
 #include <airdcpp/TimerManager.h>
 #include <airdcpp/UpdateManager.h>
 
@@ -91,6 +93,11 @@ bool Client::startup() {
 		[&](float aProgress) {}
 	);
 
+	if (Util::hasStartupParam("--benchmark-search") || Util::getStartupParam("--benchmark-search")) {
+		runSearchBenchmark();
+		return false;
+	}
+
 	if (Text::systemCharset.empty() || Text::systemCharset == "ANSI_X3.4-1968") {
 		LogManager::getInstance()->message("System encoding is not set. This will cause issues with non-ASCII characters.", LogMessage::SEV_ERROR);
 	}
@@ -137,6 +144,24 @@ bool Client::startup() {
 	return true;
 }
 
+void Client::runSearchBenchmark() {
+	auto searches = Util::getStartupParam("--benchmark-search");
+	auto count = searches ? Util::toInt(*searches) : 0;
+
+	auto files = Util::getStartupParam("--benchmark-files");
+	auto syntheticFiles = files ? Util::toInt(*files) : 0;
+
+	printf("Running search benchmark...\n");
+	printf("%s\n", ShareSearchBenchmark::run(count > 0 ? count : 10000, syntheticFiles > 0 ? syntheticFiles : 0).c_str());
+
+	dcpp::shutdown(
+		[](const string& aStr) { printf("%s\n", aStr.c_str()); },
+		[](float aProgress) {}
+	);
+
+	webserver::WebServerManager::deleteInstance();
+}
+
 void Client::shutdown() {
 	if (!started) {
 		return;
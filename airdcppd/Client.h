@@ -39,6 +39,9 @@ private:
 	bool startup();
 	void shutdown();
 
+	// Run searches against the loaded share and print the results (the client won't be started)
+	void runSearchBenchmark();
+
 	static std::string getDefaultNick() noexcept;
 
 	void on(DirectoryListingManagerListener::OpenListing, const DirectoryListingPtr& aList, const string& aDir, const string& aXML) noexcept;
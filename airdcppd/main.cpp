@@ -268,6 +268,8 @@ static void printUsage() {
 	printHelp("--no-auto-connect", 	"Don't connect to any favorite hub on startup");
 	printHelp("--cdm-hub", 					"Print all protocol communication with hubs in the console (debug)");
 	printHelp("--cdm-client", 			"Print all protocol communication with other clients in the console (debug)");
+	printHelp("--benchmark-search[=COUNT]", "Run the wanted number of searches against the own share, print the results and exit (debug)");
+	printHelp("--benchmark-files=COUNT", "Run the search benchmark against a private generated share with the wanted number of files instead of the own share (debug)");
 
 
 	cout << std::endl;